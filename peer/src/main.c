@@ -0,0 +1,155 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/* Simulated DUT for the BabbleSim scenarios (scripts/bsim): advertises connectably with a fixed identity, pairs with
+ * whoever connects and keeps the bond. Bond table size, IO capability, smallest key size and SC only mode are set
+ * with the PEER_* options. Every pairing prints one line, so the peer's side of a scenario can be read from its log.
+ */
+
+#include <zephyr/kernel.h>
+#include <stdio.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+
+static const struct bt_data ad[] = {
+	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+	BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME, sizeof(CONFIG_BT_DEVICE_NAME) - 1),
+};
+
+static unsigned int pairings;
+static unsigned int failures;
+
+static void advertise(struct k_work *work)
+{
+	int err = bt_le_adv_start(BT_LE_ADV_CONN_FAST_1, ad, ARRAY_SIZE(ad), NULL, 0);
+
+	if (err && err != -EALREADY) {
+		printf("peer: advertising failed (err %d)\n", err);
+	}
+}
+
+static K_WORK_DEFINE(adv_work, advertise);
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+	if (err) {
+		printf("peer: connection failed (err 0x%02x)\n", err);
+	}
+}
+
+static void recycled(void)
+{
+	k_work_submit(&adv_work);
+}
+
+static struct bt_conn_cb conn_callbacks = {
+	.connected = connected,
+	.recycled = recycled,
+};
+
+static void count_bond(const struct bt_bond_info *info, void *user_data)
+{
+	(*(int *)user_data)++;
+}
+
+static void pairing_complete(struct bt_conn *conn, bool bonded)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	int bonds = 0;
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	bt_foreach_bond(BT_ID_DEFAULT, count_bond, &bonds);
+
+	printf("peer: paired #%u with %s, level %d, key size %u, bonded %d, %d/%d bonds\n", ++pairings, addr,
+	       bt_conn_get_security(conn), bt_conn_enc_key_size(conn), bonded, bonds, CONFIG_BT_MAX_PAIRED);
+}
+
+static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	printf("peer: pairing #%u with %s failed, reason %d (%s)\n", ++failures, addr, reason,
+	       bt_security_err_to_str(reason));
+}
+
+static struct bt_conn_auth_info_cb auth_info_cb = {
+	.pairing_complete = pairing_complete,
+	.pairing_failed = pairing_failed,
+};
+
+#if !defined(CONFIG_PEER_IO_NONE)
+static void passkey_display(struct bt_conn *conn, unsigned int passkey)
+{
+	printf("peer: passkey %06u\n", passkey);
+}
+
+static void passkey_entry(struct bt_conn *conn)
+{
+	bt_conn_auth_passkey_entry(conn, CONFIG_PEER_PASSKEY);
+}
+
+static void passkey_confirm(struct bt_conn *conn, unsigned int passkey)
+{
+	bt_conn_auth_passkey_confirm(conn);
+}
+
+static void cancel(struct bt_conn *conn)
+{
+	printf("peer: pairing cancelled\n");
+}
+
+/* the host derives the IO capability from the callbacks that are set */
+static struct bt_conn_auth_cb auth_cb = {
+#if !defined(CONFIG_PEER_IO_KEYBOARD)
+	.passkey_display = passkey_display,
+#endif
+#if defined(CONFIG_PEER_IO_KEYBOARD) || defined(CONFIG_PEER_IO_KBDISPLAY)
+	.passkey_entry = passkey_entry,
+#endif
+#if defined(CONFIG_PEER_IO_YESNO) || defined(CONFIG_PEER_IO_KBDISPLAY)
+	.passkey_confirm = passkey_confirm,
+#endif
+	.cancel = cancel,
+};
+#endif
+
+int main(void)
+{
+	bt_addr_le_t addr;
+	int err;
+
+	err = bt_addr_le_from_str(CONFIG_PEER_ADDR, "random", &addr);
+	if (err) {
+		printf("peer: invalid PEER_ADDR %s\n", CONFIG_PEER_ADDR);
+		return err;
+	}
+
+	/* created before bt_enable, this is the default identity */
+	err = bt_id_create(&addr, NULL);
+	if (err < 0) {
+		printf("peer: setting the identity failed (err %d)\n", err);
+		return err;
+	}
+
+	err = bt_enable(NULL);
+	if (err) {
+		printf("peer: Bluetooth init failed (err %d)\n", err);
+		return err;
+	}
+
+	bt_conn_cb_register(&conn_callbacks);
+#if !defined(CONFIG_PEER_IO_NONE)
+	bt_passkey_set(CONFIG_PEER_PASSKEY);
+	bt_conn_auth_cb_register(&auth_cb);
+#endif
+	bt_conn_auth_info_cb_register(&auth_info_cb);
+
+	printf("peer: %s, %d bonds%s, key size >= %d%s\n", CONFIG_PEER_ADDR, CONFIG_BT_MAX_PAIRED,
+	       IS_ENABLED(CONFIG_BT_KEYS_OVERWRITE_OLDEST) ? " (oldest overwritten)" : "", CONFIG_BT_SMP_MIN_ENC_KEY_SIZE,
+	       IS_ENABLED(CONFIG_BT_SMP_SC_ONLY) ? ", SC only" : "");
+
+	k_work_submit(&adv_work);
+	return 0;
+}
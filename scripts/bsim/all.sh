@@ -0,0 +1,19 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# all.sh: every scenario, the output of one run is the performance baseline of a commit. It is also kept in
+# $BUILD_DIR/baseline_<commit>.txt, ready to be quoted in the commit message or compared with the one before.
+
+set -eu -o pipefail
+dir=$(dirname "$0")
+out_dir=${BUILD_DIR:-$(cd "${dir}/../.." && pwd)/build_bsim}
+out=${out_dir}/baseline_$(git -C "${dir}" rev-parse --short HEAD 2>/dev/null || echo unknown).txt
+
+mkdir -p "${out_dir}"
+{
+	echo "commit $(git -C "${dir}" describe --always --dirty 2>/dev/null || echo unknown)," \
+		"zephyr $(git -C "${ZEPHYR_BASE:-.}" describe --always 2>/dev/null || echo unknown)"
+	"${dir}/ifa.sh" "$@"
+	"${dir}/knob.sh"
+	"${dir}/scda.sh"
+} 2>&1 | tee "${out}"
@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# Shared part of the BabbleSim scenarios: builds the framework (central) and the simulated peer for nrf52_bsim, runs
+# both on the simulated radio and prints what the framework's shell reported. Times are simulated time, so they do not
+# depend on the load of the machine and can be compared between commits.
+#
+# Needs a Zephyr environment (ZEPHYR_BASE, west) and BabbleSim (BSIM_OUT_PATH, BSIM_COMPONENTS_PATH).
+
+set -eu
+
+: "${ZEPHYR_BASE:?source zephyr-env.sh of the zephyr_attacks tree first}"
+: "${BSIM_OUT_PATH:?set BSIM_OUT_PATH to the BabbleSim output folder}"
+: "${BSIM_COMPONENTS_PATH:?set BSIM_COMPONENTS_PATH to the BabbleSim components folder}"
+
+APP_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/../.." && pwd)
+BUILD_DIR=${BUILD_DIR:-${APP_DIR}/build_bsim}
+PEER_ADDR=${PEER_ADDR:-C0:00:00:00:00:01}
+SIM_LENGTH_S=${SIM_LENGTH_S:-600}
+
+# west build into $1, the remaining arguments are Kconfig lines of an extra conf file
+_build() {
+	local app=$1 dir=$2
+	shift 2
+
+	mkdir -p "${dir}"
+	printf '%s\n' "$@" > "${dir}/scenario.conf"
+	if ! west build -p auto -b nrf52_bsim -d "${dir}" "${app}" -- -DEXTRA_CONF_FILE="${dir}/scenario.conf" \
+		> "${dir}/build.log" 2>&1; then
+		tail -n 30 "${dir}/build.log" >&2
+		return 1
+	fi
+}
+
+# build_central <name> <shell commands separated by ';'>: prints the path of the executable
+build_central() {
+	local dir=${BUILD_DIR}/central_$1
+
+	_build "${APP_DIR}" "${dir}" "CONFIG_APP_BOOT_COMMANDS=\"$2\""
+	echo "${dir}/zephyr/zephyr.exe"
+}
+
+# build_peer <name> [CONFIG_PEER_...=value ...]: prints the path of the executable
+build_peer() {
+	local dir=${BUILD_DIR}/peer_$1
+	shift
+
+	_build "${APP_DIR}/peer" "${dir}" "CONFIG_PEER_ADDR=\"${PEER_ADDR}\"" "$@"
+	echo "${dir}/zephyr/zephyr.exe"
+}
+
+# run_sim <name> <central exe> <peer exe>: one simulation, the logs end up in $BUILD_DIR/<name>
+run_sim() {
+	local name=$1 central=$2 peer=$3
+	local log=${BUILD_DIR}/$1
+	local id=bleframework_$1_$$
+	local pid pty=""
+
+	mkdir -p "${log}"
+	cd "${BSIM_OUT_PATH}/bin"
+
+	# the shell is on UART0, which the simulated board connects to a pseudoterminal
+	"${central}" -s="${id}" -d=0 -RealEncryption=1 -uart0_pty > "${log}/central.log" 2>&1 &
+	pid=$!
+	"${peer}" -s="${id}" -d=1 -RealEncryption=1 > "${log}/peer.log" 2>&1 &
+	./bs_2G4_phy_v1 -s="${id}" -D=2 -sim_length=$((SIM_LENGTH_S * 1000000)) > "${log}/phy.log" 2>&1 &
+
+	while [ -z "${pty}" ] && kill -0 "${pid}" 2>/dev/null; do
+		sleep 0.1
+		pty=$(grep -ao '/dev/pts/[0-9]*' "${log}/central.log" | head -n 1 || true)
+	done
+	if [ -n "${pty}" ]; then
+		cat "${pty}" > "${log}/shell.raw" 2>/dev/null &
+	fi
+
+	wait "${pid}" || true
+	wait
+	cd - > /dev/null
+
+	# strip the prompt's escape sequences
+	sed -e 's/\x1b\[[0-9;]*[A-Za-z]//g' -e 's/\r//g' "${log}/shell.raw" > "${log}/shell.log" 2>/dev/null || true
+}
+
+# report <name>: the framework's output of the run and the job durations
+report() {
+	local log=${BUILD_DIR}/$1
+
+	echo "=== $1"
+	grep -av '^uart:~\$' "${log}/shell.log" || true
+	echo "--- peer"
+	grep -a '^peer:' "${log}/peer.log" | tail -n 5 || true
+	echo "--- timings (simulated)"
+	grep -a 'finished with' "${log}/shell.log" || echo "no job finished within ${SIM_LENGTH_S} s, see ${log}"
+}
@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# ifa.sh [n]: the whole IFA (stage 1 to 4, n bondings in stage 2) against a peer whose bond table holds 3 bonds and
+# overwrites the oldest, with the fast connection profile.
+
+. "$(dirname "$0")/common.sh"
+
+N=${1:-20}
+
+central=$(build_central ifa "bleframework init;bleframework ifa ${PEER_ADDR} random ${N} fast")
+peer=$(build_peer bonds3 CONFIG_PEER_BONDS=3 CONFIG_PEER_BONDS_OVERWRITE=y)
+
+run_sim ifa "${central}" "${peer}"
+report ifa
@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# knob.sh: key size sweep (7 to 16) against a peer that accepts every key size and one that requires 16 bytes.
+
+. "$(dirname "$0")/common.sh"
+
+central=$(build_central knob "bleframework init;bleframework knob sweep ${PEER_ADDR} random")
+peer_any=$(build_peer default)
+peer_16=$(build_peer key16 CONFIG_PEER_MIN_KEY_SIZE=16)
+
+run_sim knob_any "${central}" "${peer_any}"
+run_sim knob_16 "${central}" "${peer_16}"
+report knob_any
+report knob_16
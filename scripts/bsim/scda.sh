@@ -0,0 +1,17 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# scda.sh: Secure Connections and legacy pairing (pairmatrix, key size 16, every IO capability of ours) against a peer
+# with display and yes/no buttons, once without and once with SC only mode. The SC only peer has to refuse every
+# legacy cell.
+
+. "$(dirname "$0")/common.sh"
+
+central=$(build_central scda "bleframework init;bleframework pairmatrix ${PEER_ADDR} random 16")
+peer=$(build_peer yesno CONFIG_PEER_IO_YESNO=y)
+peer_sc=$(build_peer yesno_sc CONFIG_PEER_IO_YESNO=y CONFIG_PEER_SC_ONLY=y CONFIG_PEER_MIN_KEY_SIZE=16)
+
+run_sim scda "${central}" "${peer}"
+run_sim scda_sc_only "${central}" "${peer_sc}"
+report scda
+report scda_sc_only
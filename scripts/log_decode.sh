@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# Decodes the dictionary log of a build with overlay-logdict.conf.
+#
+#   log_decode.sh <build dir> <rtt log>
+#
+# The log is the binary RTT channel 0, e.g. JLinkRTTLogger -Device NRF52840_XXAA -If SWD -Speed 4000 -RTTChannel 0
+# rtt.bin. The database is generated by the build next to the image; it only matches the image it was built with.
+
+set -eu
+
+: "${ZEPHYR_BASE:?source zephyr-env.sh of the zephyr_attacks tree first}"
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 <build dir> <rtt log>" >&2
+	exit 1
+fi
+
+DB=$1/zephyr/log_dictionary.json
+if [ ! -f "${DB}" ]; then
+	echo "${DB} missing, build with -DEXTRA_CONF_FILE=overlay-logdict.conf" >&2
+	exit 1
+fi
+
+python3 "${ZEPHYR_BASE}/scripts/logging/dictionary/log_parser.py" "${DB}" "$2"
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# Compares the text logging profile (prj.conf) with the dictionary one (overlay-logdict.conf).
+#
+#   log_profiles.sh build [board]          builds both, with overlay-cpustats.conf, and prints their memory usage
+#   log_profiles.sh rate <log> <messages>  bytes per message on the wire
+#
+# For rate, flash each build, run the same job after `bleframework stats reset`, save what arrived (the UART log for
+# the text build, RTT channel 0 for the dictionary build) and take the message count from the log line of
+# `bleframework stats`; the CPU time of the log thread is on the same line.
+
+set -eu
+
+APP_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+
+usage() {
+	echo "usage: $0 build [board] | rate <log> <messages>" >&2
+	exit 1
+}
+
+# _build <dir> <board> <extra conf files>
+_build() {
+	mkdir -p "$1"
+	if ! west build -p auto -b "$2" -d "$1" "${APP_DIR}" -- -DEXTRA_CONF_FILE="$3" > "$1/build.log" 2>&1; then
+		tail -n 30 "$1/build.log" >&2
+		return 1
+	fi
+	grep -E '^ *(FLASH|RAM):' "$1/build.log"
+}
+
+case "${1:-}" in
+build)
+	: "${ZEPHYR_BASE:?source zephyr-env.sh of the zephyr_attacks tree first}"
+	BOARD=${2:-nrf52840dk_nrf52840}
+
+	echo "text:"
+	_build "${APP_DIR}/build_log_text" "${BOARD}" "${APP_DIR}/overlay-cpustats.conf"
+	echo "dictionary:"
+	_build "${APP_DIR}/build_log_dict" "${BOARD}" "${APP_DIR}/overlay-logdict.conf;${APP_DIR}/overlay-cpustats.conf"
+	echo "decode the dictionary log with scripts/log_decode.sh ${APP_DIR}/build_log_dict <rtt log>"
+	;;
+rate)
+	[ $# -eq 3 ] || usage
+	[ "$3" -gt 0 ] || { echo "no messages counted" >&2; exit 1; }
+	BYTES=$(wc -c < "$2")
+	echo "${BYTES} bytes, $3 messages, $((BYTES / $3)) bytes per message"
+	;;
+*)
+	usage
+	;;
+esac
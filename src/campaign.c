@@ -0,0 +1,111 @@
+#include "campaign.h"
+#include "ifa.h"
+#include "main.h"
+#include "snapshot.h"
+
+#include <string.h>
+#include <zephyr/settings/settings.h>
+
+/* Checkpoint of the running IFA campaign. The runner commits it at every stage boundary and every CAMPAIGN_CKPT_ITERS
+ * stage 2 iterations under "bleframework/campaign/state", and clears it once stage 3 has put the original identity and
+ * bond back (or an abort did). A watchdog reset or brown-out in between leaves the checkpoint behind: it is loaded with
+ * the other settings at init, and `campaign resume` restores the saved identity and continues where the run stopped.
+ * The DUT's bond itself survives in its snapshot slot, which stage 1 writes to flash for campaigns; clearing the
+ * campaign takes it off flash again unless snapshot persistence is on.
+ */
+
+static struct campaign_state state;
+static bool valid;
+
+static int campaign_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+  if (!name || strcmp(name, "state") || len != sizeof(state)) {
+    return -EINVAL;
+  }
+
+  if (read_cb(cb_arg, &state, sizeof(state)) != sizeof(state)) {
+    return -EIO;
+  }
+
+  valid = true;
+  return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(bleframework_campaign, "bleframework/campaign", NULL, campaign_set, NULL, NULL);
+
+static void campaign_print(const struct shell *sh){
+  char addr[BT_ADDR_LE_STR_LEN];
+
+  bt_addr_le_to_str(&state.target, addr, sizeof(addr));
+  shell_print(sh, "campaign against %s: stage %s%s, %d/%d stage 2 iterations, runs up to stage %s, original identity %s",
+              addr, ifa_stage_name(state.stage), state.done ? " done" : "", state.iter, state.n,
+              ifa_stage_name(state.last_stage), state.id_saved ? "saved" : "not saved");
+}
+
+// after settings_load(): point at a campaign a reset interrupted
+void campaign_init(void){
+  if (valid) {
+    campaign_print(shell);
+    shell_print(shell, "`campaign resume` continues it, `campaign clear` forgets it");
+  }
+}
+
+void campaign_commit(const struct campaign_state *next){
+  int err;
+
+  if (valid && !memcmp(&state, next, sizeof(state))) {
+    return;
+  }
+
+  state = *next;
+  valid = true;
+
+  err = settings_save_one("bleframework/campaign/state", &state, sizeof(state));
+  if (err) {
+    shell_error(shell, "campaign: checkpoint failed (err %d)", err);
+  }
+}
+
+void campaign_clear(void){
+  if (!valid) {
+    return;
+  }
+
+  valid = false;
+  snapshot_unpersist(&state.target);
+  settings_delete("bleframework/campaign/state");
+}
+
+int campaign_get(struct campaign_state *out){
+  if (!valid) {
+    return -ENOENT;
+  }
+
+  *out = state;
+  return 0;
+}
+
+int cmd_campaign(const struct shell *sh, size_t argc, char *argv[]){
+
+  if (argc > 1 && !strcmp(argv[1], "resume")) {
+    if (!valid) {
+      shell_error(sh, "no campaign to resume");
+      return -ENOENT;
+    }
+    return ifa_resume(sh);
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "clear")) {
+    campaign_clear();
+  } else if (argc > 1 && strcmp(argv[1], "status")) {
+    shell_help(sh);
+    return SHELL_CMD_HELP_PRINTED;
+  }
+
+  if (!valid) {
+    shell_print(sh, "no campaign checkpoint");
+    return 0;
+  }
+
+  campaign_print(sh);
+  return 0;
+}
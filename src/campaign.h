@@ -0,0 +1,28 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define CAMPAIGN_CKPT_ITERS  10     // stage 2 commits its progress every this many iterations
+
+/* Progress of an IFA campaign as committed to flash */
+struct campaign_state {
+  bt_addr_le_t target;
+  int n;                     // stage 2 iterations
+  uint8_t profile;
+  uint8_t stage;             // stage the run was in (enum ifa_stage)
+  uint8_t last_stage;
+  bool done;                 // the run completed its last stage, the next stage has not been started
+  int iter;                  // stage 2 iterations completed
+  bool id_saved;
+  bt_addr_le_t old_addr;     // original identity, saved in stage 1
+  uint8_t old_irk[16];
+};
+
+void campaign_init(void);
+void campaign_commit(const struct campaign_state *state);
+void campaign_clear(void);
+int campaign_get(struct campaign_state *state);
+
+int cmd_campaign(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,227 @@
+#include "conn_profile.h"
+#include "main.h"
+
+#include <string.h>
+#include <zephyr/bluetooth/hci.h>
+
+/* The SMP exchange of a pairing round is a handful of request/response PDUs, each waiting for the next connection
+ * event, so the connection interval dominates the time a round takes. The fast profile asks for the shortest interval
+ * and the 2M PHY; peers that reject it keep working on the compat profile, which is what the stack used before.
+ */
+
+static struct conn_profile profiles[] = {
+  [CONN_PROFILE_COMPAT] = {
+    .name = "compat",
+    .scan_interval = BT_GAP_SCAN_FAST_INTERVAL,
+    .scan_window = BT_GAP_SCAN_FAST_WINDOW,
+    .param = BT_LE_CONN_PARAM_INIT(BT_GAP_INIT_CONN_INT_MIN, BT_GAP_INIT_CONN_INT_MAX, 0, 400),
+    .phy = BT_GAP_LE_PHY_1M,
+    .dle = false,
+  },
+  [CONN_PROFILE_FAST] = {
+    .name = "fast",
+    // continuous initiator scan, the connect request goes out on the first advertisement
+    .scan_interval = BT_GAP_SCAN_FAST_INTERVAL,
+    .scan_window = BT_GAP_SCAN_FAST_INTERVAL,
+    .param = BT_LE_CONN_PARAM_INIT(6, 6, 0, 400),
+    .phy = BT_GAP_LE_PHY_2M,
+    .dle = true,
+  },
+  [CONN_PROFILE_CUSTOM] = {
+    .name = "custom",
+    .scan_interval = BT_GAP_SCAN_FAST_INTERVAL,
+    .scan_window = BT_GAP_SCAN_FAST_INTERVAL,
+    .param = BT_LE_CONN_PARAM_INIT(6, 12, 0, 400),
+    .phy = BT_GAP_LE_PHY_2M,
+    .dle = true,
+  },
+};
+
+static enum conn_profile_id selected = CONN_PROFILE_COMPAT;
+static const struct conn_profile *pending;  // profile of the connection we are initiating, applied in connected()
+
+int conn_profile_parse(const char *name){
+  for (int id = CONN_PROFILE_COMPAT; id < CONN_PROFILE_COUNT; id++) {
+    if (!strcmp(name, profiles[id].name)) {
+      return id;
+    }
+  }
+
+  return -EINVAL;
+}
+
+const struct conn_profile *conn_profile_get(enum conn_profile_id id){
+  if (id == CONN_PROFILE_SELECTED || id >= CONN_PROFILE_COUNT) {
+    id = selected;
+  }
+
+  return &profiles[id];
+}
+
+int conn_profile_create(const bt_addr_le_t *addr, enum conn_profile_id id, struct bt_conn **conn){
+  const struct conn_profile *p = conn_profile_get(id);
+  struct bt_conn_le_create_param *create_params = BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_NONE, p->scan_interval,
+                                                                          p->scan_window);
+
+  int err;
+
+  pending = p;
+  err = bt_conn_le_create(addr, create_params, &p->param, conn);
+  if (err) {
+    pending = NULL;
+  }
+
+  return err;
+}
+
+int conn_profile_create_auto(enum conn_profile_id id){
+  const struct conn_profile *p = conn_profile_get(id);
+  struct bt_conn_le_create_param *create_params = BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_NONE, p->scan_interval,
+                                                                          p->scan_window);
+
+  int err;
+
+  pending = p;
+  err = bt_conn_le_create_auto(create_params, &p->param);
+  if (err) {
+    pending = NULL;
+  }
+
+  return err;
+}
+
+// the connection we initiated failed or was cancelled, the next one may come from another job
+void conn_profile_failed(void){
+  pending = NULL;
+}
+
+// requests the PHY and data length of the profile the connection was initiated with
+void conn_profile_connected(struct bt_conn *conn){
+  const struct conn_profile *p = pending;
+  struct bt_conn_info info;
+  int err;
+
+  if (!p || bt_conn_get_info(conn, &info) || info.role != BT_CONN_ROLE_CENTRAL) {
+    return;
+  }
+  pending = NULL;
+
+  if (p->phy != BT_GAP_LE_PHY_1M) {
+    struct bt_conn_le_phy_param phy = {
+      .options = BT_CONN_LE_PHY_OPT_NONE,
+      .pref_tx_phy = p->phy,
+      .pref_rx_phy = p->phy,
+    };
+
+    err = bt_conn_le_phy_update(conn, &phy);
+    if (err) {
+      shell_error(shell, "PHY update request failed (err %d)", err);
+    }
+  }
+
+  if (p->dle) {
+    err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+    if (err) {
+      shell_error(shell, "Data length update request failed (err %d)", err);
+    }
+  }
+}
+
+static void conn_profile_print(const struct shell *sh, enum conn_profile_id id){
+  const struct conn_profile *p = &profiles[id];
+
+  // interval in 1.25 ms units, supervision timeout in 10 ms units
+  shell_print(sh, "%c %-7s interval %u-%u us, latency %u, timeout %u ms, phy %s, dle %s, scan %u/%u",
+              id == selected ? '*' : ' ', p->name, p->param.interval_min * 1250U, p->param.interval_max * 1250U,
+              p->param.latency, p->param.timeout * 10,
+              p->phy == BT_GAP_LE_PHY_2M ? "2M" : p->phy == BT_GAP_LE_PHY_CODED ? "coded" : "1M",
+              p->dle ? "on" : "off", p->scan_interval, p->scan_window);
+}
+
+static int conn_profile_set_custom(const struct shell *sh, size_t argc, char *argv[]){
+  struct conn_profile *p = &profiles[CONN_PROFILE_CUSTOM];
+  struct bt_le_conn_param param;
+  // intervals are given in 1.25 ms units like on the air (6 = 7.5 ms), the timeout in ms
+  unsigned long val[] = { 0, 0, 0, 4000 };  // interval_min, interval_max, latency, timeout
+  uint8_t phy = p->phy;
+  int err = 0;
+
+  for (size_t i = 0; i < ARRAY_SIZE(val) && i + 2 < argc && !err; i++) {
+    val[i] = shell_strtoul(argv[i + 2], 10, &err);
+  }
+  if (err) {
+    shell_error(sh, "intervals, latency and timeout must be numbers");
+    return -EINVAL;
+  }
+
+  // Core spec ranges, checked before narrowing to the 16 bit fields, and the supervision timeout has to outlast the
+  // latency
+  if (val[0] < 6 || val[1] > 3200 || val[0] > val[1] || val[2] > 499 || val[3] / 10 < 10 || val[3] / 10 > 3200 ||
+      val[3] / 10 * 4U <= (1U + val[2]) * val[1]) {
+    shell_error(sh, "invalid connection parameters");
+    return -EINVAL;
+  }
+
+  param.interval_min = val[0];
+  param.interval_max = val[1];
+  param.latency = val[2];
+  param.timeout = val[3] / 10;
+
+  if (argc > 6) {
+    if (!strcmp(argv[6], "1m")) {
+      phy = BT_GAP_LE_PHY_1M;
+    } else if (!strcmp(argv[6], "2m")) {
+      phy = BT_GAP_LE_PHY_2M;
+    } else if (!strcmp(argv[6], "coded")) {
+      phy = BT_GAP_LE_PHY_CODED;
+    } else {
+      shell_error(sh, "unknown PHY %s, use 1m, 2m or coded", argv[6]);
+      return -EINVAL;
+    }
+  }
+  if (argc > 7 && strcmp(argv[7], "on") && strcmp(argv[7], "off")) {
+    shell_error(sh, "data length update must be on or off");
+    return -EINVAL;
+  }
+
+  p->param = param;
+  p->phy = phy;
+  if (argc > 7) {
+    p->dle = !strcmp(argv[7], "on");
+  }
+
+  return 0;
+}
+
+int cmd_conn_profile(const struct shell *sh, size_t argc, char *argv[]){
+  int id;
+  int err;
+
+  if (argc > 1) {
+    id = conn_profile_parse(argv[1]);
+    if (id < 0) {
+      shell_error(sh, "unknown profile %s", argv[1]);
+      return id;
+    }
+
+    if (id == CONN_PROFILE_CUSTOM && argc > 2) {
+      if (argc < 4) {
+        shell_error(sh, "Usage: connprofile custom <interval_min> <interval_max> (1.25 ms units) [latency] [timeout_ms] "
+                        "[1m|2m|coded] [on|off]");
+        return -EINVAL;
+      }
+      err = conn_profile_set_custom(sh, argc, argv);
+      if (err) {
+        return err;
+      }
+    }
+
+    selected = id;
+  }
+
+  for (id = CONN_PROFILE_COMPAT; id < CONN_PROFILE_COUNT; id++) {
+    conn_profile_print(sh, id);
+  }
+
+  return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/shell/shell.h>
+
+/* Connection parameters used when we initiate a test connection. CONN_PROFILE_SELECTED stands for whatever
+ * `connprofile <name>` made the default, so zero-initialized jobs follow the shell setting.
+ */
+enum conn_profile_id {
+  CONN_PROFILE_SELECTED,
+  CONN_PROFILE_COMPAT,     // stack defaults: 30-50 ms interval, 1M PHY, 27 byte PDUs
+  CONN_PROFILE_FAST,       // 7.5 ms interval, 2M PHY, 251 byte PDUs
+  CONN_PROFILE_CUSTOM,     // set with `connprofile custom ...`
+  CONN_PROFILE_COUNT,
+};
+
+struct conn_profile {
+  const char *name;
+  uint16_t scan_interval;     // initiator scan, 0.625 ms units
+  uint16_t scan_window;
+  struct bt_le_conn_param param;
+  uint8_t phy;                // BT_GAP_LE_PHY_*, requested right after connecting
+  bool dle;                   // request the maximum data length right after connecting
+};
+
+int conn_profile_parse(const char *name);
+const struct conn_profile *conn_profile_get(enum conn_profile_id id);
+
+int conn_profile_create(const bt_addr_le_t *addr, enum conn_profile_id id, struct bt_conn **conn);
+int conn_profile_create_auto(enum conn_profile_id id);
+void conn_profile_connected(struct bt_conn *conn);
+void conn_profile_failed(void);
+
+int cmd_conn_profile(const struct shell *sh, size_t argc, char *argv[]);
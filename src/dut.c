@@ -0,0 +1,370 @@
+#include "dut.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/settings/settings.h>
+
+/* Fingerprint cache: pairing features, last advertisement, connection parameters and stage 2 pacing of every DUT we
+ * connected to. Entries are created by a connection or a pairing; advertisements only refresh existing ones, so the
+ * scan does not fill the cache with bystanders. Updates mark the slot dirty and the system workqueue writes it to
+ * "bleframework/dut/<slot>" a second later. Unchanged values are not written again, so the thousands of identical
+ * connections of a campaign cost no flash.
+ */
+
+#define DUT_SAVE_DELAY  K_SECONDS(1)
+
+static struct dut_info duts[DUT_SLOTS];
+static uint32_t dirty;           // slots to write
+static uint32_t seq;
+static struct k_spinlock dut_lock;
+
+static const char *const io_names[] = {
+  "DisplayOnly", "DisplayYesNo", "KeyboardOnly", "NoInputNoOutput", "KeyboardDisplay",
+};
+
+static void dut_save_handler(struct k_work *work){
+  struct dut_info entry;
+  uint32_t pending;
+  char name[24];
+  int err;
+
+  K_SPINLOCK(&dut_lock) {
+    pending = dirty;
+    dirty = 0;
+  }
+
+  for (int i = 0; i < DUT_SLOTS; i++) {
+    if (!(pending & BIT(i))) {
+      continue;
+    }
+
+    K_SPINLOCK(&dut_lock) {
+      entry = duts[i];
+    }
+
+    snprintk(name, sizeof(name), "bleframework/dut/%d", i);
+    err = entry.flags ? settings_save_one(name, &entry, sizeof(entry)) : settings_delete(name);
+    if (err) {
+      shell_error(shell, "dut: saving slot %d failed (err %d)", i, err);
+    }
+  }
+}
+
+static K_WORK_DELAYABLE_DEFINE(save_work, dut_save_handler);
+
+static int dut_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+  int idx = atoi(name);
+
+  // a layout change of struct dut_info drops the stored slots
+  if (idx < 0 || idx >= DUT_SLOTS || len != sizeof(duts[0])) {
+    return -EINVAL;
+  }
+
+  if (read_cb(cb_arg, &duts[idx], sizeof(duts[idx])) != sizeof(duts[idx])) {
+    memset(&duts[idx], 0, sizeof(duts[idx]));
+    return -EIO;
+  }
+
+  if (duts[idx].seq >= seq) {
+    seq = duts[idx].seq + 1;
+  }
+
+  return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(bleframework_dut, "bleframework/dut", NULL, dut_set, NULL, NULL);
+
+// call with dut_lock held
+static struct dut_info *dut_find(const bt_addr_le_t *addr){
+  for (int i = 0; i < DUT_SLOTS; i++) {
+    if (duts[i].flags && bt_addr_le_eq(&duts[i].addr, addr)) {
+      return &duts[i];
+    }
+  }
+
+  return NULL;
+}
+
+// finds or creates the slot of addr, the least recently updated DUT makes room; call with dut_lock held
+static struct dut_info *dut_get(const bt_addr_le_t *addr){
+  struct dut_info *entry = dut_find(addr);
+
+  if (entry) {
+    return entry;
+  }
+
+  entry = &duts[0];
+  for (int i = 0; i < DUT_SLOTS && entry->flags; i++) {
+    if (!duts[i].flags || duts[i].seq < entry->seq) {
+      entry = &duts[i];
+    }
+  }
+
+  memset(entry, 0, sizeof(*entry));
+  entry->addr = *addr;
+  return entry;
+}
+
+// call with dut_lock held
+static void dut_touch(struct dut_info *entry, uint8_t flag, bool changed){
+  if (!changed && (entry->flags & flag)) {
+    return;
+  }
+
+  entry->flags |= flag;
+  entry->seq = seq++;
+  dirty |= BIT(entry - duts);
+}
+
+int dut_lookup(const bt_addr_le_t *addr, struct dut_info *info){
+  struct dut_info *entry;
+  int err = -ENOENT;
+
+  K_SPINLOCK(&dut_lock) {
+    entry = dut_find(addr);
+    if (entry) {
+      *info = *entry;
+      err = 0;
+    }
+  }
+
+  return err;
+}
+
+void dut_note_feat(const bt_addr_le_t *addr, const struct bt_conn_pairing_feat *feat){
+  struct dut_info *entry;
+  bool changed;
+
+  K_SPINLOCK(&dut_lock) {
+    entry = dut_get(addr);
+    changed = entry->io_capability != feat->io_capability || entry->oob != feat->oob_data_flag ||
+              entry->auth_req != feat->auth_req || entry->max_key_size != feat->max_enc_key_size ||
+              entry->init_key_dist != feat->init_key_dist || entry->resp_key_dist != feat->resp_key_dist;
+
+    entry->io_capability = feat->io_capability;
+    entry->oob = feat->oob_data_flag;
+    entry->auth_req = feat->auth_req;
+    entry->max_key_size = feat->max_enc_key_size;
+    entry->init_key_dist = feat->init_key_dist;
+    entry->resp_key_dist = feat->resp_key_dist;
+    dut_touch(entry, DUT_HAS_FEAT, changed);
+  }
+
+  k_work_schedule(&save_work, DUT_SAVE_DELAY);
+}
+
+void dut_note_adv(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, const uint8_t *data, uint8_t len){
+  struct dut_info *entry;
+  bool changed = false;
+
+  len = MIN(len, DUT_ADV_MAX);
+
+  K_SPINLOCK(&dut_lock) {
+    entry = dut_find(addr);
+    if (!entry) {
+      K_SPINLOCK_BREAK;
+    }
+
+    // the scan response carries other data than the advertisement, keep the advertisement
+    if (type == BT_GAP_ADV_TYPE_SCAN_RSP && (entry->flags & DUT_HAS_ADV)) {
+      K_SPINLOCK_BREAK;
+    }
+
+    entry->rssi = rssi;
+    changed = entry->adv_type != type || entry->adv_len != len || memcmp(entry->adv, data, len);
+    if (changed) {
+      entry->adv_type = type;
+      entry->adv_len = len;
+      memcpy(entry->adv, data, len);
+    }
+    dut_touch(entry, DUT_HAS_ADV, changed);
+  }
+
+  if (changed) {
+    k_work_schedule(&save_work, DUT_SAVE_DELAY);
+  }
+}
+
+void dut_note_conn(const bt_addr_le_t *addr, uint16_t interval, uint16_t latency, uint16_t timeout){
+  struct dut_info *entry;
+  bool changed;
+
+  K_SPINLOCK(&dut_lock) {
+    entry = dut_get(addr);
+    changed = entry->interval != interval || entry->latency != latency || entry->timeout != timeout;
+
+    entry->interval = interval;
+    entry->latency = latency;
+    entry->timeout = timeout;
+    dut_touch(entry, DUT_HAS_CONN, changed);
+  }
+
+  k_work_schedule(&save_work, DUT_SAVE_DELAY);
+}
+
+void dut_note_pace(const bt_addr_le_t *addr, uint32_t gap_ms){
+  struct dut_info *entry;
+  bool changed;
+
+  gap_ms = MIN(gap_ms, UINT16_MAX);
+
+  K_SPINLOCK(&dut_lock) {
+    entry = dut_get(addr);
+    changed = entry->pace_gap_ms != gap_ms;
+    entry->pace_gap_ms = gap_ms;
+    dut_touch(entry, DUT_HAS_PACE, changed);
+  }
+
+  k_work_schedule(&save_work, DUT_SAVE_DELAY);
+}
+
+static void dut_print(const struct shell *sh, const struct dut_info *info){
+  char addr[BT_ADDR_LE_STR_LEN];
+  char adv[DUT_ADV_MAX * 2 + 1];
+
+  bt_addr_le_to_str(&info->addr, addr, sizeof(addr));
+  shell_print(sh, "%s", addr);
+
+  if (info->flags & DUT_HAS_FEAT) {
+    shell_print(sh, "  pairing features: IO %s (0x%02x), OOB %u, auth 0x%02x (%s%s%s), max key size %u, "
+                "init kdist 0x%02x, resp kdist 0x%02x",
+                info->io_capability < ARRAY_SIZE(io_names) ? io_names[info->io_capability] : "?",
+                info->io_capability, info->oob, info->auth_req, (info->auth_req & 0x01) ? "bonding " : "",
+                (info->auth_req & 0x04) ? "MITM " : "", (info->auth_req & 0x08) ? "SC" : "legacy",
+                info->max_key_size, info->init_key_dist, info->resp_key_dist);
+  }
+
+  if (info->flags & DUT_HAS_ADV) {
+    bin2hex(info->adv, info->adv_len, adv, sizeof(adv));
+    shell_print(sh, "  advertisement: type %u, RSSI %d dBm, data %s", info->adv_type, info->rssi, adv);
+  }
+
+  if (info->flags & DUT_HAS_CONN) {
+    shell_print(sh, "  connection: interval %u us, latency %u, timeout %u ms", info->interval * 1250U,
+                info->latency, info->timeout * 10U);
+  }
+
+  if (info->flags & DUT_HAS_PACE) {
+    shell_print(sh, "  pacing: %u ms between stage 2 iterations", info->pace_gap_ms);
+  }
+}
+
+// the listing in the structured output modes: one record per DUT, the fields of what is known about it
+static void dut_record(const struct dut_info *info){
+  char addr[BT_ADDR_LE_STR_LEN];
+  char adv[DUT_ADV_MAX * 2 + 1];
+  struct output_field fields[14] = {
+    OUTPUT_STR("addr", addr),
+  };
+  size_t n = 1;
+
+  bt_addr_le_to_str(&info->addr, addr, sizeof(addr));
+
+  if (info->flags & DUT_HAS_FEAT) {
+    fields[n++] = (struct output_field)OUTPUT_NUM("io", info->io_capability);
+    fields[n++] = (struct output_field)OUTPUT_NUM("oob", info->oob);
+    fields[n++] = (struct output_field)OUTPUT_NUM("auth", info->auth_req);
+    fields[n++] = (struct output_field)OUTPUT_NUM("max_key_size", info->max_key_size);
+    fields[n++] = (struct output_field)OUTPUT_NUM("init_kdist", info->init_key_dist);
+    fields[n++] = (struct output_field)OUTPUT_NUM("resp_kdist", info->resp_key_dist);
+  }
+
+  if (info->flags & DUT_HAS_ADV) {
+    bin2hex(info->adv, info->adv_len, adv, sizeof(adv));
+    fields[n++] = (struct output_field)OUTPUT_NUM("adv_type", info->adv_type);
+    fields[n++] = (struct output_field)OUTPUT_NUM("rssi", info->rssi);
+    fields[n++] = (struct output_field)OUTPUT_STR("adv", adv);
+  }
+
+  if (info->flags & DUT_HAS_CONN) {
+    fields[n++] = (struct output_field)OUTPUT_NUM("interval_us", info->interval * 1250U);
+    fields[n++] = (struct output_field)OUTPUT_NUM("latency", info->latency);
+    fields[n++] = (struct output_field)OUTPUT_NUM("timeout_ms", info->timeout * 10U);
+  }
+
+  if (info->flags & DUT_HAS_PACE) {
+    fields[n++] = (struct output_field)OUTPUT_NUM("pace_ms", info->pace_gap_ms);
+  }
+
+  output_record("dut", k_uptime_get_32(), worker_current_id(), fields, n);
+}
+
+static int dut_forget(const struct shell *sh, const bt_addr_le_t *addr){
+  int n = 0;
+
+  K_SPINLOCK(&dut_lock) {
+    for (int i = 0; i < DUT_SLOTS; i++) {
+      if (duts[i].flags && (!addr || bt_addr_le_eq(&duts[i].addr, addr))) {
+        memset(&duts[i], 0, sizeof(duts[i]));
+        dirty |= BIT(i);
+        n++;
+      }
+    }
+  }
+
+  k_work_schedule(&save_work, K_NO_WAIT);
+
+  if (addr && !n) {
+    shell_error(sh, "DUT not in the cache");
+    return -ENOENT;
+  }
+
+  return 0;
+}
+
+int cmd_dut(const struct shell *sh, size_t argc, char *argv[]){
+  struct dut_info info;
+  bt_addr_le_t addr;
+  int err;
+
+  if (argc < 2 || !strcmp(argv[1], "list")) {
+    int n = 0;
+
+    for (int i = 0; i < DUT_SLOTS; i++) {
+      K_SPINLOCK(&dut_lock) {
+        info = duts[i];
+      }
+      if (info.flags && output_structured()) {
+        dut_record(&info);
+        n++;
+      } else if (info.flags) {
+        dut_print(sh, &info);
+        n++;
+      }
+    }
+    if (!output_structured()) {
+      shell_print(sh, "%d/%d DUTs cached", n, DUT_SLOTS);
+    }
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "forget") && argc == 3 && !strcmp(argv[2], "all")) {
+    return dut_forget(sh, NULL);
+  }
+
+  if ((!strcmp(argv[1], "info") || !strcmp(argv[1], "forget")) && argc > 3) {
+    err = bt_addr_le_from_str(argv[2], argv[3], &addr);
+    if (err < 0) {
+      shell_error(sh, "Invalid peer address (err %d)", err);
+      return err;
+    }
+
+    if (!strcmp(argv[1], "forget")) {
+      return dut_forget(sh, &addr);
+    }
+
+    if (dut_lookup(&addr, &info)) {
+      shell_error(sh, "DUT not in the cache");
+      return -ENOENT;
+    }
+    dut_print(sh, &info);
+    return 0;
+  }
+
+  shell_help(sh);
+  return SHELL_CMD_HELP_PRINTED;
+}
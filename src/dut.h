@@ -0,0 +1,52 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define DUT_SLOTS     16
+#define DUT_ADV_MAX   31
+
+#define DUT_HAS_FEAT  BIT(0)
+#define DUT_HAS_ADV   BIT(1)
+#define DUT_HAS_CONN  BIT(2)
+#define DUT_HAS_PACE  BIT(3)
+
+/* What we learned about a DUT, kept across runs and resets */
+struct dut_info {
+  bt_addr_le_t addr;
+  uint8_t flags;             // DUT_HAS_*
+  uint32_t seq;              // order of the last update, the oldest slot is reused
+
+  // pairing features of the last pairing
+  uint8_t io_capability;
+  uint8_t oob;
+  uint8_t auth_req;
+  uint8_t max_key_size;
+  uint8_t init_key_dist;
+  uint8_t resp_key_dist;
+
+  // last advertisement
+  uint8_t adv_type;
+  int8_t rssi;               // not persisted on its own, only together with a change of the data
+  uint8_t adv_len;
+  uint8_t adv[DUT_ADV_MAX];
+
+  // parameters of the last connection that came up
+  uint16_t interval;         // 1.25 ms units
+  uint16_t latency;
+  uint16_t timeout;          // 10 ms units
+
+  // gap between stage 2 iterations the pacing ended with
+  uint16_t pace_gap_ms;
+};
+
+struct bt_conn_pairing_feat;
+
+int dut_lookup(const bt_addr_le_t *addr, struct dut_info *info);
+void dut_note_feat(const bt_addr_le_t *addr, const struct bt_conn_pairing_feat *feat);
+void dut_note_adv(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, const uint8_t *data, uint8_t len);
+void dut_note_conn(const bt_addr_le_t *addr, uint16_t interval, uint16_t latency, uint16_t timeout);
+void dut_note_pace(const bt_addr_le_t *addr, uint32_t gap_ms);
+
+int cmd_dut(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,273 @@
+#include "evtlog.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+#include <string.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/hci.h>
+
+/* The Bluetooth callbacks run in the host's RX context. Formatting an address and pushing a line through the shell
+ * backend there stalls the stack for as long as the UART needs, so the callbacks only put a record into this ring and
+ * a low priority thread prints it.
+ *
+ * Bounded MPSC ring after D. Vyukov: a producer claims a position with a CAS on head and publishes the slot through
+ * its sequence number, the single consumer owns tail. Producers never wait; when the ring is full the record is
+ * dropped and counted. Callbacks come from the RX thread, but bond_deleted() also fires from whatever thread called
+ * bt_unpair(), hence multiple producers.
+ */
+
+#define EVTLOG_MASK (EVTLOG_RING_LEN - 1)
+
+BUILD_ASSERT((EVTLOG_RING_LEN & EVTLOG_MASK) == 0, "EVTLOG_RING_LEN must be a power of two");
+
+struct evtlog_slot {
+  atomic_t seq;    // stored relative to the slot index, so the zero initialized ring is ready to use
+  struct evtlog_rec rec;
+};
+
+static struct evtlog_slot ring[EVTLOG_RING_LEN];
+static atomic_t head;
+static uint32_t tail;      // consumer only
+static atomic_t records;
+static atomic_t drops;
+static atomic_t high_water;
+
+K_SEM_DEFINE(evtlog_sem, 0, 1);
+
+static uint32_t evtlog_seq(uint32_t idx){
+  return (uint32_t)atomic_get(&ring[idx & EVTLOG_MASK].seq) + (idx & EVTLOG_MASK);
+}
+
+static void evtlog_seq_set(uint32_t idx, uint32_t seq){
+  atomic_set(&ring[idx & EVTLOG_MASK].seq, seq - (idx & EVTLOG_MASK));
+}
+
+void evtlog_put(struct evtlog_rec *rec){
+  uint32_t pos = atomic_get(&head);
+  uint32_t used;
+  int32_t diff;
+
+  rec->ts_ms = k_uptime_get_32();
+  rec->job = worker_current_id();
+
+  for (;;) {
+    diff = (int32_t)(evtlog_seq(pos) - pos);
+    if (diff == 0) {
+      if (atomic_cas(&head, pos, pos + 1)) {
+        break;
+      }
+      pos = atomic_get(&head);
+    } else if (diff < 0) {
+      // the consumer has not freed this slot yet
+      atomic_inc(&drops);
+      return;
+    } else {
+      pos = atomic_get(&head);
+    }
+  }
+
+  ring[pos & EVTLOG_MASK].rec = *rec;
+  evtlog_seq_set(pos, pos + 1);
+  atomic_inc(&records);
+
+  used = pos + 1 - tail;
+  if (used > (uint32_t)atomic_get(&high_water)) {
+    atomic_set(&high_water, used);
+  }
+
+  k_sem_give(&evtlog_sem);
+}
+
+static bool evtlog_get(struct evtlog_rec *rec){
+  if ((int32_t)(evtlog_seq(tail) - (tail + 1)) < 0) {
+    return false;
+  }
+
+  *rec = ring[tail & EVTLOG_MASK].rec;
+  evtlog_seq_set(tail, tail + EVTLOG_RING_LEN);
+  tail++;
+
+  return true;
+}
+
+static const char *security_err_str(enum bt_security_err err)
+{
+  switch (err) {
+    case BT_SECURITY_ERR_SUCCESS:
+      return "Success";
+    case BT_SECURITY_ERR_AUTH_FAIL:
+      return "Authentication failure";
+    case BT_SECURITY_ERR_PIN_OR_KEY_MISSING:
+      return "PIN or key missing";
+    case BT_SECURITY_ERR_OOB_NOT_AVAILABLE:
+      return "OOB not available";
+    case BT_SECURITY_ERR_AUTH_REQUIREMENT:
+      return "Authentication requirements";
+    case BT_SECURITY_ERR_PAIR_NOT_SUPPORTED:
+      return "Pairing not supported";
+    case BT_SECURITY_ERR_PAIR_NOT_ALLOWED:
+      return "Pairing not allowed";
+    case BT_SECURITY_ERR_INVALID_PARAM:
+      return "Invalid parameters";
+    case BT_SECURITY_ERR_UNSPECIFIED:
+      return "Unspecified";
+    default:
+      return "Unknown";
+  }
+}
+
+static const char *const type_names[] = {
+  [EVTLOG_CONNECTED] = "connected",
+  [EVTLOG_DISCONNECTED] = "disconnected",
+  [EVTLOG_SECURITY_CHANGED] = "security_changed",
+  [EVTLOG_PAIRING_FEAT] = "pairing_feat",
+  [EVTLOG_PAIRING_FAILED] = "pairing_failed",
+  [EVTLOG_PAIRING_COMPLETE] = "pairing_complete",
+  [EVTLOG_BOND_DELETED] = "bond_deleted",
+  [EVTLOG_PARAM_UPDATED] = "param_updated",
+  [EVTLOG_PHY_UPDATED] = "phy_updated",
+  [EVTLOG_DATA_LEN_UPDATED] = "data_len_updated",
+};
+
+#define EVTLOG_FIELD(_key, _num) (struct output_field)OUTPUT_NUM(_key, _num)
+
+// same information as the text lines, raw values only
+static void evtlog_record(const struct evtlog_rec *rec, const char *addr){
+  struct output_field fields[7] = { OUTPUT_STR("addr", addr) };
+  size_t n = 1;
+
+  switch (rec->type) {
+  case EVTLOG_CONNECTED:
+  case EVTLOG_PAIRING_FAILED:
+    fields[n++] = EVTLOG_FIELD("err", rec->u8[0]);
+    break;
+  case EVTLOG_DISCONNECTED:
+    fields[n++] = EVTLOG_FIELD("reason", rec->u8[0]);
+    break;
+  case EVTLOG_SECURITY_CHANGED:
+    fields[n++] = EVTLOG_FIELD("level", rec->u8[0]);
+    fields[n++] = EVTLOG_FIELD("err", rec->u8[1]);
+    break;
+  case EVTLOG_PAIRING_FEAT:
+    fields[n++] = EVTLOG_FIELD("io", rec->u8[0]);
+    fields[n++] = EVTLOG_FIELD("oob", rec->u8[1]);
+    fields[n++] = EVTLOG_FIELD("auth", rec->u8[2]);
+    fields[n++] = EVTLOG_FIELD("key_size", rec->u8[3]);
+    fields[n++] = EVTLOG_FIELD("init_kdist", rec->u8[4]);
+    fields[n++] = EVTLOG_FIELD("resp_kdist", rec->u8[5]);
+    break;
+  case EVTLOG_PAIRING_COMPLETE:
+    fields[n++] = EVTLOG_FIELD("bonded", rec->u8[0]);
+    break;
+  case EVTLOG_BOND_DELETED:
+    fields[n++] = EVTLOG_FIELD("id", rec->u8[0]);
+    break;
+  case EVTLOG_PARAM_UPDATED:
+    fields[n++] = EVTLOG_FIELD("interval", rec->u16[0]);
+    fields[n++] = EVTLOG_FIELD("latency", rec->u16[1]);
+    fields[n++] = EVTLOG_FIELD("timeout", rec->u16[2]);
+    break;
+  case EVTLOG_PHY_UPDATED:
+    fields[n++] = EVTLOG_FIELD("tx_phy", rec->u8[0]);
+    fields[n++] = EVTLOG_FIELD("rx_phy", rec->u8[1]);
+    break;
+  case EVTLOG_DATA_LEN_UPDATED:
+    fields[n++] = EVTLOG_FIELD("tx_len", rec->u16[0]);
+    fields[n++] = EVTLOG_FIELD("tx_time", rec->u16[1]);
+    fields[n++] = EVTLOG_FIELD("rx_len", rec->u16[2]);
+    fields[n++] = EVTLOG_FIELD("rx_time", rec->u16[3]);
+    break;
+  }
+
+  output_record(type_names[rec->type], rec->ts_ms, rec->job, fields, n);
+}
+
+// same wording the callbacks printed before, host scripts match on it
+static void evtlog_print(const struct evtlog_rec *rec){
+  char addr[BT_ADDR_LE_STR_LEN];
+
+  bt_addr_le_to_str(&rec->addr, addr, sizeof(addr));
+
+  if (output_structured()) {
+    evtlog_record(rec, addr);
+    return;
+  }
+
+  switch (rec->type) {
+  case EVTLOG_CONNECTED:
+    if (rec->u8[0]) {
+      shell_error(shell, "connected(): Failed to connect to %s, reason: %d (%s)\n", addr, rec->u8[0],
+                  bt_hci_err_to_str(rec->u8[0]));
+    } else {
+      shell_print(shell, "Connected: %s", addr);
+    }
+    break;
+  case EVTLOG_DISCONNECTED:
+    shell_print(shell, "Disconnected: %s, reason 0x%02x %s\n", addr, rec->u8[0], bt_hci_err_to_str(rec->u8[0]));
+    break;
+  case EVTLOG_SECURITY_CHANGED:
+    if (!rec->u8[1]) {
+      shell_print(shell, "Security with %s changed to level %u", addr, rec->u8[0]);
+    } else {
+      shell_error(shell, "Security failed: %s level %u reason %d (%s)", addr, rec->u8[0], rec->u8[1],
+                  bt_hci_err_to_str(rec->u8[1]));
+    }
+    break;
+  case EVTLOG_PAIRING_FEAT:
+    shell_print(shell, "Remote pairing features: "
+                       "IO: 0x%02x, OOB: %d, AUTH: 0x%02x, Key: %d, "
+                       "Init Kdist: 0x%02x, Resp Kdist: 0x%02x",
+                rec->u8[0], rec->u8[1], rec->u8[2], rec->u8[3], rec->u8[4], rec->u8[5]);
+    break;
+  case EVTLOG_PAIRING_FAILED:
+    shell_print(shell, "Pairing failed with %s, reason: %d (%s)", addr, rec->u8[0], security_err_str(rec->u8[0]));
+    break;
+  case EVTLOG_PAIRING_COMPLETE:
+    shell_print(shell, "Pairing complete: %s with %s", rec->u8[0] ? "Bonded" : "Paired", addr);
+    break;
+  case EVTLOG_BOND_DELETED:
+    shell_print(shell, "Bond deleted for %s, id %u", addr, rec->u8[0]);
+    break;
+  case EVTLOG_PARAM_UPDATED:
+    shell_print(shell, "Connection parameters updated: interval %u us, latency %u, timeout %u ms",
+                rec->u16[0] * 1250U, rec->u16[1], rec->u16[2] * 10U);
+    break;
+  case EVTLOG_PHY_UPDATED:
+    shell_print(shell, "PHY updated: tx 0x%02x, rx 0x%02x", rec->u8[0], rec->u8[1]);
+    break;
+  case EVTLOG_DATA_LEN_UPDATED:
+    shell_print(shell, "Data length updated: tx %u bytes / %u us, rx %u bytes / %u us", rec->u16[0], rec->u16[1],
+                rec->u16[2], rec->u16[3]);
+    break;
+  }
+}
+
+static void evtlog_thread(void *p1, void *p2, void *p3){
+  struct evtlog_rec rec;
+
+  for (;;) {
+    k_sem_take(&evtlog_sem, K_FOREVER);
+
+    while (evtlog_get(&rec)) {
+      if (shell) {
+        evtlog_print(&rec);
+      }
+    }
+  }
+}
+
+K_THREAD_DEFINE(evtlog_tid, EVTLOG_STACK_SIZE, evtlog_thread, NULL, NULL, NULL, EVTLOG_PRIORITY, 0, 0);
+
+int cmd_evtlog(const struct shell *sh, size_t argc, char *argv[]){
+
+  if (argc > 1 && !strcmp(argv[1], "reset")) {
+    atomic_clear(&records);
+    atomic_clear(&drops);
+    atomic_clear(&high_water);
+  }
+
+  shell_print(sh, "event ring: %ld records, %ld dropped, %ld/%d slots used at most", atomic_get(&records),
+              atomic_get(&drops), atomic_get(&high_water), EVTLOG_RING_LEN);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define EVTLOG_RING_LEN     64                   // power of two
+#define EVTLOG_STACK_SIZE   2048
+#define EVTLOG_PRIORITY     K_PRIO_PREEMPT(14)   // below the worker, the shell catches up when nothing else runs
+
+enum evtlog_type {
+  EVTLOG_CONNECTED,           // u8[0]: HCI error, 0 on success
+  EVTLOG_DISCONNECTED,        // u8[0]: reason
+  EVTLOG_SECURITY_CHANGED,    // u8[0]: level, u8[1]: enum bt_security_err
+  EVTLOG_PAIRING_FEAT,        // u8[0..5]: io capability, oob, auth req, max key size, init and resp key dist
+  EVTLOG_PAIRING_FAILED,      // u8[0]: enum bt_security_err
+  EVTLOG_PAIRING_COMPLETE,    // u8[0]: bonded
+  EVTLOG_BOND_DELETED,        // u8[0]: identity
+  EVTLOG_PARAM_UPDATED,       // u16[0..2]: interval, latency, timeout
+  EVTLOG_PHY_UPDATED,         // u8[0]: tx phy, u8[1]: rx phy
+  EVTLOG_DATA_LEN_UPDATED,    // u16[0..3]: tx len, tx time, rx len, rx time
+};
+
+/* One callback as a fixed size binary record; formatting happens on the consumer thread */
+struct evtlog_rec {
+  uint32_t ts_ms;             // set by evtlog_put()
+  uint32_t job;               // set by evtlog_put(), id of the job running at the time
+  uint8_t type;
+  uint8_t u8[6];
+  bt_addr_le_t addr;
+  uint16_t u16[4];
+};
+
+void evtlog_put(struct evtlog_rec *rec);
+
+int cmd_evtlog(const struct shell *sh, size_t argc, char *argv[]);
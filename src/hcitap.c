@@ -0,0 +1,374 @@
+#include "hcitap.h"
+#include "main.h"
+
+#include <string.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/byteorder.h>
+#if defined(CONFIG_APP_HCI_TAP)
+#include <SEGGER_RTT.h>
+#endif
+
+/* Binary capture of the HCI traffic, SMP PDUs included, in place of the text SMP debug log. The host hands every HCI
+ * packet to the Bluetooth monitor (bt_monitor_send(), built with CONFIG_BT_MONITOR); the link step wraps that function
+ * (CONFIG_APP_HCI_TAP, overlay-hcitap.conf) so the packets land here. They are copied, cut to HCITAP_SNAP_LEN, into a
+ * byte ring with a microsecond timestamp; nothing is formatted in the host's context. A full ring drops the packet and
+ * counts it, the counter travels along in the btsnoop records.
+ *
+ * `capture dump` empties the ring, `capture stream on` keeps emptying it from a low priority thread. Both write to an
+ * RTT up-buffer of its own (HCITAP_RTT_CHANNEL): the shell's UART at 115200 baud carries less than 100 packets a
+ * second, a campaign produces more. The channel is a btsnoop file as it is (RFC 1761 style, datalink 1002: H4), the
+ * header is written by `capture start`, so a host logging the channel from before the start gets a file Wireshark
+ * opens. A record the host does not read in time is dropped and counted like an overrun of the ring.
+ *
+ * So the capture is not lossless: it misses packets when the ring overruns or the host falls behind, and the drop
+ * counter of the next record says how many went missing up to it. Only the consumer (the hcitap thread or the shell
+ * running `capture dump`) waits for the host; the producer side runs in the host's RX/TX context and never sleeps.
+ */
+
+#define HCITAP_MASK (HCITAP_RING_SIZE - 1)
+
+BUILD_ASSERT((HCITAP_RING_SIZE & HCITAP_MASK) == 0, "HCITAP_RING_SIZE must be a power of two");
+
+// Bluetooth monitor opcodes (btmon), packets only
+#define MONITOR_COMMAND_PKT  2
+#define MONITOR_EVENT_PKT    3
+#define MONITOR_ACL_TX_PKT   4
+#define MONITOR_ACL_RX_PKT   5
+#define MONITOR_ISO_TX_PKT   18
+#define MONITOR_ISO_RX_PKT   19
+
+#define H4_CMD  0x01
+#define H4_ACL  0x02
+#define H4_EVT  0x04
+#define H4_ISO  0x05
+
+#define BTSNOOP_FLAG_RX      BIT(0)
+#define BTSNOOP_FLAG_CMDEVT  BIT(1)
+#define BTSNOOP_DATALINK_H4  1002
+#define BTSNOOP_EPOCH_US     0x00dcddb30f2f8000ULL    // 1970-01-01 in microseconds since year 0, uptime counts from it
+
+#define L2CAP_CID_SMP        0x0006
+
+enum hcitap_mode {
+  HCITAP_ALL,
+  HCITAP_SMP,           // commands, events without advertising reports, ACL of the SMP channel
+};
+
+// in front of every packet in the ring
+struct hcitap_rec {
+  uint64_t ts_us;
+  uint32_t drops;       // cumulative, at the time of this packet
+  uint16_t orig_len;
+  uint8_t incl_len;
+  uint8_t h4;
+  uint8_t rx;
+};
+
+static uint8_t ring[HCITAP_RING_SIZE];
+static uint32_t head;   // both under tap_lock
+static uint32_t tail;
+static struct k_spinlock tap_lock;
+static K_MUTEX_DEFINE(drain_lock);      // one consumer at a time, dump or the stream thread
+static K_SEM_DEFINE(hcitap_sem, 0, 1);
+
+static bool capturing;
+static bool streaming;
+static enum hcitap_mode mode;
+static uint32_t packets;
+static uint32_t bytes;
+static uint32_t truncated;
+static uint32_t drops;
+static uint32_t high_water;
+
+// record buffer of the consumer: btsnoop record header, H4 type, packet
+static uint8_t out[24 + 1 + HCITAP_SNAP_LEN];
+
+// call with tap_lock held
+static void ring_write(uint32_t pos, const void *src, size_t len){
+  size_t first = MIN(len, HCITAP_RING_SIZE - (pos & HCITAP_MASK));
+
+  memcpy(&ring[pos & HCITAP_MASK], src, first);
+  memcpy(ring, (const uint8_t *)src + first, len - first);
+}
+
+// call with tap_lock held
+static void ring_read(uint32_t pos, void *dst, size_t len){
+  size_t first = MIN(len, HCITAP_RING_SIZE - (pos & HCITAP_MASK));
+
+  memcpy(dst, &ring[pos & HCITAP_MASK], first);
+  memcpy((uint8_t *)dst + first, ring, len - first);
+}
+
+static bool hcitap_keep(uint8_t h4, const uint8_t *data, size_t len){
+  if (mode == HCITAP_ALL) {
+    return true;
+  }
+
+  switch (h4) {
+  case H4_CMD:
+    return true;
+  case H4_EVT:
+    // LE meta: advertising, extended advertising and directed advertising reports of the scan
+    return !(len >= 3 && data[0] == 0x3e && (data[2] == 0x02 || data[2] == 0x0d || data[2] == 0x0b));
+  case H4_ACL:
+    // first fragment (packet boundary flag not 0b01) of an L2CAP frame on the SMP channel
+    return len >= 8 && ((data[1] >> 4) & 0x03) != 0x01 && sys_get_le16(&data[6]) == L2CAP_CID_SMP;
+  default:
+    return false;
+  }
+}
+
+static void hcitap_put(uint8_t h4, bool rx, const uint8_t *data, size_t len){
+  struct hcitap_rec rec = {
+    .ts_us = k_ticks_to_us_floor64(k_uptime_ticks()),
+    .orig_len = MIN(len, UINT16_MAX),
+    .incl_len = MIN(len, HCITAP_SNAP_LEN),
+    .h4 = h4,
+    .rx = rx,
+  };
+  bool stored = false;
+  uint32_t used;
+
+  K_SPINLOCK(&tap_lock) {
+    if (!capturing || !hcitap_keep(h4, data, len)) {
+      K_SPINLOCK_BREAK;
+    }
+
+    if (head - tail + sizeof(rec) + rec.incl_len > HCITAP_RING_SIZE) {
+      drops++;
+      K_SPINLOCK_BREAK;
+    }
+
+    rec.drops = drops;
+    ring_write(head, &rec, sizeof(rec));
+    ring_write(head + sizeof(rec), data, rec.incl_len);
+    head += sizeof(rec) + rec.incl_len;
+
+    packets++;
+    bytes += len;
+    truncated += rec.incl_len < len;
+    used = head - tail;
+    high_water = MAX(high_water, used);
+    stored = true;
+  }
+
+  if (stored && streaming) {
+    k_sem_give(&hcitap_sem);
+  }
+}
+
+#if defined(CONFIG_APP_HCI_TAP)
+/* Linked in place of the host's bt_monitor_send() (-Wl,--wrap). The monitor's own backend (RTT) does not get the
+ * packets then, its index and log messages still go out. Called in the host's RX/TX context: hcitap_put() only takes
+ * the spinlock and gives the semaphore, it never waits for the ring or the host.
+ */
+void __wrap_bt_monitor_send(uint16_t opcode, const void *data, size_t len){
+  switch (opcode) {
+  case MONITOR_COMMAND_PKT:
+    hcitap_put(H4_CMD, false, data, len);
+    break;
+  case MONITOR_EVENT_PKT:
+    hcitap_put(H4_EVT, true, data, len);
+    break;
+  case MONITOR_ACL_TX_PKT:
+  case MONITOR_ACL_RX_PKT:
+    hcitap_put(H4_ACL, opcode == MONITOR_ACL_RX_PKT, data, len);
+    break;
+  case MONITOR_ISO_TX_PKT:
+  case MONITOR_ISO_RX_PKT:
+    hcitap_put(H4_ISO, opcode == MONITOR_ISO_RX_PKT, data, len);
+    break;
+  }
+}
+#endif
+
+#if defined(CONFIG_APP_HCI_TAP)
+static uint8_t rtt_buf[HCITAP_RTT_BUF_SIZE];
+
+static int hcitap_rtt_init(void){
+  SEGGER_RTT_ConfigUpBuffer(HCITAP_RTT_CHANNEL, "hcitap", rtt_buf, sizeof(rtt_buf), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+  return 0;
+}
+
+SYS_INIT(hcitap_rtt_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+// all of data or nothing (skip mode); waits up to wait_ms for the host to make room, consumer side only
+static int hcitap_send(const uint8_t *data, size_t len, uint32_t wait_ms){
+  for (;;) {
+    if (SEGGER_RTT_Write(HCITAP_RTT_CHANNEL, data, len)) {
+      return 0;
+    }
+    if (!wait_ms--) {
+      return -EAGAIN;
+    }
+    k_msleep(1);
+  }
+}
+#else
+static int hcitap_send(const uint8_t *data, size_t len, uint32_t wait_ms){
+  return -ENOTSUP;
+}
+#endif
+
+static int hcitap_header(void){
+  uint8_t hdr[16] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+
+  sys_put_be32(1, &hdr[8]);
+  sys_put_be32(BTSNOOP_DATALINK_H4, &hdr[12]);
+  return hcitap_send(hdr, sizeof(hdr), HCITAP_SEND_WAIT_MS);
+}
+
+// next packet of the ring as a btsnoop record in out[], returns its length or 0 when the ring is empty
+static size_t hcitap_get(void){
+  struct hcitap_rec rec;
+  size_t len = 0;
+
+  K_SPINLOCK(&tap_lock) {
+    if (head == tail) {
+      K_SPINLOCK_BREAK;
+    }
+
+    ring_read(tail, &rec, sizeof(rec));
+    ring_read(tail + sizeof(rec), &out[25], rec.incl_len);
+    tail += sizeof(rec) + rec.incl_len;
+    len = 25 + rec.incl_len;
+  }
+
+  if (!len) {
+    return 0;
+  }
+
+  sys_put_be32(rec.orig_len + 1, &out[0]);
+  sys_put_be32(rec.incl_len + 1, &out[4]);
+  sys_put_be32((rec.rx ? BTSNOOP_FLAG_RX : 0) | (rec.h4 == H4_CMD || rec.h4 == H4_EVT ? BTSNOOP_FLAG_CMDEVT : 0),
+               &out[8]);
+  sys_put_be32(rec.drops, &out[12]);
+  sys_put_be64(BTSNOOP_EPOCH_US + rec.ts_us, &out[16]);
+  out[24] = rec.h4;
+
+  return len;
+}
+
+// returns the number of records sent; once the host stopped reading, the rest is dropped without waiting
+static uint32_t hcitap_drain(void){
+  uint32_t wait_ms = HCITAP_SEND_WAIT_MS;
+  uint32_t n = 0;
+  size_t len;
+
+  k_mutex_lock(&drain_lock, K_FOREVER);
+  while ((len = hcitap_get())) {
+    if (hcitap_send(out, len, wait_ms)) {
+      K_SPINLOCK(&tap_lock) {
+        drops++;
+      }
+      wait_ms = 0;
+      continue;
+    }
+    wait_ms = HCITAP_SEND_WAIT_MS;
+    n++;
+  }
+  k_mutex_unlock(&drain_lock);
+
+  return n;
+}
+
+static void hcitap_thread(void *p1, void *p2, void *p3){
+  for (;;) {
+    k_sem_take(&hcitap_sem, K_FOREVER);
+
+    if (streaming) {
+      hcitap_drain();
+    }
+  }
+}
+
+K_THREAD_DEFINE(hcitap_tid, HCITAP_STACK_SIZE, hcitap_thread, NULL, NULL, NULL, HCITAP_PRIORITY, 0, 0);
+
+static void hcitap_status(const struct shell *sh){
+  uint32_t used;
+
+  K_SPINLOCK(&tap_lock) {
+    used = head - tail;
+  }
+
+  shell_print(sh, "capture %s (%s)%s: %u packets, %u bytes, %u truncated to %d bytes, %u dropped, %u/%d bytes buffered, "
+              "%u at most", capturing ? "on" : "off", mode == HCITAP_SMP ? "smp" : "all",
+              streaming ? ", streaming" : "", packets, bytes, truncated, HCITAP_SNAP_LEN, drops, used,
+              HCITAP_RING_SIZE, high_water);
+  if (drops) {
+    shell_warn(sh, "the ring overran or the host did not read RTT channel %d, the capture misses %u packets",
+               HCITAP_RTT_CHANNEL, drops);
+  }
+}
+
+static void hcitap_clear(void){
+  K_SPINLOCK(&tap_lock) {
+    tail = head;
+    packets = 0;
+    bytes = 0;
+    truncated = 0;
+    drops = 0;
+    high_water = 0;
+  }
+}
+
+// capture start [all | smp] | stop | status | dump | stream <on | off> | clear
+int cmd_capture(const struct shell *sh, size_t argc, char *argv[]){
+
+  if (!IS_ENABLED(CONFIG_APP_HCI_TAP)) {
+    shell_error(sh, "built without the HCI tap, add overlay-hcitap.conf (-DEXTRA_CONF_FILE=overlay-hcitap.conf)");
+    return -ENOTSUP;
+  }
+
+  if (argc < 2 || !strcmp(argv[1], "status")) {
+    hcitap_status(sh);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "start")) {
+    if (argc > 2 && strcmp(argv[2], "all") && strcmp(argv[2], "smp")) {
+      shell_error(sh, "Usage: capture start [all | smp]");
+      return -EINVAL;
+    }
+
+    hcitap_clear();
+    if (hcitap_header()) {
+      shell_warn(sh, "RTT channel %d is not read, start the host's logger first for a complete file",
+                 HCITAP_RTT_CHANNEL);
+    }
+    K_SPINLOCK(&tap_lock) {
+      mode = argc > 2 && !strcmp(argv[2], "smp") ? HCITAP_SMP : HCITAP_ALL;
+      capturing = true;
+    }
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "stop")) {
+    K_SPINLOCK(&tap_lock) {
+      capturing = false;
+    }
+    hcitap_status(sh);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "clear")) {
+    hcitap_clear();
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "dump")) {
+    shell_print(sh, "%u packets written to RTT channel %d", hcitap_drain(), HCITAP_RTT_CHANNEL);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "stream") && argc > 2 && (!strcmp(argv[2], "on") || !strcmp(argv[2], "off"))) {
+    streaming = !strcmp(argv[2], "on");
+    if (streaming) {
+      k_sem_give(&hcitap_sem);
+    }
+    return 0;
+  }
+
+  shell_help(sh);
+  return SHELL_CMD_HELP_PRINTED;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#define HCITAP_RING_SIZE    16384                // bytes, power of two
+#define HCITAP_SNAP_LEN     128                  // bytes kept of a packet, whole SMP PDUs and the HCI around them
+#define HCITAP_STACK_SIZE   1536
+#define HCITAP_PRIORITY     K_PRIO_PREEMPT(13)   // below the worker, above the event log
+#define HCITAP_RTT_CHANNEL  2                    // 0: log (overlay-logdict.conf), 1: Bluetooth monitor
+#define HCITAP_RTT_BUF_SIZE 4096
+#define HCITAP_SEND_WAIT_MS 100                  // a host not reading the channel that long loses the record
+
+int cmd_capture(const struct shell *sh, size_t argc, char *argv[]);
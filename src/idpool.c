@@ -0,0 +1,183 @@
+#include "idpool.h"
+#include "main.h"
+#include "stats.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/crypto.h>
+
+/* Stage 2 needs a fresh identity per iteration. bt_id_reset(id, NULL, NULL) draws the address and the IRK from the
+ * controller's random number generator (HCI LE Rand) while the iteration waits. The pool draws them ahead of time on
+ * the system workqueue, so the iteration only applies a ready pair with bt_id_reset(id, addr, irk).
+ *
+ * bt_id_reset() also stores the new identity under "bt/id" and "bt/irk", which would cost a flash write per iteration
+ * no matter where the values came from. With the pool on, the bonding stages run with the RAM store (ramstore.c)
+ * even if it is off, so those writes are dropped and stage 3 commits the restored identity. What remains per
+ * iteration is the RPA of the new IRK, generated when the next connection starts.
+ *
+ * The central role always connects with the default identity (bt_conn_le_create() has no identity argument), so the
+ * pool rotates the values of BT_ID_DEFAULT instead of switching between CONFIG_BT_ID_MAX identity slots.
+ */
+
+static struct idpool_entry pool[IDPOOL_SIZE];
+static uint8_t pool_head;     // next entry to take
+static uint8_t pool_count;
+static struct k_spinlock pool_lock;
+static bool pool_on;
+static uint32_t pool_misses;  // iterations that fell back to a random reset because the pool was empty
+
+void bt_rpa_invalidate(void);
+
+static int idpool_generate(struct idpool_entry *entry){
+  int err;
+
+  err = bt_rand(entry->addr.a.val, sizeof(entry->addr.a.val));
+  if (err) {
+    return err;
+  }
+  entry->addr.type = BT_ADDR_LE_RANDOM;
+  BT_ADDR_SET_STATIC(&entry->addr.a);
+
+  return bt_rand(entry->irk, sizeof(entry->irk));
+}
+
+static void idpool_refill_handler(struct k_work *work){
+  struct idpool_entry entry;
+  bool full = false;
+
+  while (!full) {
+    if (idpool_generate(&entry)) {
+      shell_error(shell, "idpool: generating an identity failed");
+      return;
+    }
+
+    K_SPINLOCK(&pool_lock) {
+      if (pool_count < IDPOOL_SIZE) {
+        pool[(pool_head + pool_count) % IDPOOL_SIZE] = entry;
+        pool_count++;
+      }
+      full = pool_count == IDPOOL_SIZE;
+    }
+  }
+}
+
+static K_WORK_DEFINE(refill_work, idpool_refill_handler);
+
+bool idpool_enabled(void){
+  return pool_on;
+}
+
+int idpool_take(struct idpool_entry *entry){
+  int err = -ENOENT;
+  uint8_t left = 0;
+
+  K_SPINLOCK(&pool_lock) {
+    if (pool_count) {
+      *entry = pool[pool_head];
+      pool_head = (pool_head + 1) % IDPOOL_SIZE;
+      pool_count--;
+      err = 0;
+    } else {
+      pool_misses++;
+    }
+    left = pool_count;
+  }
+
+  if (left < IDPOOL_LOW_MARK) {
+    k_work_submit(&refill_work);
+  }
+
+  return err;
+}
+
+/* Times n identity changes with freshly drawn values against n with pool values. The identity in use before is put
+ * back afterwards, but the RPA is renewed, so do not run it in the middle of a campaign.
+ */
+static int idpool_bench(const struct shell *sh, int n){
+  struct idpool_entry saved, entry;
+  uint64_t sum_reset = 0, sum_pool = 0;
+  uint32_t max_reset = 0, max_pool = 0, us;
+  stats_ts_t start;
+  int done = 0;
+  int err;
+
+  if (worker_busy()) {
+    shell_error(sh, "a job is running, try again when it finished");
+    return -EBUSY;
+  }
+
+  bt_get_identity(BT_ID_DEFAULT, &saved.addr);
+  bt_get_irk(BT_ID_DEFAULT, saved.irk);
+
+  for (int i = 0; i < n; i++) {
+    start = stats_now();
+    err = bt_id_reset(BT_ID_DEFAULT, NULL, NULL);
+    bt_rpa_invalidate();
+    us = stats_span_us(start, stats_now());
+    if (err < 0) {
+      break;
+    }
+    sum_reset += us;
+    max_reset = MAX(max_reset, us);
+
+    // pair generation is not part of the measurement, that is what the refill work does ahead of time
+    err = idpool_generate(&entry);
+    if (err) {
+      break;
+    }
+    start = stats_now();
+    err = bt_id_reset(BT_ID_DEFAULT, &entry.addr, entry.irk);
+    bt_rpa_invalidate();
+    us = stats_span_us(start, stats_now());
+    if (err < 0) {
+      break;
+    }
+    sum_pool += us;
+    max_pool = MAX(max_pool, us);
+    done++;
+  }
+
+  bt_id_reset(BT_ID_DEFAULT, &saved.addr, saved.irk);
+  bt_rpa_invalidate();
+
+  if (!done) {
+    shell_error(sh, "identity reset failed (err %d)", err);
+    return err;
+  }
+
+  shell_print(sh, "%-14s %6s %10s %10s  (us)", "path", "n", "mean", "max");
+  shell_print(sh, "%-14s %6d %10u %10u", "random reset", done, (uint32_t)(sum_reset / done), max_reset);
+  shell_print(sh, "%-14s %6d %10u %10u", "pool", done, (uint32_t)(sum_pool / done), max_pool);
+
+  return 0;
+}
+
+int cmd_idpool(const struct shell *sh, size_t argc, char *argv[]){
+  uint8_t count;
+  uint32_t misses;
+
+  if (argc > 1 && !strcmp(argv[1], "on")) {
+    pool_on = true;
+    k_work_submit(&refill_work);
+  } else if (argc > 1 && !strcmp(argv[1], "off")) {
+    pool_on = false;
+  } else if (argc > 1 && !strcmp(argv[1], "fill")) {
+    k_work_submit(&refill_work);
+  } else if (argc > 1 && !strcmp(argv[1], "bench")) {
+    stats_init();
+    return idpool_bench(sh, argc > 2 ? CLAMP(atoi(argv[2]), 1, 100) : 10);
+  } else if (argc > 1) {
+    shell_help(sh);
+    return SHELL_CMD_HELP_PRINTED;
+  }
+
+  K_SPINLOCK(&pool_lock) {
+    count = pool_count;
+    misses = pool_misses;
+  }
+
+  shell_print(sh, "identity pool %s: %u/%u ready, %u misses", pool_on ? "on" : "off", count, IDPOOL_SIZE, misses);
+  return 0;
+}
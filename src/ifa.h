@@ -18,16 +18,68 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/shell/shell.h>
 
-extern struct k_sem conn_sem;
-extern struct k_sem disconn_sem;
-extern struct k_sem bond_sem;
+struct bt_conn;  // forward declaration (sufficient for pointer)
+
+/* Events fed into the ifa state machine by the Bluetooth callbacks in main.c */
+enum ifa_evt_type {
+  IFA_EVT_CONNECTED,         // status: HCI error of the connection attempt
+  IFA_EVT_DISCONNECTED,      // status: HCI disconnect reason
+  IFA_EVT_PAIRING_FEAT,      // status: max key size of the remote pairing features (pairing_accept)
+  IFA_EVT_SECURITY_CHANGED,  // status: enum bt_security_err
+  IFA_EVT_PAIRING_COMPLETE,  // status: 1 if bonded
+  IFA_EVT_PAIRING_FAILED,    // status: enum bt_security_err
+  IFA_EVT_BOND_DELETED,
+};
+
+void ifa_notify(enum ifa_evt_type type, struct bt_conn *conn, int status);
+
+struct worker_job;
+
+struct ifa_status {
+  const char *stage;
+  const char *step;
+  const char *phase;
+  int iter;                  // 1-based stage 2 iteration, 0 outside stage 2
+  int n;
+  uint8_t attempt;
+  bt_addr_le_t target;
+};
+
+/* sessions run side by side, one link each */
+#define IFA_SESSIONS_MAX  CONFIG_BT_MAX_CONN
+
+struct ifa_check_result {
+  int err;
+  uint8_t sec_level;
+  uint8_t enc_key_size;
+  uint8_t sec_flags;         // enum bt_security_flag: Secure Connections, OOB
+  uint8_t remote_key_size;   // 0 if the DUT never sent its pairing features
+  uint8_t sec_err;           // enum bt_security_err if pairing failed
+  bool connect_failed;       // the DUT could not be connected to, err is the connect step's
+  uint32_t duration_ms;      // start of the run until the link was secured
+};
 
 void ifa_init(const struct shell *sh);
 
+int ifa_get_status(uint8_t idx, struct ifa_status *st);
+int ifa_pair(const struct worker_job *job);
+int ifa_check(const bt_addr_le_t *duts, uint8_t n, uint8_t profile, struct ifa_check_result *results);
+int ifa_wait_disconnected(const bt_addr_le_t *addr);
+int ifa_resume(const struct shell *sh);
+const char *ifa_stage_name(uint8_t stage);
+
+int ifa_abort(void);
+int cmd_ifa_abort(const struct shell *sh, size_t argc, char *argv[]);
+int cmd_ifa_timeout(const struct shell *sh, size_t argc, char *argv[]);
+int cmd_ifa_restore_mode(const struct shell *sh, size_t argc, char *argv[]);
+int cmd_ifa_connect_mode(const struct shell *sh, size_t argc, char *argv[]);
+int cmd_ifa_pace(const struct shell *sh, size_t argc, char *argv[]);
+
 int cmd_reset(const struct shell *sh, size_t argc, char *argv[]);
 
 int cmd_ifa_id_save();
 int cmd_ifa_id_restore();
+int ifa_id_set(const bt_addr_le_t *addr, const uint8_t irk[16]);
 
 int cmd_ifa_snapshot_take(const struct shell *sh, size_t argc, char *argv[]);
 int cmd_ifa_snapshot_restore();
@@ -37,7 +89,8 @@ int cmd_ifa_stage1_periph(const struct shell *sh);
 int cmd_ifa_stage2(const struct shell *sh, size_t argc, char *argv[]);
 int cmd_ifa_stage2_1_periph(const struct shell *sh);
 int cmd_ifa_stage2_2_periph(const struct shell *sh);
+int cmd_ifa_periph(const struct shell *sh, size_t argc, char *argv[]);
 int cmd_ifa_stage3(const struct shell *sh, size_t argc, char *argv[]);
 int cmd_ifa_stage4(const struct shell *sh, size_t argc, char *argv[]);
 
-int cmd_ifa(const struct shell *sh, size_t argc, char *argv[]);
\ No newline at end of file
+int cmd_ifa(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,189 @@
+#include "knob.h"
+#include "dut.h"
+#include "ifa.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* KNOB key size sweep. For every size of the range the DUT is paired with from scratch (connect, pair, report,
+ * disconnect, unpair: the check stage) while we offer at most that many bytes of entropy. Every size starts without a
+ * link to the DUT, a link the check left behind is taken down first. A DUT that enforces a minimum
+ * key size rejects the small ones with a pairing failure; one that accepts ends up with the reduced size. The size set
+ * before the sweep is put back at the end. Sizes above the max key size the DUT announced in an earlier pairing (dut
+ * cache) would all negotiate that maximum and are skipped.
+ */
+
+#define KNOB_SIZES  (KNOB_KEY_SIZE_MAX - KNOB_KEY_SIZE_MIN + 1)
+
+static uint8_t key_size = KNOB_KEY_SIZE_MAX;
+
+void knob_set(uint8_t size){
+  bt_smp_set_enc_key_size(size);
+  key_size = size;
+}
+
+uint8_t knob_get(void){
+  return key_size;
+}
+
+struct knob_cell {
+  uint8_t size;
+  struct ifa_check_result res;
+};
+
+static void knob_output(const bt_addr_le_t *dut, const struct knob_cell *cell){
+  char addr[BT_ADDR_LE_STR_LEN];
+  struct output_field fields[] = {
+    OUTPUT_STR("addr", addr),
+    OUTPUT_NUM("size", cell->size),
+    OUTPUT_NUM("err", cell->res.err),
+    OUTPUT_NUM("connected", !cell->res.connect_failed),
+    OUTPUT_NUM("sec_err", cell->res.sec_err),
+    OUTPUT_NUM("key_size", cell->res.enc_key_size),
+    OUTPUT_NUM("dut_max", cell->res.remote_key_size),
+    OUTPUT_NUM("level", cell->res.sec_level),
+  };
+
+  bt_addr_le_to_str(dut, addr, sizeof(addr));
+  output_record("knob_cell", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+}
+
+/* One column per key size:
+ *   accepted  y: paired with that size, n: DUT refused to pair, c: DUT not connected, ?: no answer (timeout, ...)
+ *   reason    enum bt_security_err of the refusal, otherwise the errno of the failed step
+ */
+static void knob_print(const struct knob_cell *cells, uint8_t n){
+  static const char *const rows[] = { "key size", "accepted", "negotiated", "dut max", "level", "reason" };
+  char line[12 + 5 * KNOB_SIZES + 1];
+  size_t len;
+
+  for (uint8_t r = 0; r < ARRAY_SIZE(rows); r++) {
+    len = snprintk(line, sizeof(line), "%-12s", rows[r]);
+
+    for (uint8_t i = 0; i < n; i++) {
+      const struct ifa_check_result *res = &cells[i].res;
+      char val[6] = "-";
+
+      switch (r) {
+      case 0:
+        snprintk(val, sizeof(val), "%u", cells[i].size);
+        break;
+      case 1:
+        strcpy(val, !res->err ? "y" : res->sec_err ? "n" : res->connect_failed ? "c" : "?");
+        break;
+      case 2:
+        if (!res->err) {
+          snprintk(val, sizeof(val), "%u", res->enc_key_size);
+        }
+        break;
+      case 3:
+        if (res->remote_key_size) {
+          snprintk(val, sizeof(val), "%u", res->remote_key_size);
+        }
+        break;
+      case 4:
+        if (!res->err) {
+          snprintk(val, sizeof(val), "%u", res->sec_level);
+        }
+        break;
+      case 5:
+        if (res->sec_err || res->err) {
+          snprintk(val, sizeof(val), "%d", res->sec_err ? res->sec_err : res->err);
+        }
+        break;
+      }
+
+      len += snprintk(&line[len], sizeof(line) - len, "%5s", val);
+    }
+
+    shell_print(shell, "%s", line);
+  }
+}
+
+static int knob_sweep_job(const struct worker_job *job){
+  struct knob_cell cells[KNOB_SIZES];
+  struct dut_info info;
+  uint8_t prev = knob_get();
+  uint8_t last = job->range[1];
+  uint8_t n = 0;
+  int err = 0;
+
+  if (!dut_lookup(&job->addr, &info) && (info.flags & DUT_HAS_FEAT) && info.max_key_size < last) {
+    last = MAX(info.max_key_size, job->range[0]);
+    shell_print(shell, "DUT announced max key size %u before, sweeping %u..%u", info.max_key_size, job->range[0],
+                last);
+  }
+
+  for (uint8_t size = job->range[0]; size <= last; size++) {
+    struct knob_cell *cell = &cells[n];
+
+    err = ifa_wait_disconnected(&job->addr);
+    if (err) {
+      shell_error(shell, "link to the DUT does not go down (%d), sweep stopped", err);
+      break;
+    }
+    n++;
+
+    // an old bond would only be re-encrypted, pair from scratch
+    bt_unpair(BT_ID_DEFAULT, &job->addr);
+    knob_set(size);
+
+    cell->size = size;
+    ifa_check(&job->addr, 1, job->profile, &cell->res);
+
+    if (output_structured()) {
+      knob_output(&job->addr, cell);
+    }
+
+    if (cell->res.err == -ECANCELED) {
+      err = -ECANCELED;
+      break;
+    }
+  }
+
+  knob_set(prev);
+
+  if (!output_structured()) {
+    knob_print(cells, n);
+  }
+
+  return err;
+}
+
+// knob sweep <addr> <type> [min max]
+int cmd_knob_sweep(const struct shell *sh, size_t argc, char *argv[]){
+  struct worker_job job = {
+    .name = "knob sweep",
+    .run = knob_sweep_job,
+    .range = { KNOB_KEY_SIZE_MIN, KNOB_KEY_SIZE_MAX },
+  };
+  int err;
+
+  if (argc != 3 && argc != 5) {
+    shell_error(sh, "Usage: knob sweep <address> <type> [min max]");
+    return -EINVAL;
+  }
+
+  err = bt_addr_le_from_str(argv[1], argv[2], &job.addr);
+  if (err < 0) {
+    shell_error(sh, "Invalid peer address (err %d)", err);
+    return err;
+  }
+
+  if (argc == 5) {
+    long min = strtol(argv[3], NULL, 10);
+    long max = strtol(argv[4], NULL, 10);
+
+    if (min < KNOB_KEY_SIZE_MIN || max > KNOB_KEY_SIZE_MAX || min > max) {
+      shell_error(sh, "key sizes must be %d <= min <= max <= %d", KNOB_KEY_SIZE_MIN, KNOB_KEY_SIZE_MAX);
+      return -EINVAL;
+    }
+    job.range[0] = min;
+    job.range[1] = max;
+  }
+
+  return worker_submit(sh, &job);
+}
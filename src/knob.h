@@ -0,0 +1,12 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#define KNOB_KEY_SIZE_MIN  7
+#define KNOB_KEY_SIZE_MAX  16
+
+void knob_set(uint8_t key_size);
+uint8_t knob_get(void);
+
+int cmd_knob_sweep(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,98 @@
+#include "logstat.h"
+#include "output.h"
+#include "worker.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log_backend.h>
+#include <zephyr/logging/log_msg.h>
+
+/* Counts what goes through the log core, for comparing logging profiles (prj.conf: text through the shell backend,
+ * overlay-logdict.conf: dictionary over RTT). A backend of its own sees every message the other backends process and
+ * every drop the core reports, without touching them: messages, their size in the log buffer and the drops. The CPU
+ * time of the deferred processing thread ("logging") comes from the thread runtime stats; formatting text or writing
+ * dictionary records happens there, so it is the cost that differs between the profiles. Bytes on the wire are counted
+ * on the host (size of the captured RTT/UART log divided by the messages counted here), see the README.
+ */
+
+static atomic_t msgs;
+static atomic_t msg_bytes;
+static atomic_t dropped;
+static uint64_t log_cycles_base;      // thread cycles at the last reset
+
+static void logstat_process(const struct log_backend *const backend, union log_msg_generic *msg){
+  atomic_inc(&msgs);
+  atomic_add(&msg_bytes, log_msg_generic_get_wlen((union mpsc_pbuf_generic *)msg) * sizeof(uint32_t));
+}
+
+static void logstat_dropped(const struct log_backend *const backend, uint32_t cnt){
+  atomic_add(&dropped, cnt);
+}
+
+static void logstat_panic(const struct log_backend *const backend){
+}
+
+static const struct log_backend_api logstat_api = {
+  .process = logstat_process,
+  .dropped = logstat_dropped,
+  .panic = logstat_panic,
+};
+
+LOG_BACKEND_DEFINE(log_backend_stats, logstat_api, true);
+
+static void logstat_find(const struct k_thread *thread, void *user_data){
+  const char *name = k_thread_name_get((k_tid_t)thread);
+  k_thread_runtime_stats_t rt;
+
+  if (name && !strcmp(name, "logging") && !k_thread_runtime_stats_get((k_tid_t)thread, &rt)) {
+    *(uint64_t *)user_data = rt.execution_cycles;
+  }
+}
+
+// execution cycles of the log processing thread, 0 without runtime stats or thread (immediate mode)
+static uint64_t logstat_cycles(void){
+  uint64_t cycles = 0;
+
+  if (IS_ENABLED(CONFIG_THREAD_RUNTIME_STATS) && IS_ENABLED(CONFIG_THREAD_NAME)) {
+    k_thread_foreach(logstat_find, &cycles);
+  }
+
+  return cycles;
+}
+
+void logstat_reset(void){
+  atomic_clear(&msgs);
+  atomic_clear(&msg_bytes);
+  atomic_clear(&dropped);
+  log_cycles_base = logstat_cycles();
+}
+
+void logstat_print(const struct shell *sh){
+  uint32_t n = atomic_get(&msgs);
+  uint32_t bytes = atomic_get(&msg_bytes);
+  uint32_t drops = atomic_get(&dropped);
+  uint32_t cpu_us = (uint32_t)k_cyc_to_us_floor64(logstat_cycles() - log_cycles_base);
+
+  if (output_structured()) {
+    struct output_field fields[] = {
+      OUTPUT_NUM("msgs", n),
+      OUTPUT_NUM("bytes", bytes),
+      OUTPUT_NUM("dropped", drops),
+      OUTPUT_NUM("cpu_us", cpu_us),
+    };
+
+    output_record("log", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+    return;
+  }
+
+  if (!IS_ENABLED(CONFIG_THREAD_RUNTIME_STATS) || !IS_ENABLED(CONFIG_THREAD_NAME)) {
+    shell_print(sh, "log: %u messages, %u bytes buffered (%u per message), %u dropped, log thread CPU time needs "
+                "overlay-cpustats.conf", n, bytes, n ? bytes / n : 0, drops);
+  } else {
+    shell_print(sh, "log: %u messages, %u bytes buffered (%u per message), %u dropped, %u us in the log thread "
+                "(%u per message)", n, bytes, n ? bytes / n : 0, drops, cpu_us, n ? cpu_us / n : 0);
+  }
+  if (drops) {
+    shell_warn(sh, "%u log messages dropped", drops);
+  }
+}
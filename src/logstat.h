@@ -0,0 +1,6 @@
+#pragma once
+
+#include <zephyr/shell/shell.h>
+
+void logstat_reset(void);
+void logstat_print(const struct shell *sh);
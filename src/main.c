@@ -24,39 +24,32 @@
 #include <zephyr/settings/settings.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/shell/shell.h>
+#include <zephyr/shell/shell_dummy.h>
+#include <zephyr/shell/shell_uart.h>
+#include "campaign.h"
+#include "conn_profile.h"
+#include "dut.h"
+#include "hcitap.h"
+#include "evtlog.h"
+#include "idpool.h"
+#include "output.h"
+#include "pairmatrix.h"
 #include "ifa.h"
+#include "knob.h"
+#include "ramstore.h"
+#include "scan.h"
+#include "script.h"
+#include "session.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "worker.h"
 
 struct bt_conn *default_conn;
 uint8_t selected_id = BT_ID_DEFAULT;
 const struct shell *shell;
+bool scda_downgrade;
 static bool is_connected = false;
 
-static const char *security_err_str(enum bt_security_err err)
-{
-	switch (err) {
-		case BT_SECURITY_ERR_SUCCESS:
-			return "Success";
-		case BT_SECURITY_ERR_AUTH_FAIL:
-			return "Authentication failure";
-		case BT_SECURITY_ERR_PIN_OR_KEY_MISSING:
-			return "PIN or key missing";
-		case BT_SECURITY_ERR_OOB_NOT_AVAILABLE:
-			return "OOB not available";
-		case BT_SECURITY_ERR_AUTH_REQUIREMENT:
-			return "Authentication requirements";
-		case BT_SECURITY_ERR_PAIR_NOT_SUPPORTED:
-			return "Pairing not supported";
-		case BT_SECURITY_ERR_PAIR_NOT_ALLOWED:
-			return "Pairing not allowed";
-		case BT_SECURITY_ERR_INVALID_PARAM:
-			return "Invalid parameters";
-		case BT_SECURITY_ERR_UNSPECIFIED:
-			return "Unspecified";
-		default:
-			return "Unknown";
-	}
-}
-
 static const struct bt_data ad[] = {
 	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
 	BT_DATA_BYTES(BT_DATA_UUID16_ALL,
@@ -84,8 +77,7 @@ static int advertising_start(void)
 // wrapper for calling from outside
 int w_advertising_start(void)
 {
-	advertising_start();
-	return 0;
+	return advertising_start();
 }
 
 static int advertising_stop(void)
@@ -122,83 +114,12 @@ static int cmd_advertise(const struct shell *sh, size_t argc, char *argv[])
 	}
 }
 
-// as soon as the callback function is called it listens to adv events until stop_advertising() is called
-static void scan_started(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
-			 struct net_buf_simple *ad)
-{
-	char dev[BT_ADDR_LE_STR_LEN];
-	//int err;
-
-	/* We're only interested in connectable events */
-	if (type != BT_GAP_ADV_TYPE_ADV_IND &&
-		type != BT_GAP_ADV_TYPE_ADV_DIRECT_IND) {
-		return;
-	}
-
-	/* connect only to devices in close proximity */
-	if (rssi > -50) {
-		bt_addr_le_to_str(addr, dev, sizeof(dev));
-
-		shell_print(shell, "[DEVICE]: %s, AD evt type %u, AD data len %u, RSSI %i",
-		   dev, type, ad->len, rssi);
-	}
-}
-
-static int scan_start(void)
-{
-	int err = bt_le_scan_start(BT_LE_SCAN_ACTIVE, scan_started);
-	if (err) {
-		shell_error(shell,"Scanning failed to start, reason: %d (%s)", err, bt_hci_err_to_str(err));
-		return err;
-	} else {
-		shell_print(shell,"Scanning successfully started");
-	}
-
-	return 0;
-}
-
-static int scan_stop(void)
-{
-	int err = bt_le_scan_stop();
-
-	if (err) {
-		shell_error(shell, "Stopping scanning failed, reason: %d (%s)", err, bt_hci_err_to_str(err));
-		return err;
-	} else {
-		shell_print(shell, "Scan successfully stopped");
-	}
-
-	return 0;
-}
-
-static int cmd_scan(const struct shell *sh, size_t argc, char *argv[])
-{
-	const char *action = argv[1];
-
-	if (argc != 2) {
-		shell_error(sh, "Wrong number of arguments.");
-		shell_help(sh);
-		return SHELL_CMD_HELP_PRINTED;
-	}
-
-	if (!strcmp(action, "start")) {
-		return scan_start();
-	}
-
-	if (!strcmp(action, "stop")) {
-		return scan_stop();
-	}
-
-	shell_help(sh);
-	return SHELL_CMD_HELP_PRINTED;
-}
-
 static int cmd_connect(const struct shell *sh, size_t argc, char *argv[])
 {
 	int err;
 	bt_addr_le_t addr;
 	struct bt_conn *conn = NULL;
-	uint32_t options = 0;
+	int profile = CONN_PROFILE_SELECTED;
 
 	err = bt_addr_le_from_str(argv[1], argv[2], &addr);
 	if (err) {
@@ -206,12 +127,15 @@ static int cmd_connect(const struct shell *sh, size_t argc, char *argv[])
 		return err;
 	}
 
-	struct bt_conn_le_create_param *create_params =
-		BT_CONN_LE_CREATE_PARAM(options,
-					BT_GAP_SCAN_FAST_INTERVAL,
-					BT_GAP_SCAN_FAST_INTERVAL);
+	if (argc > 3) {
+		profile = conn_profile_parse(argv[3]);
+		if (profile < 0) {
+			shell_error(sh, "Unknown connection profile %s", argv[3]);
+			return profile;
+		}
+	}
 
-	err = bt_conn_le_create(&addr, create_params, BT_LE_CONN_PARAM_DEFAULT, &conn);
+	err = conn_profile_create(&addr, profile, &conn);
 
 	if (err) {
 		shell_error(sh, "Connection failed (%s)", bt_hci_err_to_str(err));
@@ -267,49 +191,63 @@ static int cmd_disconnect(const struct shell *sh, size_t argc, char *argv[])
 	return 0;
 }
 
+/* The callbacks below run in the Bluetooth host context: they only notify the ifa runner and put a record into the
+ * event ring, the text is printed by the evtlog thread.
+ */
+
 static void connected(struct bt_conn *conn, uint8_t err)
 {
 	struct bt_conn_info conn_info;
-	char addr[BT_ADDR_LE_STR_LEN];
+	struct evtlog_rec rec = {
+		.type = EVTLOG_CONNECTED,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { err },
+	};
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	ifa_notify(IFA_EVT_CONNECTED, conn, err);
+	evtlog_put(&rec);
 
 	if (err) {
-		shell_error(shell, "connected(): Failed to connect to %s, reason: %d (%s)\n", addr, err,
-			   bt_hci_err_to_str(err));
-		bt_conn_unref(default_conn);
-		default_conn = NULL;
-		conn = NULL;
+		conn_profile_failed();
+		// a cancelled connect of an ifa session, or another session's link, is not default_conn
+		if (default_conn == conn) {
+			bt_conn_unref(default_conn);
+			default_conn = NULL;
+		}
 		return;
 	}
 
-	shell_print(shell,"Connected: %s", addr);
-
 	int info_err = bt_conn_get_info(conn, &conn_info);
 	if (info_err) {
-		shell_error(shell, "Failed to get connection info, reason: %d (%s).\n", info_err, bt_hci_err_to_str(info_err));
 		return;
 	}
+	dut_note_conn(bt_conn_get_dst(conn), conn_info.le.interval, conn_info.le.latency, conn_info.le.timeout);
 
 	if (default_conn) {
 		bt_conn_unref(default_conn);
 	}
 	default_conn = bt_conn_ref(conn);
 	is_connected = true;
-	k_sem_give(&conn_sem); 	// Signal that connection is complete
+
+	conn_profile_connected(conn);
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
 	struct bt_conn_info conn_info;
-	char addr[BT_ADDR_LE_STR_LEN];
+	struct evtlog_rec rec = {
+		.type = EVTLOG_DISCONNECTED,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { reason },
+	};
 	int err;
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	ifa_notify(IFA_EVT_DISCONNECTED, conn, reason);
+	// every link, the sessions of a parallel check run on others than default_conn
+	evtlog_put(&rec);
 
 	err = bt_conn_get_info(conn, &conn_info);
 	if (err) {
-		shell_error(shell, "Failed to get connection info, reason: %d (%s).\n", err, bt_hci_err_to_str(err));
 		return;
 	}
 
@@ -319,59 +257,94 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 
 	bt_conn_unref(default_conn);
 	default_conn = NULL;
+}
 
-	k_sem_give(&disconn_sem); // Signal that disconnection is complete
+static void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
+{
+	struct evtlog_rec rec = {
+		.type = EVTLOG_SECURITY_CHANGED,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { level, err },
+	};
+
+	ifa_notify(IFA_EVT_SECURITY_CHANGED, conn, err);
+	evtlog_put(&rec);
+}
 
-	shell_print(shell,"Disconnected: %s, reason 0x%02x %s\n", addr, reason, bt_hci_err_to_str(reason));
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+	struct evtlog_rec rec = {
+		.type = EVTLOG_PARAM_UPDATED,
+		.addr = *bt_conn_get_dst(conn),
+		.u16 = { interval, latency, timeout },
+	};
+
+	dut_note_conn(bt_conn_get_dst(conn), interval, latency, timeout);
+	evtlog_put(&rec);
 }
 
-static void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
+	struct evtlog_rec rec = {
+		.type = EVTLOG_PHY_UPDATED,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { param->tx_phy, param->rx_phy },
+	};
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	evtlog_put(&rec);
+}
 
-	if (!err) {
-		shell_print(shell, "Security with %s changed to level %u", addr, level);
-	} else {
-		shell_error(shell, "Security failed: %s level %u reason %d (%s)", addr, level, err, bt_hci_err_to_str(err));
-	}
-	k_sleep(K_MSEC(500));
-	k_sem_give(&bond_sem); // Signal that bonding is complete
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+	struct evtlog_rec rec = {
+		.type = EVTLOG_DATA_LEN_UPDATED,
+		.addr = *bt_conn_get_dst(conn),
+		.u16 = { info->tx_max_len, info->tx_max_time, info->rx_max_len, info->rx_max_time },
+	};
+
+	evtlog_put(&rec);
 }
 
 
 enum bt_security_err pairing_accept(
 	struct bt_conn *conn, const struct bt_conn_pairing_feat *const feat)
 {
-	shell_print(shell, "Remote pairing features: "
-				   "IO: 0x%02x, OOB: %d, AUTH: 0x%02x, Key: %d, "
-				   "Init Kdist: 0x%02x, Resp Kdist: 0x%02x",
-				   feat->io_capability, feat->oob_data_flag,
-				   feat->auth_req, feat->max_enc_key_size,
-				   feat->init_key_dist, feat->resp_key_dist);
+	struct evtlog_rec rec = {
+		.type = EVTLOG_PAIRING_FEAT,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { feat->io_capability, feat->oob_data_flag, feat->auth_req, feat->max_enc_key_size,
+			feat->init_key_dist, feat->resp_key_dist },
+	};
+
+	ifa_notify(IFA_EVT_PAIRING_FEAT, conn, feat->max_enc_key_size);
+	dut_note_feat(bt_conn_get_dst(conn), feat);
+	evtlog_put(&rec);
 
 	return BT_SECURITY_ERR_SUCCESS;
 }
 
 static void pairing_failed(struct bt_conn *conn, enum bt_security_err err)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-	shell_print(shell, "Pairing failed with %s, reason: %d (%s)", addr, err,
-			security_err_str(err));
+	struct evtlog_rec rec = {
+		.type = EVTLOG_PAIRING_FAILED,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { err },
+	};
+
+	ifa_notify(IFA_EVT_PAIRING_FAILED, conn, err);
+	evtlog_put(&rec);
 }
 
 static void pairing_complete(struct bt_conn *conn, bool bonded)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-	shell_print(shell, "Pairing complete: %s with %s", bonded ? "Bonded" : "Paired",
-			addr);
+	struct evtlog_rec rec = {
+		.type = EVTLOG_PAIRING_COMPLETE,
+		.addr = *bt_conn_get_dst(conn),
+		.u8 = { bonded },
+	};
+
+	ifa_notify(IFA_EVT_PAIRING_COMPLETE, conn, bonded);
+	evtlog_put(&rec);
 }
 
 static void bond_info(const struct bt_bond_info *info, void *user_data)
@@ -397,10 +370,14 @@ static int cmd_bonds(const struct shell *sh)
 
 void bond_deleted(uint8_t id, const bt_addr_le_t *peer)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-
-	bt_addr_le_to_str(peer, addr, sizeof(addr));
-	shell_print(shell, "Bond deleted for %s, id %u", addr, id);
+	struct evtlog_rec rec = {
+		.type = EVTLOG_BOND_DELETED,
+		.addr = *peer,
+		.u8 = { id },
+	};
+
+	ifa_notify(IFA_EVT_BOND_DELETED, NULL, id);
+	evtlog_put(&rec);
 }
 
 static int cmd_pairing_delete(const struct shell *sh, size_t argc, char *argv[])
@@ -408,6 +385,11 @@ static int cmd_pairing_delete(const struct shell *sh, size_t argc, char *argv[])
 	bt_addr_le_t addr;
 	int err;
 
+	err = ramstore_refuse(sh);
+	if (err) {
+		return err;
+	}
+
 	if (strcmp(argv[1], "all") == 0) {
 		err = bt_unpair(selected_id, NULL);
 		if (err) {
@@ -463,16 +445,38 @@ static int cmd_security(const struct shell *sh)
 }
 
 static int cmd_pair(const struct shell *sh, size_t argc, char *argv[]){
-	cmd_connect(sh, argc, argv);
-	k_sleep(K_SECONDS(2));
-	cmd_security(sh);
-	return 0;
+	struct worker_job job = {
+		.name = "pair",
+		.run = ifa_pair,
+	};
+	int err;
+
+	err = bt_addr_le_from_str(argv[1], argv[2], &job.addr);
+	if (err) {
+		shell_error(sh, "Invalid peer address, reason: %d (%s)", err, bt_hci_err_to_str(err));
+		return err;
+	}
+
+	if (argc > 3) {
+		err = conn_profile_parse(argv[3]);
+		if (err < 0) {
+			shell_error(sh, "Unknown connection profile %s", argv[3]);
+			return err;
+		}
+		job.profile = err;
+	}
+
+	// connect and secure on the worker thread, security is requested as soon as the link is up
+	return worker_submit(sh, &job);
 }
 
 struct bt_conn_cb connection_callbacks = {
 	.connected = connected,
 	.disconnected = disconnected,
 	.security_changed = security_changed,
+	.le_param_updated = le_param_updated,
+	.le_phy_updated = le_phy_updated,
+	.le_data_len_updated = le_data_len_updated,
 };
 
 static struct bt_conn_auth_cb conn_auth_callbacks = {
@@ -489,7 +493,12 @@ static struct bt_conn_auth_info_cb auth_info_cb = {
 static int cmd_init(const struct shell *sh)
 {
 	int err;
-	shell = sh;
+	stats_ts_t start;
+
+	// scripts and the boot commands run on the dummy backend, its output would only be seen by script_shell_exec()
+	shell = sh == shell_backend_dummy_get_ptr() ? shell_backend_uart_get_ptr() : sh;
+
+	stats_init();
 
 	err = bt_enable(NULL);
 	if (err) {
@@ -498,13 +507,16 @@ static int cmd_init(const struct shell *sh)
 	}
 	printf("Bluetooth initialized\n");
 
+	start = stats_now();
 	err = settings_load();
+	stats_record_since(STATS_SETTINGS_LOAD, start);
 	if(err < 0){
 		printf("Loading settings failed, reason: %d (%s)\n", err, bt_hci_err_to_str(err));
 		printf("continuing anyways\n");
 	} else {
 		printf("Settings loaded\n");
 	}
+	campaign_init();
 
 	default_conn = NULL;
 
@@ -535,8 +547,12 @@ static int cmd_init(const struct shell *sh)
 
 static int cmd_knob(const struct shell *sh, size_t argc, char *argv[])
 {
+	if (argc > 1 && !strcmp(argv[1], "sweep")) {
+		return cmd_knob_sweep(sh, argc - 1, &argv[1]);
+	}
+
 	if (argc != 2) {
-		shell_error(sh, "Usage: knob <true/false> or knob <key_size>");
+		shell_error(sh, "Usage: knob <true/false>, knob <key_size> or knob sweep <address> <type> [min max]");
 		return -EINVAL;
 	}
 
@@ -560,7 +576,7 @@ static int cmd_knob(const struct shell *sh, size_t argc, char *argv[])
 		key_size = (uint8_t)value;
 	}
 
-	bt_smp_set_enc_key_size(key_size);
+	knob_set(key_size);
 	shell_print(sh, "LTK entropy set to %u bytes", key_size);
 
 	return 0;
@@ -576,15 +592,39 @@ static int cmd_scda(const struct shell *sh, size_t argc, char *argv[])
 	bool downgrade = !strcmp(argv[1], "true");
 
 	bt_smp_secure_connections_downgrade(downgrade);
+	scda_downgrade = downgrade;
 	shell_print(sh, "Secure Connections Downgrade Attack set to: %s", downgrade ? "true" : "false");
 
 	return 0;
 }
 
+/* CONFIG_APP_BOOT_COMMANDS, separated by ';', on the dummy shell backend (script_shell_exec()), their output goes to
+ * the UART. The simulated runs (scripts/bsim) are driven this way,
+ * jobs they submit queue up in the worker as if typed one after another.
+ */
+static void run_boot_commands(void)
+{
+	char cmds[] = CONFIG_APP_BOOT_COMMANDS;
+	char *save;
+	int err;
+
+	for (char *cmd = strtok_r(cmds, ";", &save); cmd; cmd = strtok_r(NULL, ";", &save)) {
+		printf("boot: %s\n", cmd);
+		err = script_shell_exec(cmd);
+		if (err) {
+			printf("boot: %s failed (err %d)\n", cmd, err);
+		}
+	}
+}
+
 int main(void)
 {
 	printf("BLE Testing Framework %s\n", CONFIG_BOARD_TARGET);
 
+	if (sizeof(CONFIG_APP_BOOT_COMMANDS) > 1) {
+		run_boot_commands();
+	}
+
 	return 0;
 }
 
@@ -606,29 +646,51 @@ static int cmd_default_handler(const struct shell *sh, size_t argc, char **argv)
 SHELL_STATIC_SUBCMD_SET_CREATE(cmds,
 	SHELL_CMD(init, NULL, HELP_NONE, cmd_init),
 	SHELL_CMD_ARG(advertise, NULL, "<value: start, stop>", cmd_advertise, 2, 0),
-	SHELL_CMD_ARG(scan, NULL, "<value: start, stop>", cmd_scan, 2, 0),
-	SHELL_CMD_ARG(connect, NULL, HELP_NONE, cmd_connect, 3, 0),
+	SHELL_CMD_ARG(scan, NULL, "<value: start, stop, list, clear, events [on [interval_ms] | off], "
+		"filter [reset | rssi <dBm> | connectable <on|off> | name <str|off> | uuid <hex|off> | mfg <hex|off> | "
+		"dup <on|off> | passive <on|off> | timing <interval_ms> <window_ms> | accept <on|off|clear|add|remove> [addr type]]>",
+		cmd_scan, 2, 4),
+	SHELL_CMD_ARG(connect, NULL, HELP_ADDR_LE" [profile]", cmd_connect, 3, 1),
 	SHELL_CMD_ARG(disconnect, NULL, HELP_NONE, cmd_disconnect, 3, 0),
 	SHELL_CMD(security, NULL, "security level 2 for Nino attack", cmd_security),
-	SHELL_CMD_ARG(pair, NULL, NULL, cmd_pair, 3, 0),
+	SHELL_CMD_ARG(pair, NULL, HELP_ADDR_LE" [profile]", cmd_pair, 3, 1),
 	SHELL_CMD(bonds, NULL, HELP_NONE, cmd_bonds),
 	SHELL_CMD_ARG(unpair, NULL, "[all] ["HELP_ADDR_LE"]", cmd_pairing_delete, 3, 0),
-	SHELL_CMD_ARG(knob, NULL, "<true/false> (reduce LTK entropy)", cmd_knob, 2, 0),
+	SHELL_CMD_ARG(knob, NULL, "<true/false> | <key_size> | sweep "HELP_ADDR_LE" [min max] (reduce LTK entropy, or pair once per key size and print what the DUT accepted)", cmd_knob, 2, 4),
 	SHELL_CMD_ARG(scda, NULL, "<true/false> (enable/disable Secure Connections Downgrade Attack)", cmd_scda, 2, 0),
+	SHELL_CMD_ARG(pairmatrix, NULL, HELP_ADDR_LE" [key sizes...] | io <none|display|yesno|keyboard|kbdisplay> pair with every combination of SC/legacy, key size (default 7 16) and IO capability", cmd_pairmatrix, 3, 10),
 	SHELL_CMD_ARG(id_reset, NULL, "Enter an id which should be reset", cmd_reset, 2, 0),
 	SHELL_CMD_ARG(id_save, NULL, "", cmd_ifa_id_save, 1, 0),
 	SHELL_CMD_ARG(id_restore, NULL, "", cmd_ifa_id_restore, 1, 0),
 
-	SHELL_CMD_ARG(snapshot, NULL, "", cmd_ifa_snapshot_take, 3, 0),
+	SHELL_CMD_ARG(snapshot, NULL, "["HELP_ADDR_LE" | list | drop <address> <type> | drop all | restore <address> <type> | persist <on|off>] take or manage per-DUT key snapshots", cmd_snapshot, 1, 3),
 	SHELL_CMD_ARG(restore, NULL, "", cmd_ifa_snapshot_restore, 1, 0),
 
-	SHELL_CMD_ARG(ifa1, NULL, "", cmd_ifa_stage1, 3, 0),
+	SHELL_CMD_ARG(ifa1, NULL, "", cmd_ifa_stage1, 3, 1),
 	SHELL_CMD(ifa1_p, NULL, HELP_NONE, cmd_ifa_stage1_periph),
-	SHELL_CMD_ARG(ifa2, NULL, "", cmd_ifa_stage2, 4, 0),
+	SHELL_CMD_ARG(ifa2, NULL, "", cmd_ifa_stage2, 4, 1),
 	SHELL_CMD(ifa2_1_p, NULL, HELP_NONE, cmd_ifa_stage2_1_periph),
 	SHELL_CMD(ifa2_2_p, NULL, HELP_NONE, cmd_ifa_stage2_2_periph),
+	SHELL_CMD_ARG(ifa_p, NULL, "<n> attack on a central DUT without operator: advertise, wait for the DUT to bond, n new identities, restore and verify", cmd_ifa_periph, 2, 0),
 	SHELL_CMD_ARG(ifa3, NULL, "", cmd_ifa_stage3, 1, 0),
-	SHELL_CMD_ARG(ifa4, NULL, "", cmd_ifa_stage4, 3, 0),
-	SHELL_CMD_ARG(ifa, NULL, "ifa addr addr_type n \n addr is target address formatted as "HELP_ADDR_LE" \n n is number of bondings\n", cmd_ifa, 4, 0));
+	SHELL_CMD_ARG(ifa4, NULL, "", cmd_ifa_stage4, 3, 1),
+	SHELL_CMD_ARG(ifa, NULL, "ifa addr addr_type n [profile] \n addr is target address formatted as "HELP_ADDR_LE" \n n is number of bondings\n profile is the connection profile (see connprofile)\n", cmd_ifa, 4, 1),
+	SHELL_CMD_ARG(script, NULL, "<list | load <name> <statements> | append <name> <statements> | show <name> | delete <name> | run <name> | stop> command scripts run on the device, statements separated by ';'", cmd_script, 2, 18),
+	SHELL_CMD_ARG(campaign, NULL, "[status | resume | clear] checkpoint of the last ifa run, resume continues it after a reset", cmd_campaign, 1, 1),
+	SHELL_CMD_ARG(abort, NULL, "[all] abort the running job, tear down its connection and restore the saved id and snapshot; all also drops queued jobs", cmd_ifa_abort, 1, 1),
+	SHELL_CMD_ARG(output, NULL, "[text | json | cbor] json: one object per line, cbor: COBS framed maps between 0x00 bytes", cmd_output, 1, 1),
+	SHELL_CMD_ARG(evtlog, NULL, "[reset] records, drops and fill level of the callback event ring", cmd_evtlog, 1, 1),
+	SHELL_CMD_ARG(capture, NULL, "[start [all | smp] | stop | status | dump | stream <on | off> | clear] binary HCI/SMP capture, written as a btsnoop file to RTT channel 2", cmd_capture, 1, 2),
+	SHELL_CMD_ARG(stats, NULL, "[reset | hist [step]] per-step latency min/mean/p95/max and histograms", cmd_stats, 1, 2),
+	SHELL_CMD(status, NULL, "current job, stage, step, iteration and elapsed time", cmd_status),
+	SHELL_CMD_ARG(dut, NULL, "[list | info <address> <type> | forget <address> <type> | forget all] cached pairing features, advertisement and connection parameters per DUT", cmd_dut, 1, 3),
+	SHELL_CMD_ARG(session, NULL, "[list | add <address> <type> | remove <address> <type> | clear | run [profile]] pairing check of all listed DUTs in parallel", cmd_session, 1, 3),
+	SHELL_CMD_ARG(idpool, NULL, "[on | off | fill | bench [n]] pre-generated identities for stage 2, bench compares n resets with and without", cmd_idpool, 1, 2),
+	SHELL_CMD_ARG(ramstore, NULL, "[on | off | reset] keep bonding/identity writes of stage 1/2 off flash until stage 3", cmd_ramstore, 1, 1),
+	SHELL_CMD_ARG(connprofile, NULL, "[compat | fast | custom [<interval_min> <interval_max> [latency] [timeout_ms] [1m|2m|coded] [on|off]]] select/show connection profiles", cmd_conn_profile, 1, 7),
+	SHELL_CMD_ARG(restore_mode, NULL, "[inplace | restart] how stage 3 makes the restored keys live", cmd_ifa_restore_mode, 1, 1),
+	SHELL_CMD_ARG(pace, NULL, "[on | off] [step_ms] [max_ms] gap between stage 2 iterations, grows after failed iterations and shrinks after clean ones, learned per DUT", cmd_ifa_pace, 1, 3),
+	SHELL_CMD_ARG(connect_mode, NULL, "[direct | auto] how ifa/pair connect; auto puts the target on the accept list and connects on its first advertisement", cmd_ifa_connect_mode, 1, 1),
+	SHELL_CMD_ARG(timeout, NULL, "[<step> <timeout_ms> [retries] [backoff_ms]] (0 ms waits forever)", cmd_ifa_timeout, 1, 4));
 
 SHELL_CMD_REGISTER(bleframework, &cmds, "Bluetooth shell commands", cmd_default_handler);
\ No newline at end of file
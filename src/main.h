@@ -1,7 +1,12 @@
 #pragma once
 
-struct bt_conn;  // forward declaration (sufficient for pointer)
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
 extern struct bt_conn *default_conn;
 extern const struct shell *shell;
+extern bool scda_downgrade;    // last value passed to bt_smp_secure_connections_downgrade()
 
 int w_advertising_start(void);
+// auth callback of every IO capability, pairmatrix registers it in its callback sets
+enum bt_security_err pairing_accept(struct bt_conn *conn, const struct bt_conn_pairing_feat *const feat);
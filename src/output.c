@@ -0,0 +1,286 @@
+#include "output.h"
+#include "main.h"
+
+#include <string.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#if defined(CONFIG_USE_SEGGER_RTT)
+#include <SEGGER_RTT.h>
+#endif
+
+/* Structured output for host automation. In text mode every caller prints its usual line. In the structured modes it
+ * passes the same information as a record instead: event name, uptime of the event, job id and a list of key/value
+ * fields.
+ *
+ * json: one object per line, {"ts":..,"ev":"..","job":..,<fields>}, written through the shell like any other line.
+ * cbor: the same map as CBOR (RFC 8949) followed by its CRC-16 (CRC-16/XMODEM, big endian), COBS encoded and framed as
+ *       0x00 <frame> 0x00. Binary data has no place in the shell's text stream, so the frames go to an RTT up-buffer of
+ *       their own (OUTPUT_RTT_CHANNEL) and the shell keeps the UART for the command echo. The zero delimiters let the
+ *       host find the next frame after a gap and the CRC catches the rest. The channel skips: a frame that does not fit
+ *       the free space is dropped and counted, the caller never waits for the host.
+ */
+
+struct output_buf {
+  uint8_t data[OUTPUT_BUF_SIZE + 2];                          // room for the CRC of a cbor record
+  size_t len;
+  bool overflow;
+};
+
+static enum output_mode mode = OUTPUT_TEXT;
+static struct output_buf buf;                                  // under output_lock
+static uint8_t frame[OUTPUT_BUF_SIZE + 2 + (OUTPUT_BUF_SIZE + 2) / 254 + 3];
+static uint32_t overflows;
+static uint32_t unsent;
+
+K_MUTEX_DEFINE(output_lock);
+
+static const char *const mode_names[] = {
+  [OUTPUT_TEXT] = "text",
+  [OUTPUT_JSON] = "json",
+  [OUTPUT_CBOR] = "cbor",
+};
+
+bool output_structured(void){
+  return mode != OUTPUT_TEXT;
+}
+
+static void out_put(struct output_buf *b, const void *data, size_t len){
+  if (b->len + len > OUTPUT_BUF_SIZE) {
+    b->overflow = true;
+    return;
+  }
+
+  memcpy(&b->data[b->len], data, len);
+  b->len += len;
+}
+
+static void out_str(struct output_buf *b, const char *str){
+  out_put(b, str, strlen(str));
+}
+
+/* json ---------------------------------------------------------------------------------------------------------------- */
+
+static void json_str(struct output_buf *b, const char *str){
+  char esc[7];
+
+  out_str(b, "\"");
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      esc[0] = '\\';
+      esc[1] = *str;
+      out_put(b, esc, 2);
+    } else if ((uint8_t)*str < 0x20) {
+      snprintk(esc, sizeof(esc), "\\u%04x", (uint8_t)*str);
+      out_str(b, esc);
+    } else {
+      out_put(b, str, 1);
+    }
+  }
+  out_str(b, "\"");
+}
+
+static void json_num(struct output_buf *b, int64_t num){
+  char str[21];
+
+  snprintk(str, sizeof(str), "%lld", num);
+  out_str(b, str);
+}
+
+static void json_field(struct output_buf *b, const struct output_field *f){
+  out_str(b, ",");
+  json_str(b, f->key);
+  out_str(b, ":");
+  if (f->str) {
+    json_str(b, f->str);
+  } else {
+    json_num(b, f->num);
+  }
+}
+
+/* cbor ---------------------------------------------------------------------------------------------------------------- */
+
+#define CBOR_UINT  0
+#define CBOR_NINT  1
+#define CBOR_TEXT  3
+#define CBOR_MAP   5
+
+static void cbor_head(struct output_buf *b, uint8_t major, uint64_t val){
+  uint8_t head[9];
+  size_t len;
+
+  if (val < 24) {
+    head[0] = (major << 5) | val;
+    len = 1;
+  } else if (val <= UINT8_MAX) {
+    head[0] = (major << 5) | 24;
+    head[1] = val;
+    len = 2;
+  } else if (val <= UINT16_MAX) {
+    head[0] = (major << 5) | 25;
+    sys_put_be16(val, &head[1]);
+    len = 3;
+  } else if (val <= UINT32_MAX) {
+    head[0] = (major << 5) | 26;
+    sys_put_be32(val, &head[1]);
+    len = 5;
+  } else {
+    head[0] = (major << 5) | 27;
+    sys_put_be64(val, &head[1]);
+    len = 9;
+  }
+
+  out_put(b, head, len);
+}
+
+static void cbor_str(struct output_buf *b, const char *str){
+  size_t len = strlen(str);
+
+  cbor_head(b, CBOR_TEXT, len);
+  out_put(b, str, len);
+}
+
+static void cbor_num(struct output_buf *b, int64_t num){
+  if (num < 0) {
+    cbor_head(b, CBOR_NINT, (uint64_t)(-(num + 1)));
+  } else {
+    cbor_head(b, CBOR_UINT, num);
+  }
+}
+
+// consistent overhead byte stuffing, dst needs len + len / 254 + 1 bytes
+static size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst){
+  size_t code_idx = 0;
+  size_t out = 1;
+  uint8_t code = 1;
+
+  for (size_t i = 0; i < len; i++) {
+    if (src[i]) {
+      dst[out++] = src[i];
+      code++;
+    }
+    if (!src[i] || code == 0xff) {
+      dst[code_idx] = code;
+      code_idx = out++;
+      code = 1;
+    }
+  }
+  dst[code_idx] = code;
+
+  return out;
+}
+
+#if defined(CONFIG_USE_SEGGER_RTT)
+BUILD_ASSERT(OUTPUT_RTT_CHANNEL < CONFIG_SEGGER_RTT_MAX_NUM_UP_BUFFERS, "raise CONFIG_SEGGER_RTT_MAX_NUM_UP_BUFFERS");
+
+static uint8_t rtt_buf[OUTPUT_RTT_BUF_SIZE];
+
+static int output_rtt_init(void){
+  SEGGER_RTT_ConfigUpBuffer(OUTPUT_RTT_CHANNEL, "output", rtt_buf, sizeof(rtt_buf), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+  return 0;
+}
+
+SYS_INIT(output_rtt_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+#endif
+
+// call with output_lock held, b->data has room for the two CRC bytes
+static void output_cbor_frame(struct output_buf *b){
+  size_t n;
+
+  sys_put_be16(crc16_itu_t(0, b->data, b->len), &b->data[b->len]);
+
+  frame[0] = 0;
+  n = cobs_encode(b->data, b->len + 2, &frame[1]) + 1;
+  frame[n++] = 0;
+
+#if defined(CONFIG_USE_SEGGER_RTT)
+  if (!SEGGER_RTT_Write(OUTPUT_RTT_CHANNEL, frame, n)) {
+    unsent++;
+  }
+#endif
+}
+
+/* records ------------------------------------------------------------------------------------------------------------- */
+
+void output_record(const char *ev, uint32_t ts_ms, uint32_t job, const struct output_field *fields, size_t n){
+  enum output_mode m = mode;
+
+  if (m == OUTPUT_TEXT || !shell) {
+    return;
+  }
+
+  k_mutex_lock(&output_lock, K_FOREVER);
+  buf.len = 0;
+  buf.overflow = false;
+
+  if (m == OUTPUT_JSON) {
+    out_str(&buf, "{\"ts\":");
+    json_num(&buf, ts_ms);
+    out_str(&buf, ",\"ev\":");
+    json_str(&buf, ev);
+    out_str(&buf, ",\"job\":");
+    json_num(&buf, job);
+    for (size_t i = 0; i < n; i++) {
+      json_field(&buf, &fields[i]);
+    }
+    out_str(&buf, "}");
+    out_put(&buf, "", 1);
+  } else {
+    cbor_head(&buf, CBOR_MAP, n + 3);
+    cbor_str(&buf, "ts");
+    cbor_num(&buf, ts_ms);
+    cbor_str(&buf, "ev");
+    cbor_str(&buf, ev);
+    cbor_str(&buf, "job");
+    cbor_num(&buf, job);
+    for (size_t i = 0; i < n; i++) {
+      cbor_str(&buf, fields[i].key);
+      if (fields[i].str) {
+        cbor_str(&buf, fields[i].str);
+      } else {
+        cbor_num(&buf, fields[i].num);
+      }
+    }
+  }
+
+  // a truncated record would not parse, drop it and count
+  if (buf.overflow) {
+    overflows++;
+  } else if (m == OUTPUT_JSON) {
+    shell_print(shell, "%s", (const char *)buf.data);
+  } else {
+    output_cbor_frame(&buf);
+  }
+
+  k_mutex_unlock(&output_lock);
+}
+
+int cmd_output(const struct shell *sh, size_t argc, char *argv[]){
+
+  if (argc > 1) {
+    int m;
+
+    for (m = 0; m < ARRAY_SIZE(mode_names); m++) {
+      if (!strcmp(argv[1], mode_names[m])) {
+        break;
+      }
+    }
+    if (m == ARRAY_SIZE(mode_names)) {
+      shell_error(sh, "Usage: output [text | json | cbor]");
+      return -EINVAL;
+    }
+
+    if (m == OUTPUT_CBOR && !IS_ENABLED(CONFIG_USE_SEGGER_RTT)) {
+      shell_error(sh, "cbor frames go to RTT channel %d, build with -DEXTRA_CONF_FILE=overlay-cbor.conf",
+                  OUTPUT_RTT_CHANNEL);
+      return -ENOTSUP;
+    }
+
+    mode = m;
+  }
+
+  shell_print(sh, "output: %s, %u records dropped (longer than %d bytes), %u frames not sent (RTT channel %d full)",
+              mode_names[mode], overflows, OUTPUT_BUF_SIZE, unsent, OUTPUT_RTT_CHANNEL);
+  return 0;
+}
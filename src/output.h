@@ -0,0 +1,29 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+enum output_mode {
+  OUTPUT_TEXT,               // human readable lines, the default
+  OUTPUT_JSON,               // one JSON object per line
+  OUTPUT_CBOR,               // one CBOR map and its CRC-16 per frame, COBS encoded, on RTT channel OUTPUT_RTT_CHANNEL
+};
+
+/* One field of a record; a string if str is set, the number otherwise */
+struct output_field {
+  const char *key;
+  const char *str;
+  int64_t num;
+};
+
+#define OUTPUT_NUM(_key, _num) { .key = (_key), .num = (_num) }
+#define OUTPUT_STR(_key, _str) { .key = (_key), .str = (_str) }
+
+#define OUTPUT_BUF_SIZE     384
+#define OUTPUT_RTT_CHANNEL  3     // 0: log (overlay-logdict.conf), 1: Bluetooth monitor, 2: capture (overlay-hcitap.conf)
+#define OUTPUT_RTT_BUF_SIZE 2048
+
+bool output_structured(void);
+void output_record(const char *ev, uint32_t ts_ms, uint32_t job, const struct output_field *fields, size_t n);
+
+int cmd_output(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,310 @@
+#include "pairmatrix.h"
+#include "dut.h"
+#include "ifa.h"
+#include "knob.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Pairing feature matrix: every combination of Secure Connections/legacy (SCDA), key size (KNOB) and our IO capability
+ * is paired against one DUT with the check stage, recording the resulting pairing method, security level and time.
+ *
+ * The host derives our IO capability from the auth callbacks that are registered, so every capability is a callback
+ * set; passkey requests are answered automatically (PAIRMATRIX_PASSKEY, numeric comparison confirmed) and which of the
+ * callbacks fired tells the pairing method. A failed passkey entry is only a result against a DUT with that fixed
+ * passkey; a DUT showing a random one needs an operator, the cell is marked manual. An encrypted link cannot pair again, so each cell pairs on a new connection and waits until the last one is down;
+ * connect_mode auto and a fast connection profile keep the setup short. SCDA, key size and IO capability are put back
+ * when the grid is done. A DUT known (dut cache) to have no input and no output pairs with just works whatever our
+ * capability is, so only the "none" column is run for it.
+ */
+
+enum pairmatrix_method {
+  PAIRMATRIX_JUST_WORKS,
+  PAIRMATRIX_PASSKEY_DISPLAY,    // we displayed, the DUT entered
+  PAIRMATRIX_PASSKEY_ENTRY,      // the DUT displayed, we entered
+  PAIRMATRIX_NUMERIC,
+};
+
+static const char *const io_names[] = {
+  [PAIRMATRIX_IO_NONE] = "none",
+  [PAIRMATRIX_IO_DISPLAY] = "display",
+  [PAIRMATRIX_IO_YESNO] = "yesno",
+  [PAIRMATRIX_IO_KEYBOARD] = "keyboard",
+  [PAIRMATRIX_IO_KBDISPLAY] = "kbdisplay",
+};
+
+static const char *const method_names[] = {
+  [PAIRMATRIX_JUST_WORKS] = "just works",
+  [PAIRMATRIX_PASSKEY_DISPLAY] = "passkey disp",
+  [PAIRMATRIX_PASSKEY_ENTRY] = "passkey entry",
+  [PAIRMATRIX_NUMERIC] = "numeric",
+};
+
+struct pairmatrix_cell {
+  bool legacy;
+  uint8_t key_size;
+  uint8_t io;
+  uint8_t method;
+  uint32_t cell_ms;              // connect until unpaired
+  struct ifa_check_result res;
+};
+
+#define PAIRMATRIX_CELLS  (2 * (KNOB_KEY_SIZE_MAX - KNOB_KEY_SIZE_MIN + 1) * PAIRMATRIX_IO_COUNT)
+
+static struct pairmatrix_cell cells[PAIRMATRIX_CELLS];   // only the worker runs a grid
+static atomic_t method;
+static enum pairmatrix_io io_active = PAIRMATRIX_IO_NONE;
+
+static void pairmatrix_passkey_display(struct bt_conn *conn, unsigned int passkey){
+  atomic_set(&method, PAIRMATRIX_PASSKEY_DISPLAY);
+}
+
+static void pairmatrix_passkey_entry(struct bt_conn *conn){
+  atomic_set(&method, PAIRMATRIX_PASSKEY_ENTRY);
+  bt_conn_auth_passkey_entry(conn, PAIRMATRIX_PASSKEY);
+}
+
+static void pairmatrix_passkey_confirm(struct bt_conn *conn, unsigned int passkey){
+  atomic_set(&method, PAIRMATRIX_NUMERIC);
+  bt_conn_auth_passkey_confirm(conn);
+}
+
+static void pairmatrix_cancel(struct bt_conn *conn){
+}
+
+static const struct bt_conn_auth_cb io_cbs[] = {
+  [PAIRMATRIX_IO_NONE] = {
+    .pairing_accept = pairing_accept,
+  },
+  [PAIRMATRIX_IO_DISPLAY] = {
+    .pairing_accept = pairing_accept,
+    .passkey_display = pairmatrix_passkey_display,
+    .cancel = pairmatrix_cancel,
+  },
+  [PAIRMATRIX_IO_YESNO] = {
+    .pairing_accept = pairing_accept,
+    .passkey_display = pairmatrix_passkey_display,
+    .passkey_confirm = pairmatrix_passkey_confirm,
+    .cancel = pairmatrix_cancel,
+  },
+  [PAIRMATRIX_IO_KEYBOARD] = {
+    .pairing_accept = pairing_accept,
+    .passkey_entry = pairmatrix_passkey_entry,
+    .cancel = pairmatrix_cancel,
+  },
+  [PAIRMATRIX_IO_KBDISPLAY] = {
+    .pairing_accept = pairing_accept,
+    .passkey_display = pairmatrix_passkey_display,
+    .passkey_entry = pairmatrix_passkey_entry,
+    .passkey_confirm = pairmatrix_passkey_confirm,
+    .cancel = pairmatrix_cancel,
+  },
+};
+
+// only while no pairing is in progress
+int pairmatrix_set_io(enum pairmatrix_io io){
+  int err;
+
+  bt_conn_auth_cb_register(NULL);
+  err = bt_conn_auth_cb_register(&io_cbs[io]);
+  if (!err) {
+    io_active = io;
+  }
+
+  return err;
+}
+
+/* manual: the DUT displayed a passkey we cannot read and refused PAIRMATRIX_PASSKEY, that is no answer about the DUT */
+static const char *pairmatrix_result(const struct pairmatrix_cell *cell){
+  const struct ifa_check_result *res = &cell->res;
+
+  if (!res->err) {
+    return "ok";
+  }
+  if (cell->method == PAIRMATRIX_PASSKEY_ENTRY) {
+    return "manual";
+  }
+  return res->sec_err ? "refused" : "failed";
+}
+
+static void pairmatrix_output(const bt_addr_le_t *dut, const struct pairmatrix_cell *cell){
+  char addr[BT_ADDR_LE_STR_LEN];
+  struct output_field fields[] = {
+    OUTPUT_STR("addr", addr),
+    OUTPUT_STR("pairing", cell->legacy ? "legacy" : "sc"),
+    OUTPUT_NUM("size", cell->key_size),
+    OUTPUT_STR("io", io_names[cell->io]),
+    OUTPUT_STR("result", pairmatrix_result(cell)),
+    OUTPUT_NUM("err", cell->res.err),
+    OUTPUT_NUM("sec_err", cell->res.sec_err),
+    OUTPUT_STR("method", method_names[cell->method]),
+    OUTPUT_NUM("level", cell->res.sec_level),
+    OUTPUT_NUM("sc", !!(cell->res.sec_flags & BT_SECURITY_FLAG_SC)),
+    OUTPUT_NUM("key_size", cell->res.enc_key_size),
+    OUTPUT_NUM("pair_ms", cell->res.duration_ms),
+    OUTPUT_NUM("cell_ms", cell->cell_ms),
+  };
+
+  bt_addr_le_to_str(dut, addr, sizeof(addr));
+  output_record("matrix_cell", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+}
+
+static void pairmatrix_print(const struct pairmatrix_cell *cells, uint16_t n){
+  shell_print(shell, "%-7s %4s %-9s %-8s %6s %-13s %5s %3s %4s %8s %8s", "offer", "key", "io", "result", "reason",
+              "method", "level", "sc", "size", "pair ms", "cell ms");
+
+  for (uint16_t i = 0; i < n; i++) {
+    const struct pairmatrix_cell *cell = &cells[i];
+    const struct ifa_check_result *res = &cell->res;
+
+    if (res->err) {
+      shell_print(shell, "%-7s %4u %-9s %-8s %6d %-13s %5s %3s %4s %8s %8u", cell->legacy ? "legacy" : "sc",
+                  cell->key_size, io_names[cell->io], pairmatrix_result(cell), res->sec_err ? res->sec_err : res->err,
+                  "-", "-", "-", "-", "-", cell->cell_ms);
+      continue;
+    }
+
+    shell_print(shell, "%-7s %4u %-9s %-8s %6s %-13s %5u %3s %4u %8u %8u", cell->legacy ? "legacy" : "sc",
+                cell->key_size, io_names[cell->io], pairmatrix_result(cell), "-", method_names[cell->method],
+                res->sec_level, (res->sec_flags & BT_SECURITY_FLAG_SC) ? "y" : "n", res->enc_key_size,
+                res->duration_ms, cell->cell_ms);
+  }
+}
+
+static int pairmatrix_job(const struct worker_job *job){
+  bool prev_scda = scda_downgrade;
+  uint8_t prev_size = knob_get();
+  enum pairmatrix_io prev_io = io_active;
+  uint8_t n_io = PAIRMATRIX_IO_COUNT;
+  struct dut_info info;
+  uint16_t n = 0;
+  int err = 0;
+
+  if (!dut_lookup(&job->addr, &info) && (info.flags & DUT_HAS_FEAT) && info.io_capability == BT_IO_NO_INPUT_OUTPUT) {
+    n_io = PAIRMATRIX_IO_NONE + 1;
+    shell_print(shell, "DUT has no input and no output (cached), only pairing without IO capability is run");
+  }
+
+  for (int legacy = 0; legacy < 2 && !err; legacy++) {
+    for (uint8_t size = KNOB_KEY_SIZE_MIN; size <= KNOB_KEY_SIZE_MAX && !err; size++) {
+      if (!(job->set & BIT(size))) {
+        continue;
+      }
+
+      for (uint8_t io = 0; io < n_io && !err; io++) {
+        struct pairmatrix_cell *cell = &cells[n];
+        uint32_t start;
+
+        // the check's teardown may give up on a link, the next cell would find the DUT still connected
+        err = ifa_wait_disconnected(&job->addr);
+        if (err) {
+          shell_error(shell, "link to the DUT does not go down (%d), grid stopped", err);
+          break;
+        }
+        n++;
+
+        bt_unpair(BT_ID_DEFAULT, &job->addr);
+        bt_smp_secure_connections_downgrade(legacy);
+        knob_set(size);
+        pairmatrix_set_io(io);
+        atomic_set(&method, PAIRMATRIX_JUST_WORKS);
+
+        cell->legacy = legacy;
+        cell->key_size = size;
+        cell->io = io;
+
+        start = k_uptime_get_32();
+        ifa_check(&job->addr, 1, job->profile, &cell->res);
+        cell->cell_ms = k_uptime_get_32() - start;
+        cell->method = atomic_get(&method);
+
+        if (output_structured()) {
+          pairmatrix_output(&job->addr, cell);
+        }
+
+        if (cell->res.err == -ECANCELED) {
+          err = -ECANCELED;
+        }
+      }
+    }
+  }
+
+  bt_smp_secure_connections_downgrade(prev_scda);
+  knob_set(prev_size);
+  pairmatrix_set_io(prev_io);
+
+  if (!output_structured()) {
+    pairmatrix_print(cells, n);
+  }
+
+  return err;
+}
+
+static int pairmatrix_parse_io(const char *name){
+  for (int io = 0; io < PAIRMATRIX_IO_COUNT; io++) {
+    if (!strcmp(name, io_names[io])) {
+      return io;
+    }
+  }
+
+  return -EINVAL;
+}
+
+// pairmatrix <addr> <type> [key sizes...] | io <capability>
+int cmd_pairmatrix(const struct shell *sh, size_t argc, char *argv[]){
+  struct worker_job job = {
+    .name = "pairmatrix",
+    .run = pairmatrix_job,
+    .set = BIT(KNOB_KEY_SIZE_MIN) | BIT(KNOB_KEY_SIZE_MAX),
+  };
+  int err;
+
+  if (argc == 3 && !strcmp(argv[1], "io")) {
+    err = pairmatrix_parse_io(argv[2]);
+    if (err < 0) {
+      shell_error(sh, "Usage: pairmatrix io <none | display | yesno | keyboard | kbdisplay>");
+      return err;
+    }
+    if (worker_busy()) {
+      shell_error(sh, "a job is running, try again when it finished");
+      return -EBUSY;
+    }
+
+    err = pairmatrix_set_io(err);
+    if (err) {
+      shell_error(sh, "registering the auth callbacks failed (err %d)", err);
+      return err;
+    }
+    shell_print(sh, "IO capability: %s", argv[2]);
+    return 0;
+  }
+
+  if (argc < 3) {
+    shell_help(sh);
+    return SHELL_CMD_HELP_PRINTED;
+  }
+
+  err = bt_addr_le_from_str(argv[1], argv[2], &job.addr);
+  if (err < 0) {
+    shell_error(sh, "Invalid peer address (err %d)", err);
+    return err;
+  }
+
+  if (argc > 3) {
+    job.set = 0;
+  }
+  for (size_t i = 3; i < argc; i++) {
+    long size = strtol(argv[i], NULL, 10);
+
+    if (size < KNOB_KEY_SIZE_MIN || size > KNOB_KEY_SIZE_MAX) {
+      shell_error(sh, "key sizes must be between %d and %d", KNOB_KEY_SIZE_MIN, KNOB_KEY_SIZE_MAX);
+      return -EINVAL;
+    }
+    job.set |= BIT(size);
+  }
+
+  return worker_submit(sh, &job);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+enum pairmatrix_io {
+  PAIRMATRIX_IO_NONE,        // NoInputNoOutput, what init registers
+  PAIRMATRIX_IO_DISPLAY,     // DisplayOnly
+  PAIRMATRIX_IO_YESNO,       // DisplayYesNo
+  PAIRMATRIX_IO_KEYBOARD,    // KeyboardOnly
+  PAIRMATRIX_IO_KBDISPLAY,   // KeyboardDisplay
+  PAIRMATRIX_IO_COUNT,
+};
+
+#define PAIRMATRIX_PASSKEY  123456   // entered whenever the stack asks for the passkey of the DUT
+
+int pairmatrix_set_io(enum pairmatrix_io io);
+
+int cmd_pairmatrix(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,96 @@
+#include "ramstore.h"
+#include "main.h"
+
+#include <string.h>
+#include <zephyr/settings/settings.h>
+
+/* Campaign mode for the settings writes. Every bonding of stage 1/2 stores keys, CCC and the identity under "bt/", and
+ * the following bt_unpair() deletes them again, two NVS writes per iteration that nobody ever reads: stage 3 puts back
+ * the snapshot and the saved identity, and only then reloads the settings from flash. While a campaign runs, the host's
+ * settings_save_one()/settings_delete() calls are wrapped at link time (CMakeLists.txt) and "bt/" writes are dropped;
+ * everything else is passed through. Stage 3 (and an aborted or failed run) ends the campaign before it restores, so
+ * exactly the snapshot and the identity are committed. In between, jobs that bond or unpair outside the campaign are
+ * refused, their writes would be lost.
+ */
+
+int __real_settings_save_one(const char *name, const void *value, size_t val_len);
+int __real_settings_delete(const char *name);
+
+static bool enabled;
+static atomic_t active;
+
+static uint32_t writes_avoided;
+static uint32_t deletes_avoided;
+static uint32_t bytes_avoided;
+static uint32_t writes_passed;
+
+int __wrap_settings_save_one(const char *name, const void *value, size_t val_len){
+
+  if (atomic_get(&active) && !strncmp(name, "bt/", 3)) {
+    writes_avoided++;
+    bytes_avoided += val_len;
+    return 0;
+  }
+
+  writes_passed++;
+  return __real_settings_save_one(name, value, val_len);
+}
+
+int __wrap_settings_delete(const char *name){
+
+  if (atomic_get(&active) && !strncmp(name, "bt/", 3)) {
+    deletes_avoided++;
+    return 0;
+  }
+
+  writes_passed++;
+  return __real_settings_delete(name);
+}
+
+// force: keep the campaign in RAM even if `ramstore off` (identity pool)
+void ramstore_begin(bool force){
+  if (enabled || force) {
+    atomic_set(&active, 1);
+  }
+}
+
+void ramstore_end(void){
+  atomic_set(&active, 0);
+}
+
+bool ramstore_active(void){
+  return atomic_get(&active);
+}
+
+// for commands that would bond or unpair outside the campaign
+int ramstore_refuse(const struct shell *sh){
+  if (!ramstore_active()) {
+    return 0;
+  }
+
+  shell_error(sh, "an unfinished ifa campaign keeps bonds off flash (ramstore), run ifa3 or `ramstore off` first");
+  return -EBUSY;
+}
+
+int cmd_ramstore(const struct shell *sh, size_t argc, char *argv[]){
+
+  if (argc > 1 && !strcmp(argv[1], "on")) {
+    enabled = true;
+  } else if (argc > 1 && !strcmp(argv[1], "off")) {
+    enabled = false;
+    ramstore_end();
+  } else if (argc > 1 && !strcmp(argv[1], "reset")) {
+    writes_avoided = 0;
+    deletes_avoided = 0;
+    bytes_avoided = 0;
+    writes_passed = 0;
+  } else if (argc > 1) {
+    shell_help(sh);
+    return SHELL_CMD_HELP_PRINTED;
+  }
+
+  shell_print(sh, "ramstore %s%s: %u writes (%u bytes) and %u deletes kept off flash, %u writes passed",
+              enabled ? "on" : "off", atomic_get(&active) ? " (campaign running)" : "", writes_avoided,
+              bytes_avoided, deletes_avoided, writes_passed);
+  return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+void ramstore_begin(bool force);
+void ramstore_end(void);
+bool ramstore_active(void);
+int ramstore_refuse(const struct shell *sh);
+
+int cmd_ramstore(const struct shell *sh, size_t argc, char *argv[]);
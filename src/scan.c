@@ -0,0 +1,672 @@
+#include "scan.h"
+#include "dut.h"
+#include "main.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/sys/byteorder.h>
+
+/* Scan results are deduplicated into a fixed-size hash table. The scan callback runs in the Bluetooth RX context, so it
+ * only parses and updates the table; formatting happens in the shell (scan list) or in a rate limited work item.
+ */
+
+static struct scan_dev table[SCAN_TABLE_SIZE];
+static struct k_spinlock table_lock;
+static uint32_t table_drops;     // advertisers not stored because the table was full
+static uint32_t reports;         // reports delivered by the controller
+static uint32_t matched;         // reports that passed the host filter
+
+#define SCAN_FILTER_DEFAULT {                   \
+		.rssi_above = -50,                      \
+		.connectable_only = true,               \
+		.interval = BT_GAP_SCAN_FAST_INTERVAL,  \
+		.window = BT_GAP_SCAN_FAST_WINDOW,      \
+	}
+
+static struct scan_filter filter = SCAN_FILTER_DEFAULT;  // guarded by table_lock
+static bool scanning;
+
+static bool evt_enabled;
+static uint32_t evt_interval_ms = SCAN_EVT_INTERVAL_MS;
+
+static void scan_evt_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(scan_evt_work, scan_evt_work_handler);
+
+/* scratch for scan list, only used from the shell thread */
+static struct scan_dev list_copy[SCAN_TABLE_SIZE];
+
+struct scan_ad {
+	char name[SCAN_NAME_LEN + 1];
+	uint16_t uuid16[SCAN_UUIDS];
+	uint8_t n_uuid16;
+	bool uuid128;
+	bool has_company;
+	uint16_t company_id;
+};
+
+static uint32_t scan_hash(const bt_addr_le_t *addr)
+{
+	// FNV-1a over type and address
+	uint32_t hash = 2166136261u;
+
+	hash = (hash ^ addr->type) * 16777619u;
+	for (size_t i = 0; i < sizeof(addr->a.val); i++) {
+		hash = (hash ^ addr->a.val[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+// returns the slot of addr, or the free slot it would go to, or NULL if the table is full
+static struct scan_dev *scan_slot(const bt_addr_le_t *addr)
+{
+	uint32_t idx = scan_hash(addr) & (SCAN_TABLE_SIZE - 1);
+
+	for (size_t probe = 0; probe < SCAN_TABLE_SIZE; probe++) {
+		struct scan_dev *dev = &table[(idx + probe) & (SCAN_TABLE_SIZE - 1)];
+
+		if (!dev->used || bt_addr_le_eq(&dev->addr, addr)) {
+			return dev;
+		}
+	}
+
+	return NULL;
+}
+
+static bool scan_ad_parse(struct bt_data *data, void *user_data)
+{
+	struct scan_ad *ad = user_data;
+
+	switch (data->type) {
+	case BT_DATA_NAME_SHORTENED:
+	case BT_DATA_NAME_COMPLETE:
+		memcpy(ad->name, data->data, MIN(data->data_len, SCAN_NAME_LEN));
+		ad->name[MIN(data->data_len, SCAN_NAME_LEN)] = '\0';
+		break;
+	case BT_DATA_UUID16_SOME:
+	case BT_DATA_UUID16_ALL:
+		for (size_t i = 0; i + 1 < data->data_len && ad->n_uuid16 < SCAN_UUIDS; i += 2) {
+			ad->uuid16[ad->n_uuid16++] = sys_get_le16(&data->data[i]);
+		}
+		break;
+	case BT_DATA_UUID128_SOME:
+	case BT_DATA_UUID128_ALL:
+		ad->uuid128 = true;
+		break;
+	case BT_DATA_MANUFACTURER_DATA:
+		if (data->data_len >= 2) {
+			ad->has_company = true;
+			ad->company_id = sys_get_le16(data->data);
+		}
+		break;
+	}
+
+	return true;
+}
+
+static bool scan_filter_match(const struct scan_filter *f, const struct scan_ad *ad)
+{
+	bool uuid_found = false;
+
+	if (f->name[0] && !strstr(ad->name, f->name)) {
+		return false;
+	}
+
+	if (f->has_company && (!ad->has_company || ad->company_id != f->company_id)) {
+		return false;
+	}
+
+	if (f->uuid16) {
+		for (uint8_t i = 0; i < ad->n_uuid16; i++) {
+			uuid_found |= ad->uuid16[i] == f->uuid16;
+		}
+		if (!uuid_found) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// as soon as the callback function is called it listens to adv events until stop_advertising() is called
+static void scan_started(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+			 struct net_buf_simple *ad)
+{
+	struct net_buf_simple ad_view = *ad;  // bt_data_parse() pulls from the buffer, parse a view instead of a copy
+	struct scan_ad parsed = { 0 };
+	struct scan_filter f;
+	struct scan_dev *dev;
+	bool inserted = false;
+	bool match;
+	uint32_t now;
+
+	K_SPINLOCK(&table_lock) {
+		f = filter;
+		reports++;
+	}
+
+	/* refreshes cached DUTs only */
+	dut_note_adv(addr, rssi, type, ad->data, ad->len);
+
+	/* connectable events (and the scan responses to them, which carry names) */
+	if (f.connectable_only &&
+		type != BT_GAP_ADV_TYPE_ADV_IND &&
+		type != BT_GAP_ADV_TYPE_ADV_DIRECT_IND &&
+		type != BT_GAP_ADV_TYPE_SCAN_RSP) {
+		return;
+	}
+
+	/* only devices in close proximity */
+	if (rssi <= f.rssi_above) {
+		return;
+	}
+
+	bt_data_parse(&ad_view, scan_ad_parse, &parsed);
+	match = scan_filter_match(&f, &parsed);
+	now = k_uptime_get_32();
+
+	K_SPINLOCK(&table_lock) {
+		dev = scan_slot(addr);
+		if (!dev) {
+			table_drops++;
+			K_SPINLOCK_BREAK;
+		}
+
+		// devices that matched once keep being tracked, e.g. their adv without the name of the scan response
+		if (!dev->used) {
+			if (!match) {
+				K_SPINLOCK_BREAK;
+			}
+			memset(dev, 0, sizeof(*dev));
+			dev->used = true;
+			dev->addr = *addr;
+			dev->first_seen_ms = now;
+			dev->avg_rssi_q4 = rssi * 16;
+			inserted = true;
+		}
+
+		if (type != BT_GAP_ADV_TYPE_SCAN_RSP || inserted) {
+			dev->adv_type = type;
+		}
+		matched++;
+		dev->last_rssi = rssi;
+		dev->avg_rssi_q4 += (rssi * 16 - dev->avg_rssi_q4) / 8;
+		dev->adv_count++;
+		dev->last_seen_ms = now;
+
+		if (parsed.name[0]) {
+			memcpy(dev->name, parsed.name, sizeof(dev->name));
+		}
+		if (parsed.n_uuid16) {
+			memcpy(dev->uuid16, parsed.uuid16, sizeof(dev->uuid16));
+			dev->n_uuid16 = parsed.n_uuid16;
+		}
+		dev->uuid128 |= parsed.uuid128;
+		if (parsed.has_company) {
+			dev->has_company = true;
+			dev->company_id = parsed.company_id;
+		}
+	}
+
+	if (inserted && evt_enabled) {
+		// does nothing while a report is already scheduled, which is what limits the rate
+		k_work_schedule(&scan_evt_work, K_MSEC(evt_interval_ms));
+	}
+}
+
+static void scan_evt_work_handler(struct k_work *work)
+{
+	struct scan_dev dev;
+	char addr[BT_ADDR_LE_STR_LEN];
+	int reported = 0;
+	bool more = false;
+
+	for (size_t i = 0; i < SCAN_TABLE_SIZE; i++) {
+		bool report = false;
+
+		K_SPINLOCK(&table_lock) {
+			if (table[i].used && !table[i].reported) {
+				if (reported < SCAN_EVT_BATCH) {
+					table[i].reported = true;
+					dev = table[i];
+					report = true;
+				} else {
+					more = true;
+				}
+			}
+		}
+
+		if (report) {
+			bt_addr_le_to_str(&dev.addr, addr, sizeof(addr));
+			shell_print(shell, "[NEW DEVICE]: %s, RSSI %i, %s", addr, dev.last_rssi, dev.name);
+			reported++;
+		}
+	}
+
+	if (more && evt_enabled) {
+		k_work_schedule(&scan_evt_work, K_MSEC(evt_interval_ms));
+	}
+}
+
+int scan_lookup(const bt_addr_le_t *addr, struct scan_dev *dev)
+{
+	int err = -ENOENT;
+
+	K_SPINLOCK(&table_lock) {
+		struct scan_dev *slot = scan_slot(addr);
+
+		if (slot && slot->used) {
+			*dev = *slot;
+			err = 0;
+		}
+	}
+
+	return err;
+}
+
+static void scan_clear(void)
+{
+	K_SPINLOCK(&table_lock) {
+		memset(table, 0, sizeof(table));
+		table_drops = 0;
+		reports = 0;
+		matched = 0;
+	}
+}
+
+static int scan_cmp_rssi(const void *a, const void *b)
+{
+	const struct scan_dev *x = a;
+	const struct scan_dev *y = b;
+
+	// strongest (closest) devices first
+	return y->avg_rssi_q4 - x->avg_rssi_q4;
+}
+
+static int scan_list(const struct shell *sh)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	char uuids[SCAN_UUIDS * 5 + 5];
+	uint32_t now = k_uptime_get_32();
+	size_t n = 0;
+	uint32_t drops, n_reports, n_matched;
+
+	K_SPINLOCK(&table_lock) {
+		for (size_t i = 0; i < SCAN_TABLE_SIZE; i++) {
+			if (table[i].used) {
+				list_copy[n++] = table[i];
+			}
+		}
+		drops = table_drops;
+		n_reports = reports;
+		n_matched = matched;
+	}
+
+	qsort(list_copy, n, sizeof(list_copy[0]), scan_cmp_rssi);
+
+	shell_print(sh, "%-30s %4s %4s %4s %7s %7s %7s %-16s %s", "address", "type", "rssi", "avg", "count",
+		    "first_s", "last_s", "name", "uuids");
+
+	for (size_t i = 0; i < n; i++) {
+		struct scan_dev *dev = &list_copy[i];
+		int len = 0;
+
+		uuids[0] = '\0';
+		for (uint8_t u = 0; u < dev->n_uuid16; u++) {
+			len += snprintf(&uuids[len], sizeof(uuids) - len, "%04x ", dev->uuid16[u]);
+		}
+		if (dev->uuid128) {
+			snprintf(&uuids[len], sizeof(uuids) - len, "+128");
+		}
+
+		bt_addr_le_to_str(&dev->addr, addr, sizeof(addr));
+		shell_print(sh, "%-30s %4u %4d %4d %7u %7u %7u %-16s %s", addr, dev->adv_type, dev->last_rssi,
+			    dev->avg_rssi_q4 / 16, dev->adv_count, (now - dev->first_seen_ms) / 1000,
+			    (now - dev->last_seen_ms) / 1000, dev->name, uuids);
+	}
+
+	shell_print(sh, "%zu devices, %u dropped (table full), %u of %u reports matched the filter", n, drops, n_matched,
+		    n_reports);
+	return 0;
+}
+
+static int scan_events(const struct shell *sh, size_t argc, char *argv[])
+{
+	if (argc < 3) {
+		shell_print(sh, "new device events %s, interval %u ms", evt_enabled ? "on" : "off", evt_interval_ms);
+		return 0;
+	}
+
+	if (!strcmp(argv[2], "on")) {
+		if (argc > 3) {
+			evt_interval_ms = MAX(strtoul(argv[3], NULL, 10), 1);
+		}
+		evt_enabled = true;
+	} else if (!strcmp(argv[2], "off")) {
+		evt_enabled = false;
+		k_work_cancel_delayable(&scan_evt_work);
+	} else {
+		shell_error(sh, "Usage: scan events [on [interval_ms] | off]");
+		return -EINVAL;
+	}
+
+	shell_print(sh, "new device events %s, interval %u ms", evt_enabled ? "on" : "off", evt_interval_ms);
+	return 0;
+}
+
+static int scan_start(void)
+{
+	struct bt_le_scan_param param = { 0 };
+	int err;
+
+	K_SPINLOCK(&table_lock) {
+		param.type = filter.passive ? BT_LE_SCAN_TYPE_PASSIVE : BT_LE_SCAN_TYPE_ACTIVE;
+		param.options = (filter.dup_filter ? BT_LE_SCAN_OPT_FILTER_DUPLICATE : 0) |
+				(filter.accept_list ? BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST : 0);
+		param.interval = filter.interval;
+		param.window = filter.window;
+	}
+
+	err = bt_le_scan_start(&param, scan_started);
+	if (err) {
+		shell_error(shell,"Scanning failed to start, reason: %d (%s)", err, bt_hci_err_to_str(err));
+		return err;
+	} else {
+		shell_print(shell,"Scanning successfully started");
+	}
+
+	scanning = true;
+	return 0;
+}
+
+static int scan_stop(void)
+{
+	int err = bt_le_scan_stop();
+
+	if (err) {
+		shell_error(shell, "Stopping scanning failed, reason: %d (%s)", err, bt_hci_err_to_str(err));
+		return err;
+	} else {
+		shell_print(shell, "Scan successfully stopped");
+	}
+
+	scanning = false;
+	return 0;
+}
+
+static void scan_filter_show(const struct shell *sh)
+{
+	struct scan_filter f;
+
+	K_SPINLOCK(&table_lock) {
+		f = filter;
+	}
+
+	shell_print(sh, "controller: accept list %s, duplicates %s, %s, interval %u, window %u (0.625 ms)",
+		    f.accept_list ? "on" : "off", f.dup_filter ? "filtered" : "reported",
+		    f.passive ? "passive" : "active", f.interval, f.window);
+	shell_print(sh, "host: rssi > %d, %s, name \"%s\", uuid %04x, company %s%04x", f.rssi_above,
+		    f.connectable_only ? "connectable only" : "all types", f.name, f.uuid16,
+		    f.has_company ? "" : "any/", f.company_id);
+}
+
+static bool scan_parse_on_off(const char *arg, bool *val)
+{
+	if (!strcmp(arg, "on")) {
+		*val = true;
+	} else if (!strcmp(arg, "off")) {
+		*val = false;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// hex, as the UUIDs and company ids are written in the assigned numbers
+static int scan_parse_u16(const char *arg, uint16_t *val)
+{
+	int err = 0;
+	unsigned long num = shell_strtoul(arg, 16, &err);
+
+	if (err || num > UINT16_MAX) {
+		return -EINVAL;
+	}
+
+	*val = num;
+	return 0;
+}
+
+/* The host cannot read the accept list back, so the entries the operator added are kept here as well. Connecting
+ * from the accept list (connect_mode auto) swaps them for the DUT and puts them back afterwards.
+ */
+static bt_addr_le_t accept[SCAN_ACCEPT_MAX];
+static uint8_t n_accept;
+
+static int scan_accept_index(const bt_addr_le_t *addr)
+{
+	for (int i = 0; i < n_accept; i++) {
+		if (bt_addr_le_eq(&accept[i], addr)) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+// controller accept list with just addr, the operator's entries stay saved
+int scan_accept_list_only(const bt_addr_le_t *addr)
+{
+	int err;
+
+	err = bt_le_filter_accept_list_clear();
+	if (!err) {
+		err = bt_le_filter_accept_list_add(addr);
+	}
+
+	return err;
+}
+
+// back to the operator's entries
+int scan_accept_list_restore(void)
+{
+	int err;
+
+	err = bt_le_filter_accept_list_clear();
+	for (int i = 0; i < n_accept && !err; i++) {
+		err = bt_le_filter_accept_list_add(&accept[i]);
+	}
+
+	return err;
+}
+
+// the accept list can not be changed while the scanner might use it
+static int scan_accept_list(const struct shell *sh, size_t argc, char *argv[], struct scan_filter *f)
+{
+	bt_addr_le_t addr;
+	int idx;
+	int err;
+
+	if (argc > 3 && scan_parse_on_off(argv[3], &f->accept_list)) {
+		return 0;
+	}
+
+	if (argc > 3 && !strcmp(argv[3], "clear")) {
+		err = bt_le_filter_accept_list_clear();
+		if (err) {
+			shell_error(sh, "Clearing the accept list failed (err %d)", err);
+			return err;
+		}
+		n_accept = 0;
+		return 0;
+	}
+
+	if (argc > 5 && (!strcmp(argv[3], "add") || !strcmp(argv[3], "remove"))) {
+		err = bt_addr_le_from_str(argv[4], argv[5], &addr);
+		if (err) {
+			shell_error(sh, "Invalid peer address (err %d)", err);
+			return err;
+		}
+
+		if (!strcmp(argv[3], "add") && scan_accept_index(&addr) < 0 && n_accept == SCAN_ACCEPT_MAX) {
+			shell_error(sh, "The accept list is full (%d entries)", SCAN_ACCEPT_MAX);
+			return -ENOMEM;
+		}
+
+		err = !strcmp(argv[3], "add") ? bt_le_filter_accept_list_add(&addr) :
+						  bt_le_filter_accept_list_remove(&addr);
+		if (err) {
+			shell_error(sh, "Updating the accept list failed (err %d)", err);
+			return err;
+		}
+
+		idx = scan_accept_index(&addr);
+		if (!strcmp(argv[3], "add") && idx < 0) {
+			accept[n_accept++] = addr;
+		} else if (!strcmp(argv[3], "remove") && idx >= 0) {
+			accept[idx] = accept[--n_accept];
+		}
+		return 0;
+	}
+
+	shell_error(sh, "Usage: scan filter accept <on | off | clear | add <addr> <type> | remove <addr> <type>>");
+	return -EINVAL;
+}
+
+static int scan_filter_cmd(const struct shell *sh, size_t argc, char *argv[])
+{
+	struct scan_filter f;
+	bool was_scanning = scanning;
+	const char *what;
+	int err = 0;
+
+	if (argc < 3) {
+		scan_filter_show(sh);
+		return 0;
+	}
+
+	K_SPINLOCK(&table_lock) {
+		f = filter;
+	}
+
+	what = argv[2];
+
+	if (!strcmp(what, "reset")) {
+		f = (struct scan_filter)SCAN_FILTER_DEFAULT;
+	} else if (!strcmp(what, "accept")) {
+		// controller settings only apply to a newly started scan
+		if (was_scanning) {
+			scan_stop();
+		}
+		err = scan_accept_list(sh, argc, argv, &f);
+	} else if (argc < 4) {
+		shell_error(sh, "%s needs a value", what);
+		return -EINVAL;
+	} else if (!strcmp(what, "rssi")) {
+		long rssi = shell_strtol(argv[3], 10, &err);
+
+		f.rssi_above = CLAMP(rssi, INT8_MIN, INT8_MAX);
+	} else if (!strcmp(what, "connectable")) {
+		err = scan_parse_on_off(argv[3], &f.connectable_only) ? 0 : -EINVAL;
+	} else if (!strcmp(what, "name")) {
+		if (!strcmp(argv[3], "off")) {
+			f.name[0] = '\0';
+		} else {
+			strncpy(f.name, argv[3], SCAN_NAME_LEN);
+			f.name[SCAN_NAME_LEN] = '\0';
+		}
+	} else if (!strcmp(what, "uuid")) {
+		f.uuid16 = 0;
+		if (strcmp(argv[3], "off")) {
+			err = scan_parse_u16(argv[3], &f.uuid16);
+		}
+	} else if (!strcmp(what, "mfg")) {
+		f.has_company = strcmp(argv[3], "off");
+		f.company_id = 0;
+		if (f.has_company) {
+			err = scan_parse_u16(argv[3], &f.company_id);
+		}
+	} else if (!strcmp(what, "dup")) {
+		err = scan_parse_on_off(argv[3], &f.dup_filter) ? 0 : -EINVAL;
+	} else if (!strcmp(what, "passive")) {
+		err = scan_parse_on_off(argv[3], &f.passive) ? 0 : -EINVAL;
+	} else if (!strcmp(what, "timing") && argc > 4) {
+		unsigned long interval_ms = shell_strtoul(argv[3], 10, &err);
+		unsigned long window_ms = err ? 0 : shell_strtoul(argv[4], 10, &err);
+
+		// ms to 0.625 ms units, the controller requires window <= interval
+		f.interval = CLAMP(MIN(interval_ms, 0x4000) * 1000 / 625, 0x0004, 0x4000);
+		f.window = CLAMP(MIN(window_ms, 0x4000) * 1000 / 625, 0x0004, f.interval);
+	} else {
+		shell_help(sh);
+		return SHELL_CMD_HELP_PRINTED;
+	}
+
+	if (err) {
+		if (err == -EINVAL) {
+			shell_error(sh, "invalid value for %s", what);
+		}
+		if (was_scanning && !scanning) {
+			scan_start();
+		}
+		return err;
+	}
+
+	K_SPINLOCK(&table_lock) {
+		filter = f;
+	}
+
+	if (was_scanning && (!strcmp(what, "accept") || !strcmp(what, "dup") || !strcmp(what, "passive") ||
+			     !strcmp(what, "timing") || !strcmp(what, "reset"))) {
+		if (scanning) {
+			scan_stop();
+		}
+		scan_start();
+	}
+
+	scan_filter_show(sh);
+	return 0;
+}
+
+int cmd_scan(const struct shell *sh, size_t argc, char *argv[])
+{
+	const char *action = argv[1];
+
+	if (argc < 2) {
+		shell_error(sh, "Wrong number of arguments.");
+		shell_help(sh);
+		return SHELL_CMD_HELP_PRINTED;
+	}
+
+	if (!strcmp(action, "start")) {
+		return scan_start();
+	}
+
+	if (!strcmp(action, "stop")) {
+		return scan_stop();
+	}
+
+	if (!strcmp(action, "list")) {
+		return scan_list(sh);
+	}
+
+	if (!strcmp(action, "clear")) {
+		scan_clear();
+		shell_print(sh, "scan table cleared");
+		return 0;
+	}
+
+	if (!strcmp(action, "events")) {
+		return scan_events(sh, argc, argv);
+	}
+
+	if (!strcmp(action, "filter")) {
+		return scan_filter_cmd(sh, argc, argv);
+	}
+
+	shell_help(sh);
+	return SHELL_CMD_HELP_PRINTED;
+}
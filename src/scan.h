@@ -0,0 +1,56 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define SCAN_TABLE_SIZE   64    // power of two, open addressing
+#define SCAN_NAME_LEN     16
+#define SCAN_UUIDS        4
+
+#define SCAN_EVT_INTERVAL_MS   1000  // default spacing of "new device" reports
+#define SCAN_EVT_BATCH         8     // devices reported per interval at most
+
+#define SCAN_ACCEPT_MAX   8     // entries of the filter accept list the operator can add
+
+/* One advertiser seen while scanning */
+struct scan_dev {
+	bt_addr_le_t addr;
+	bool used;
+	bool reported;              // "new device" event already emitted
+	uint8_t adv_type;
+	int8_t last_rssi;
+	int16_t avg_rssi_q4;        // moving average in 1/16 dBm
+	uint32_t adv_count;
+	uint32_t first_seen_ms;
+	uint32_t last_seen_ms;
+	char name[SCAN_NAME_LEN + 1];
+	uint16_t uuid16[SCAN_UUIDS];
+	uint8_t n_uuid16;
+	bool uuid128;               // advertises (at least one) 128 bit service uuid
+	bool has_company;
+	uint16_t company_id;        // first two bytes of the manufacturer data
+};
+
+/* What the scanner lets through. The controller applies the accept list and duplicate filtering, so these reports
+ * never reach the host; the remaining fields are matched on the host against the parsed advertising data.
+ */
+struct scan_filter {
+	int8_t rssi_above;          // reports at or below are dropped
+	bool connectable_only;
+	char name[SCAN_NAME_LEN + 1];  // substring of the advertised name, empty matches all
+	uint16_t uuid16;            // 0 matches all
+	bool has_company;
+	uint16_t company_id;
+	bool accept_list;           // controller only reports devices on the filter accept list
+	bool dup_filter;            // controller drops repeated reports of the same advertiser
+	bool passive;
+	uint16_t interval;          // 0.625 ms units
+	uint16_t window;            // 0.625 ms units
+};
+
+int scan_lookup(const bt_addr_le_t *addr, struct scan_dev *dev);
+int scan_accept_list_only(const bt_addr_le_t *addr);
+int scan_accept_list_restore(void);
+
+int cmd_scan(const struct shell *sh, size_t argc, char *argv[]);
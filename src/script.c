@@ -0,0 +1,604 @@
+#include "script.h"
+#include "ifa.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/shell/shell_dummy.h>
+#include <zephyr/shell/shell_uart.h>
+
+/* Command scripts. A script is a list of statements, separated by ';' or newlines, stored in flash under
+ * "bleframework/script/<name>" and run on its own thread, so the steps of a test procedure follow each other without a
+ * round trip over the UART. A statement is a shell command, run as typed ("bleframework unpair ..."), or one of
+ *   repeat <n> ... end          loop, nested up to SCRIPT_DEPTH_MAX deep
+ *   wait <event> [timeout_ms]   an event since the previous command: connected, disconnected, security, paired,
+ *                               pair_failed, bond_deleted; "wait job" waits until all queued jobs have finished
+ *   sleep <ms>
+ *   label <name>, goto <name>   labels only outside of loops
+ *   iferr <statement>           the statement only runs if the last one failed, ifok only if it succeeded
+ *   exit [code]
+ *   # comment
+ * What iferr/ifok look at: the return code of a command, -ETIMEDOUT of a wait that timed out, the HCI or security error
+ * of the awaited event, and after "wait job" the result of the last job.
+ *
+ * Commands run on the dummy shell backend, see script_shell_exec(). Every jump back (end of a loop pass, goto) sleeps a
+ * tick, so a script that only loops cannot starve the UART shell and the operator can still type "script stop".
+ */
+
+#define SCRIPT_EVT_JOB   (IFA_EVT_BOND_DELETED + 1)
+#define SCRIPT_EVT_STOP  (SCRIPT_EVT_JOB + 1)
+
+enum script_cond {
+  SCRIPT_ALWAYS,
+  SCRIPT_IFERR,
+  SCRIPT_IFOK,
+};
+
+struct script_slot {
+  char name[SCRIPT_NAME_MAX + 1];
+  uint16_t len;
+  char text[SCRIPT_SIZE];
+};
+
+/* statements of the script being run or checked */
+struct script_prog {
+  char buf[SCRIPT_SIZE + 1];
+  const char *lines[SCRIPT_LINES_MAX];
+  int16_t jump[SCRIPT_LINES_MAX];   // repeat: its end, goto: the label
+  uint8_t n;
+};
+
+static const struct {
+  const char *name;
+  uint8_t evt;
+} wait_events[] = {
+  { "connected", IFA_EVT_CONNECTED },
+  { "disconnected", IFA_EVT_DISCONNECTED },
+  { "security", IFA_EVT_SECURITY_CHANGED },
+  { "paired", IFA_EVT_PAIRING_COMPLETE },
+  { "pair_failed", IFA_EVT_PAIRING_FAILED },
+  { "bond_deleted", IFA_EVT_BOND_DELETED },
+  { "job", SCRIPT_EVT_JOB },
+};
+
+static struct script_slot slots[SCRIPT_SLOTS];
+static struct script_prog prog;       // only touched while no script runs, or by the script thread
+static uint8_t run_slot;
+static atomic_t running;
+static atomic_t stopping;
+static int evt_status[SCRIPT_EVT_JOB + 1];
+static K_EVENT_DEFINE(script_evts);
+static K_SEM_DEFINE(script_sem, 0, 1);
+
+static struct script_slot *script_find(const char *name){
+  for (int i = 0; i < SCRIPT_SLOTS; i++) {
+    if (slots[i].name[0] && !strcmp(slots[i].name, name)) {
+      return &slots[i];
+    }
+  }
+
+  return NULL;
+}
+
+static struct script_slot *script_get(const char *name){
+  struct script_slot *slot = script_find(name);
+
+  for (int i = 0; i < SCRIPT_SLOTS && !slot; i++) {
+    if (!slots[i].name[0]) {
+      slot = &slots[i];
+      strcpy(slot->name, name);
+      slot->len = 0;
+    }
+  }
+
+  return slot;
+}
+
+static int script_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+  struct script_slot *slot;
+
+  if (!name || strlen(name) > SCRIPT_NAME_MAX || len > SCRIPT_SIZE) {
+    return -EINVAL;
+  }
+
+  slot = script_get(name);
+  if (!slot) {
+    return -ENOMEM;
+  }
+
+  if (read_cb(cb_arg, slot->text, len) != len) {
+    slot->name[0] = '\0';
+    return -EIO;
+  }
+
+  slot->len = len;
+  return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(bleframework_script, "bleframework/script", NULL, script_set, NULL, NULL);
+
+static int script_save(const struct script_slot *slot){
+  char key[sizeof("bleframework/script/") + SCRIPT_NAME_MAX];
+
+  snprintk(key, sizeof(key), "bleframework/script/%s", slot->name);
+  return slot->len ? settings_save_one(key, slot->text, slot->len) : settings_delete(key);
+}
+
+/* Parser ---------------------------------------------------------------------------------------------------------------- */
+
+// arguments of stmt if it is the keyword kw, NULL otherwise
+static const char *script_kw(const char *stmt, const char *kw){
+  size_t len = strlen(kw);
+
+  if (strncmp(stmt, kw, len) || (stmt[len] != '\0' && stmt[len] != ' ')) {
+    return NULL;
+  }
+
+  stmt += len;
+  while (*stmt == ' ') {
+    stmt++;
+  }
+  return stmt;
+}
+
+// strips an iferr/ifok prefix
+static const char *script_cond(const char *stmt, enum script_cond *cond){
+  const char *rest;
+
+  *cond = SCRIPT_ALWAYS;
+  if ((rest = script_kw(stmt, "iferr"))) {
+    *cond = SCRIPT_IFERR;
+    return rest;
+  }
+  if ((rest = script_kw(stmt, "ifok"))) {
+    *cond = SCRIPT_IFOK;
+    return rest;
+  }
+
+  return stmt;
+}
+
+static int script_label(const struct script_prog *p, const char *name){
+  const char *label;
+
+  for (int i = 0; i < p->n; i++) {
+    label = script_kw(p->lines[i], "label");
+    if (label && !strcmp(label, name)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Splits text into statements and resolves the jumps. Errors name the statement, counted from 1. */
+static int script_parse(const struct shell *sh, struct script_prog *p, const char *text, size_t len){
+  int16_t loops[SCRIPT_DEPTH_MAX];
+  uint8_t depth = 0;
+  enum script_cond cond;
+  const char *stmt;
+  char *save;
+
+  memcpy(p->buf, text, len);
+  p->buf[len] = '\0';
+  p->n = 0;
+
+  for (char *line = strtok_r(p->buf, ";\n", &save); line; line = strtok_r(NULL, ";\n", &save)) {
+    char *end;
+
+    while (*line == ' ' || *line == '\t') {
+      line++;
+    }
+    for (end = line + strlen(line); end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'); end--) {
+    }
+    *end = '\0';
+
+    if (!*line || *line == '#') {
+      continue;
+    }
+    if (p->n == SCRIPT_LINES_MAX) {
+      shell_error(sh, "more than %d statements", SCRIPT_LINES_MAX);
+      return -E2BIG;
+    }
+
+    p->jump[p->n] = -1;
+    p->lines[p->n++] = line;
+  }
+
+  for (int i = 0; i < p->n; i++) {
+    stmt = script_cond(p->lines[i], &cond);
+
+    if (script_kw(stmt, "repeat") || script_kw(stmt, "end") || script_kw(stmt, "label")) {
+      if (cond != SCRIPT_ALWAYS) {
+        shell_error(sh, "statement %d: %s cannot be conditional", i + 1, stmt);
+        return -EINVAL;
+      }
+    }
+
+    if (script_kw(stmt, "repeat")) {
+      if (depth == SCRIPT_DEPTH_MAX) {
+        shell_error(sh, "statement %d: loops nested deeper than %d", i + 1, SCRIPT_DEPTH_MAX);
+        return -EINVAL;
+      }
+      loops[depth++] = i;
+    } else if (script_kw(stmt, "end")) {
+      if (!depth) {
+        shell_error(sh, "statement %d: end without repeat", i + 1);
+        return -EINVAL;
+      }
+      p->jump[loops[--depth]] = i;
+    } else if (script_kw(stmt, "label") && depth) {
+      shell_error(sh, "statement %d: label inside a loop", i + 1);
+      return -EINVAL;
+    } else if (script_kw(stmt, "goto")) {
+      p->jump[i] = script_label(p, script_kw(stmt, "goto"));
+      if (p->jump[i] < 0) {
+        shell_error(sh, "statement %d: no label %s", i + 1, script_kw(stmt, "goto"));
+        return -EINVAL;
+      }
+    }
+  }
+
+  if (depth) {
+    shell_error(sh, "statement %d: repeat without end", loops[depth - 1] + 1);
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+/* Interpreter ----------------------------------------------------------------------------------------------------------- */
+
+static k_timeout_t script_timeout(const char *ms){
+  return *ms ? K_MSEC(strtoul(ms, NULL, 10)) : K_FOREVER;
+}
+
+static int script_sleep(const char *args){
+  // only script stop ends it early
+  return k_event_wait(&script_evts, BIT(SCRIPT_EVT_STOP), false, script_timeout(args)) ? -ECANCELED : 0;
+}
+
+static int script_wait(const char *args){
+  const char *arg = args;
+  k_timepoint_t deadline;
+  uint32_t mask;
+  uint8_t evt;
+  size_t len;
+  int i;
+
+  len = strcspn(args, " ");
+  for (i = 0; i < ARRAY_SIZE(wait_events); i++) {
+    if (strlen(wait_events[i].name) == len && !strncmp(args, wait_events[i].name, len)) {
+      break;
+    }
+  }
+  if (i == ARRAY_SIZE(wait_events)) {
+    shell_error(shell, "script: unknown event %.*s", (int)len, args);
+    return -EINVAL;
+  }
+
+  evt = wait_events[i].evt;
+  mask = BIT(evt) | BIT(SCRIPT_EVT_STOP);
+  arg += len;
+  while (*arg == ' ') {
+    arg++;
+  }
+  deadline = sys_timepoint_calc(script_timeout(arg));
+
+  // a job ends per event, wait until the last queued one did
+  do {
+    if (evt == SCRIPT_EVT_JOB && worker_idle()) {
+      break;
+    }
+    if (!k_event_wait(&script_evts, mask, false, sys_timepoint_timeout(deadline))) {
+      return -ETIMEDOUT;
+    }
+    if (atomic_get(&stopping)) {
+      return -ECANCELED;
+    }
+    k_event_clear(&script_evts, BIT(evt));
+  } while (evt == SCRIPT_EVT_JOB);
+
+  return evt_status[evt];
+}
+
+static K_MUTEX_DEFINE(exec_lock);
+
+/* shell_execute_cmd() on the UART shell would use its command buffer, the line the operator is typing. Script
+ * statements and the boot commands run on the dummy backend instead, one at a time; what they printed is copied to the
+ * console afterwards.
+ */
+int script_shell_exec(const char *cmd){
+  const struct shell *sh = shell_backend_dummy_get_ptr();
+  const char *out;
+  size_t len;
+  int err;
+
+  k_mutex_lock(&exec_lock, K_FOREVER);
+  shell_backend_dummy_clear_output(sh);
+  err = shell_execute_cmd(sh, cmd);
+  out = shell_backend_dummy_get_output(sh, &len);
+  if (len) {
+    shell_fprintf(shell ? shell : shell_backend_uart_get_ptr(), SHELL_NORMAL, "%s", out);
+  }
+  k_mutex_unlock(&exec_lock);
+
+  return err;
+}
+
+static int script_command(const char *stmt){
+  // a wait afterwards sees the events this command caused, not older ones
+  k_event_clear(&script_evts, (uint32_t)~BIT(SCRIPT_EVT_STOP));
+  return script_shell_exec(stmt);
+}
+
+static int script_exec(void){
+  struct {
+    uint8_t start;
+    int left;
+  } loops[SCRIPT_DEPTH_MAX];
+  uint8_t depth = 0;
+  enum script_cond cond;
+  const char *stmt;
+  const char *args;
+  int status = 0;
+  int next;
+
+  for (int pc = 0; pc < prog.n; pc = next) {
+    next = pc + 1;
+
+    if (atomic_get(&stopping)) {
+      return -ECANCELED;
+    }
+
+    stmt = script_cond(prog.lines[pc], &cond);
+    if ((cond == SCRIPT_IFERR && !status) || (cond == SCRIPT_IFOK && status)) {
+      continue;
+    }
+
+    if ((args = script_kw(stmt, "repeat"))) {
+      int n = atoi(args);
+
+      if (n > 0) {
+        loops[depth].start = next;
+        loops[depth++].left = n;
+      } else {
+        next = prog.jump[pc] + 1;
+      }
+    } else if (script_kw(stmt, "end")) {
+      if (--loops[depth - 1].left > 0) {
+        next = loops[depth - 1].start;
+      } else {
+        depth--;
+      }
+    } else if (script_kw(stmt, "goto")) {
+      // labels are outside of loops
+      depth = 0;
+      next = prog.jump[pc];
+    } else if (script_kw(stmt, "label")) {
+    } else if ((args = script_kw(stmt, "exit"))) {
+      return atoi(args);
+    } else if ((args = script_kw(stmt, "sleep"))) {
+      status = script_sleep(args);
+    } else if ((args = script_kw(stmt, "wait"))) {
+      status = script_wait(args);
+    } else {
+      status = script_command(stmt);
+    }
+
+    if (next <= pc) {
+      k_sleep(K_TICKS(1));
+    }
+  }
+
+  return 0;
+}
+
+static void script_report(const char *name, int err, int64_t duration_ms){
+  struct output_field fields[] = {
+    OUTPUT_STR("name", name),
+    OUTPUT_NUM("err", err),
+    OUTPUT_NUM("ms", duration_ms),
+  };
+
+  if (output_structured()) {
+    output_record("script_end", k_uptime_get_32(), 0, fields, ARRAY_SIZE(fields));
+  } else {
+    shell_print(shell, "script %s finished with %d after %lld ms", name, err, duration_ms);
+  }
+}
+
+static void script_thread(void *p1, void *p2, void *p3){
+  int64_t start;
+  int err;
+
+  for (;;) {
+    k_sem_take(&script_sem, K_FOREVER);
+
+    start = k_uptime_get();
+    err = script_parse(shell, &prog, slots[run_slot].text, slots[run_slot].len);
+    if (!err) {
+      err = script_exec();
+    }
+    script_report(slots[run_slot].name, err, k_uptime_get() - start);
+
+    atomic_set(&running, 0);
+  }
+}
+
+K_THREAD_DEFINE(script_tid, SCRIPT_STACK_SIZE, script_thread, NULL, NULL, NULL, SCRIPT_PRIORITY, 0, 0);
+
+// Bluetooth host context, see ifa_notify()
+void script_event(uint8_t type, int status){
+  if (!atomic_get(&running) || type >= SCRIPT_EVT_JOB) {
+    return;
+  }
+
+  // the disconnect reason and the bonded flag are no errors
+  evt_status[type] = type == IFA_EVT_DISCONNECTED || type == IFA_EVT_PAIRING_COMPLETE ? 0 : status;
+  k_event_post(&script_evts, BIT(type));
+}
+
+void script_job_done(int err){
+  evt_status[SCRIPT_EVT_JOB] = err;
+  k_event_post(&script_evts, BIT(SCRIPT_EVT_JOB));
+}
+
+/* Shell ----------------------------------------------------------------------------------------------------------------- */
+
+static int script_edit(const struct shell *sh, const char *name, size_t argc, char *argv[], bool append){
+  static struct script_slot next;    // shell thread only
+  struct script_slot *slot;
+  size_t len;
+  int err;
+
+  // the name is part of the settings key
+  if (strlen(name) > SCRIPT_NAME_MAX || strpbrk(name, "/=")) {
+    shell_error(sh, "script names have at most %d characters and no / or =", SCRIPT_NAME_MAX);
+    return -EINVAL;
+  }
+
+  slot = append ? script_find(name) : script_get(name);
+  if (!slot) {
+    shell_error(sh, append ? "no script %s" : "no free slot for %s (%d scripts)", name, SCRIPT_SLOTS);
+    return append ? -ENOENT : -ENOMEM;
+  }
+
+  next = *slot;
+  len = append ? next.len : 0;
+
+  for (size_t i = 0; i < argc; i++) {
+    size_t arg = strlen(argv[i]);
+
+    // words of one statement were split by the shell, statements of an append go on a new line
+    if (len + arg + 1 > SCRIPT_SIZE) {
+      shell_error(sh, "script longer than %d bytes", SCRIPT_SIZE);
+      if (!slot->len) {
+        slot->name[0] = '\0';
+      }
+      return -E2BIG;
+    }
+    if (len) {
+      next.text[len++] = i ? ' ' : '\n';
+    }
+    memcpy(&next.text[len], argv[i], arg);
+    len += arg;
+  }
+  next.len = len;
+
+  err = script_parse(sh, &prog, next.text, next.len);
+  if (err) {
+    if (!slot->len) {
+      slot->name[0] = '\0';
+    }
+    return err;
+  }
+
+  *slot = next;
+  err = script_save(slot);
+  if (err) {
+    shell_error(sh, "saving %s failed (err %d)", name, err);
+    return err;
+  }
+
+  shell_print(sh, "%s: %d statements, %u bytes", name, prog.n, slot->len);
+  return 0;
+}
+
+static int script_show(const struct shell *sh, const struct script_slot *slot){
+  int err = script_parse(sh, &prog, slot->text, slot->len);
+
+  if (err) {
+    return err;
+  }
+
+  for (int i = 0; i < prog.n; i++) {
+    shell_print(sh, "%3d  %s", i + 1, prog.lines[i]);
+  }
+  return 0;
+}
+
+// script list | load <name> <statements> | append <name> <statements> | show <name> | delete <name> | run <name> | stop
+int cmd_script(const struct shell *sh, size_t argc, char *argv[]){
+  struct script_slot *slot;
+  const char *name = argc > 2 ? argv[2] : NULL;
+
+  if (!strcmp(argv[1], "list")) {
+    int n = 0;
+
+    for (int i = 0; i < SCRIPT_SLOTS; i++) {
+      if (slots[i].name[0]) {
+        shell_print(sh, "%-*s %4u bytes%s", SCRIPT_NAME_MAX, slots[i].name, slots[i].len,
+                    atomic_get(&running) && run_slot == i ? ", running" : "");
+        n++;
+      }
+    }
+    shell_print(sh, "%d/%d scripts", n, SCRIPT_SLOTS);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "stop")) {
+    if (!atomic_get(&running)) {
+      shell_print(sh, "no script running");
+      return 0;
+    }
+    atomic_set(&stopping, 1);
+    k_event_post(&script_evts, BIT(SCRIPT_EVT_STOP));
+    shell_print(sh, "stop requested, queued jobs keep running (abort all)");
+    return 0;
+  }
+
+  if (!name) {
+    shell_help(sh);
+    return SHELL_CMD_HELP_PRINTED;
+  }
+
+  // the running script and the checks of an edit share the parser state
+  if (atomic_get(&running)) {
+    shell_error(sh, "a script is running, try again when it finished (script stop)");
+    return -EBUSY;
+  }
+
+  if (!strcmp(argv[1], "load") && argc > 3) {
+    return script_edit(sh, name, argc - 3, &argv[3], false);
+  }
+  if (!strcmp(argv[1], "append") && argc > 3) {
+    return script_edit(sh, name, argc - 3, &argv[3], true);
+  }
+
+  slot = script_find(name);
+  if (!slot) {
+    shell_error(sh, "no script %s", name);
+    return -ENOENT;
+  }
+
+  if (!strcmp(argv[1], "show")) {
+    return script_show(sh, slot);
+  }
+
+  if (!strcmp(argv[1], "delete")) {
+    slot->len = 0;
+    script_save(slot);
+    slot->name[0] = '\0';
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "run")) {
+    if (!shell) {
+      shell_error(sh, "run bleframework init first");
+      return -EPERM;
+    }
+    run_slot = slot - slots;
+    atomic_set(&stopping, 0);
+    k_event_clear(&script_evts, ~0U);
+    atomic_set(&running, 1);
+    k_sem_give(&script_sem);
+    return 0;
+  }
+
+  shell_help(sh);
+  return SHELL_CMD_HELP_PRINTED;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#define SCRIPT_SLOTS        4
+#define SCRIPT_NAME_MAX     15
+#define SCRIPT_SIZE         512        // text of one script
+#define SCRIPT_LINES_MAX    48
+#define SCRIPT_DEPTH_MAX    4          // nested repeat loops
+#define SCRIPT_STACK_SIZE   3072       // shell commands run on it
+#define SCRIPT_PRIORITY     K_PRIO_PREEMPT(7)  // above the shell, jumps back sleep a tick
+
+int script_shell_exec(const char *cmd);
+void script_event(uint8_t type, int status);
+void script_job_done(int err);
+
+int cmd_script(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,146 @@
+#include "session.h"
+#include "conn_profile.h"
+#include "ifa.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+/* Pairing checks against several lab DUTs at once. Only DUTs the operator put on the session list are ever connected
+ * to; `session run` checks all of them in one job, each on its own link (up to CONFIG_BT_MAX_CONN). The KNOB and SCDA
+ * settings are stack wide, so all sessions of a run pair with the same settings, and the identity is never changed:
+ * the IFA stages stay single-DUT.
+ */
+
+static bt_addr_le_t duts[IFA_SESSIONS_MAX];
+static uint8_t n_duts;
+static struct k_spinlock duts_lock;
+
+static int session_job(const struct worker_job *job){
+  struct ifa_check_result results[IFA_SESSIONS_MAX];
+  bt_addr_le_t list[IFA_SESSIONS_MAX];
+  char addr[BT_ADDR_LE_STR_LEN];
+  uint8_t n;
+  int err;
+
+  K_SPINLOCK(&duts_lock) {
+    n = n_duts;
+    memcpy(list, duts, sizeof(list));
+  }
+
+  if (!n) {
+    shell_error(shell, "no DUTs on the session list");
+    return -ENOENT;
+  }
+
+  err = ifa_check(list, n, job->profile, results);
+
+  if (output_structured()) {
+    for (uint8_t i = 0; i < n; i++) {
+      struct output_field fields[] = {
+        OUTPUT_STR("addr", addr),
+        OUTPUT_NUM("err", results[i].err),
+        OUTPUT_NUM("level", results[i].sec_level),
+        OUTPUT_NUM("key_size", results[i].enc_key_size),
+        OUTPUT_NUM("ms", results[i].duration_ms),
+      };
+
+      bt_addr_le_to_str(&list[i], addr, sizeof(addr));
+      output_record("session", k_uptime_get_32(), job->id, fields, ARRAY_SIZE(fields));
+    }
+    return err;
+  }
+
+  shell_print(shell, "%-30s %6s %6s %8s %10s", "dut", "err", "level", "key size", "time (ms)");
+  for (uint8_t i = 0; i < n; i++) {
+    bt_addr_le_to_str(&list[i], addr, sizeof(addr));
+    shell_print(shell, "%-30s %6d %6u %8u %10u", addr, results[i].err, results[i].sec_level,
+                results[i].enc_key_size, results[i].duration_ms);
+  }
+
+  return err;
+}
+
+static int session_find(const bt_addr_le_t *addr){
+  for (uint8_t i = 0; i < n_duts; i++) {
+    if (bt_addr_le_eq(&duts[i], addr)) {
+      return i;
+    }
+  }
+
+  return -ENOENT;
+}
+
+static int session_update(const struct shell *sh, bool add, const bt_addr_le_t *addr){
+  int err = 0;
+  int idx;
+
+  K_SPINLOCK(&duts_lock) {
+    idx = session_find(addr);
+    if (add && idx < 0 && n_duts < IFA_SESSIONS_MAX) {
+      duts[n_duts++] = *addr;
+    } else if (add && idx < 0) {
+      err = -ENOMEM;
+    } else if (!add && idx >= 0) {
+      duts[idx] = duts[--n_duts];
+    } else if (!add) {
+      err = -ENOENT;
+    }
+  }
+
+  if (err == -ENOMEM) {
+    shell_error(sh, "session list full (%d links)", IFA_SESSIONS_MAX);
+  } else if (err) {
+    shell_error(sh, "DUT not on the session list");
+  }
+
+  return err;
+}
+
+int cmd_session(const struct shell *sh, size_t argc, char *argv[]){
+  struct worker_job job = {
+    .name = "session",
+    .run = session_job,
+  };
+  char addr_str[BT_ADDR_LE_STR_LEN];
+  bt_addr_le_t addr;
+  int err;
+
+  if (argc > 3 && (!strcmp(argv[1], "add") || !strcmp(argv[1], "remove"))) {
+    err = bt_addr_le_from_str(argv[2], argv[3], &addr);
+    if (err < 0) {
+      shell_error(sh, "Invalid peer address (err %d)", err);
+      return err;
+    }
+
+    err = session_update(sh, !strcmp(argv[1], "add"), &addr);
+    if (err) {
+      return err;
+    }
+  } else if (argc > 1 && !strcmp(argv[1], "clear")) {
+    K_SPINLOCK(&duts_lock) {
+      n_duts = 0;
+    }
+  } else if (argc > 1 && !strcmp(argv[1], "run")) {
+    if (argc > 2) {
+      err = conn_profile_parse(argv[2]);
+      if (err < 0) {
+        shell_error(sh, "unknown connection profile %s", argv[2]);
+        return err;
+      }
+      job.profile = err;
+    }
+    return worker_submit(sh, &job);
+  } else if (argc > 1 && strcmp(argv[1], "list")) {
+    shell_help(sh);
+    return SHELL_CMD_HELP_PRINTED;
+  }
+
+  // the list is only changed from the shell thread
+  for (uint8_t i = 0; i < n_duts; i++) {
+    bt_addr_le_to_str(&duts[i], addr_str, sizeof(addr_str));
+    shell_print(sh, "%u: %s", i, addr_str);
+  }
+  shell_print(sh, "%u/%d DUTs", n_duts, IFA_SESSIONS_MAX);
+
+  return 0;
+}
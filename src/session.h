@@ -0,0 +1,6 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+int cmd_session(const struct shell *sh, size_t argc, char *argv[]);
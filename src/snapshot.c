@@ -0,0 +1,328 @@
+#include "snapshot.h"
+#include "ifa.h"
+#include "main.h"
+#include "output.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <host/id.h>
+#include <host/keys.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/settings/settings.h>
+
+/* Bonding state of stage 1 per DUT: our identity at that time and the key pool entry of the DUT. Switching between the
+ * DUTs of a rack restores a slot instead of pairing again. With persistence on, slots are kept in settings under
+ * "bleframework/snap/<slot>" and loaded with the other settings at init; the setting itself is kept under
+ * "bleframework/snap/persist".
+ */
+
+struct snapshot_entry {
+  bool used;
+  bt_addr_le_t dut;
+  bt_addr_le_t id_addr;
+  uint8_t id_irk[16];
+  uint32_t taken;                      // uptime in s when taken, informational only
+  uint8_t keys[BT_KEYS_STORAGE_LEN];   // struct bt_keys from storage_start, the part the stack persists itself
+};
+
+static struct snapshot_entry slots[SNAPSHOT_SLOTS];
+static bool persist;
+
+static struct snapshot_entry *snapshot_find(const bt_addr_le_t *dut){
+  for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+    if (slots[i].used && bt_addr_le_eq(&slots[i].dut, dut)) {
+      return &slots[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void snapshot_write(const struct snapshot_entry *entry, int idx){
+  char name[24];
+  int err;
+
+  snprintk(name, sizeof(name), "bleframework/snap/%d", idx);
+  err = entry->used ? settings_save_one(name, entry, sizeof(*entry)) : settings_delete(name);
+  if (err) {
+    shell_error(shell, "snapshot: saving slot %d failed (err %d)", idx, err);
+  }
+}
+
+static void snapshot_save(const struct snapshot_entry *entry, int idx){
+  if (persist) {
+    snapshot_write(entry, idx);
+  }
+}
+
+static int snapshot_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+  int idx;
+
+  if (name && !strcmp(name, "persist")) {
+    return read_cb(cb_arg, &persist, sizeof(persist)) == sizeof(persist) ? 0 : -EIO;
+  }
+
+  idx = atoi(name);
+
+  // a layout change of struct bt_keys (Kconfig) invalidates stored slots
+  if (idx < 0 || idx >= SNAPSHOT_SLOTS || len != sizeof(slots[0])) {
+    return -EINVAL;
+  }
+
+  if (read_cb(cb_arg, &slots[idx], sizeof(slots[idx])) != sizeof(slots[idx])) {
+    memset(&slots[idx], 0, sizeof(slots[idx]));
+    return -EIO;
+  }
+
+  return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(bleframework_snap, "bleframework/snap", NULL, snapshot_set, NULL, NULL);
+
+// snapshots the keys of dut together with the current default identity; replaces an older slot of the same DUT
+int snapshot_store(const bt_addr_le_t *dut){
+  struct snapshot_entry *entry = snapshot_find(dut);
+  struct bt_keys *keys = bt_keys_find_addr(BT_ID_DEFAULT, dut);
+
+  if (!keys) {
+    return -ENOENT;
+  }
+
+  for (int i = 0; !entry && i < SNAPSHOT_SLOTS; i++) {
+    if (!slots[i].used) {
+      entry = &slots[i];
+    }
+  }
+  if (!entry) {
+    shell_error(shell, "snapshot table full (%d slots), drop one first", SNAPSHOT_SLOTS);
+    return -ENOMEM;
+  }
+
+  entry->used = true;
+  entry->dut = *dut;
+  entry->taken = k_uptime_seconds();
+  bt_get_identity(BT_ID_DEFAULT, &entry->id_addr);
+  bt_get_irk(BT_ID_DEFAULT, entry->id_irk);
+  memcpy(entry->keys, keys->storage_start, sizeof(entry->keys));
+
+  snapshot_save(entry, entry - slots);
+  return 0;
+}
+
+// writes the slot of dut to flash even with persistence off, a campaign needs it after a reset
+int snapshot_persist(const bt_addr_le_t *dut){
+  struct snapshot_entry *entry = snapshot_find(dut);
+
+  if (!entry) {
+    return -ENOENT;
+  }
+
+  snapshot_write(entry, entry - slots);
+  return 0;
+}
+
+// the campaign is over: with persistence off, its slot leaves flash again (the RAM slot stays)
+void snapshot_unpersist(const bt_addr_le_t *dut){
+  struct snapshot_entry empty = { 0 };
+  struct snapshot_entry *entry = snapshot_find(dut);
+
+  if (entry && !persist) {
+    snapshot_write(&empty, entry - slots);
+  }
+}
+
+// our identity at the time the slot of dut was taken
+int snapshot_identity(const bt_addr_le_t *dut, bt_addr_le_t *id_addr, uint8_t id_irk[16]){
+  struct snapshot_entry *entry = snapshot_find(dut);
+
+  if (!entry) {
+    return -ENOENT;
+  }
+
+  *id_addr = entry->id_addr;
+  memcpy(id_irk, entry->id_irk, sizeof(entry->id_irk));
+  return 0;
+}
+
+// IRK the DUT distributed when the slot was taken, recognises its RPAs while it is not bonded to us
+int snapshot_dut_irk(const bt_addr_le_t *dut, uint8_t irk[16]){
+  struct snapshot_entry *entry = snapshot_find(dut);
+  struct bt_keys keys;
+
+  if (!entry) {
+    return -ENOENT;
+  }
+
+  memcpy(keys.storage_start, entry->keys, sizeof(entry->keys));
+  if (!(keys.keys & BT_KEYS_IRK)) {
+    return -ENOENT;
+  }
+
+  memcpy(irk, keys.irk.val, sizeof(keys.irk.val));
+  return 0;
+}
+
+// puts the keys of dut back into the key pool and storage; the identity is left alone
+int snapshot_restore_keys(const bt_addr_le_t *dut){
+  struct snapshot_entry *entry = snapshot_find(dut);
+  struct bt_keys *keys;
+
+  if (!entry) {
+    return -ENOENT;
+  }
+
+  keys = bt_keys_get_addr(BT_ID_DEFAULT, dut);
+  if (!keys) {
+    return -ENOMEM;
+  }
+
+  memcpy(keys->storage_start, entry->keys, sizeof(entry->keys));
+  return bt_keys_store(keys);
+}
+
+// identity and keys of the slot, then the resolving list, so the DUT can reconnect with its old bond right away
+static int snapshot_restore(const struct shell *sh, const bt_addr_le_t *dut){
+  struct snapshot_entry *entry = snapshot_find(dut);
+  struct bt_keys *keys;
+  int err;
+
+  if (!entry) {
+    shell_error(sh, "no snapshot for this DUT");
+    return -ENOENT;
+  }
+
+  if (worker_busy()) {
+    shell_error(sh, "a job is running, try again when it finished");
+    return -EBUSY;
+  }
+
+  err = ifa_id_set(&entry->id_addr, entry->id_irk);
+  if (err < 0) {
+    shell_error(sh, "restoring the identity failed (err %d)", err);
+    return err;
+  }
+
+  err = snapshot_restore_keys(dut);
+  if (err) {
+    shell_error(sh, "restoring the keys failed (err %d)", err);
+    return err;
+  }
+
+  keys = bt_keys_find_addr(BT_ID_DEFAULT, dut);
+  if (keys && (keys->keys & BT_KEYS_IRK) && !(keys->state & BT_KEYS_ID_ADDED)) {
+    bt_id_add(keys);
+  }
+
+  shell_print(sh, "identity and keys restored");
+  return 0;
+}
+
+static void snapshot_list(const struct shell *sh){
+  char dut[BT_ADDR_LE_STR_LEN];
+  char id[BT_ADDR_LE_STR_LEN];
+  int n = 0;
+
+  for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+    if (!slots[i].used) {
+      continue;
+    }
+
+    bt_addr_le_to_str(&slots[i].dut, dut, sizeof(dut));
+    bt_addr_le_to_str(&slots[i].id_addr, id, sizeof(id));
+    if (output_structured()) {
+      struct output_field fields[] = {
+        OUTPUT_NUM("slot", i),
+        OUTPUT_STR("addr", dut),
+        OUTPUT_STR("id", id),
+        OUTPUT_NUM("taken_s", slots[i].taken),
+        OUTPUT_NUM("persist", persist),
+      };
+
+      output_record("snapshot", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+    } else {
+      shell_print(sh, "%d: %s as %s, taken at %u s", i, dut, id, slots[i].taken);
+    }
+    n++;
+  }
+
+  if (!output_structured()) {
+    shell_print(sh, "%d/%d slots used, persistence %s", n, SNAPSHOT_SLOTS, persist ? "on" : "off");
+  }
+}
+
+static int snapshot_drop(const struct shell *sh, const bt_addr_le_t *dut){
+  struct snapshot_entry *entry;
+
+  for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+    entry = &slots[i];
+    if (entry->used && (!dut || bt_addr_le_eq(&entry->dut, dut))) {
+      memset(entry, 0, sizeof(*entry));
+      snapshot_save(entry, i);
+      if (dut) {
+        return 0;
+      }
+    }
+  }
+
+  if (dut) {
+    shell_error(sh, "no snapshot for this DUT");
+    return -ENOENT;
+  }
+
+  return 0;
+}
+
+int cmd_snapshot(const struct shell *sh, size_t argc, char *argv[]){
+  bt_addr_le_t addr;
+  int err;
+
+  if (argc < 2 || !strcmp(argv[1], "list")) {
+    snapshot_list(sh);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "persist") && argc > 2) {
+    struct snapshot_entry empty = { 0 };
+
+    if (strcmp(argv[2], "on") && strcmp(argv[2], "off")) {
+      shell_error(sh, "Usage: snapshot persist <on | off>");
+      return -EINVAL;
+    }
+
+    // write what is there now, or remove it from flash
+    persist = !strcmp(argv[2], "on");
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+      snapshot_write(persist ? &slots[i] : &empty, i);
+    }
+
+    err = settings_save_one("bleframework/snap/persist", &persist, sizeof(persist));
+    if (err) {
+      shell_error(sh, "snapshot: saving the persistence setting failed (err %d)", err);
+    }
+    snapshot_list(sh);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "drop") && argc == 3 && !strcmp(argv[2], "all")) {
+    return snapshot_drop(sh, NULL);
+  }
+
+  if ((!strcmp(argv[1], "drop") || !strcmp(argv[1], "restore")) && argc > 3) {
+    err = bt_addr_le_from_str(argv[2], argv[3], &addr);
+    if (err < 0) {
+      shell_error(sh, "Invalid peer address (err %d)", err);
+      return err;
+    }
+
+    return !strcmp(argv[1], "drop") ? snapshot_drop(sh, &addr) : snapshot_restore(sh, &addr);
+  }
+
+  // snapshot <addr> <type>: take
+  if (argc > 2) {
+    return cmd_ifa_snapshot_take(sh, argc, argv);
+  }
+
+  shell_help(sh);
+  return SHELL_CMD_HELP_PRINTED;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define SNAPSHOT_SLOTS  8
+
+int snapshot_store(const bt_addr_le_t *dut);
+int snapshot_restore_keys(const bt_addr_le_t *dut);
+int snapshot_identity(const bt_addr_le_t *dut, bt_addr_le_t *id_addr, uint8_t id_irk[16]);
+int snapshot_dut_irk(const bt_addr_le_t *dut, uint8_t irk[16]);
+int snapshot_persist(const bt_addr_le_t *dut);
+void snapshot_unpersist(const bt_addr_le_t *dut);
+
+int cmd_snapshot(const struct shell *sh, size_t argc, char *argv[]);
@@ -0,0 +1,251 @@
+#include "stats.h"
+#include "logstat.h"
+#include "output.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/timing/timing.h>
+
+/* Timestamps come from the timing API (DWT cycle counter on the nRF52), so a single sample is cycle accurate. The
+ * 32 bit counter wraps after ~67 s at 64 MHz (~33 s at 128 MHz), less than a stage 2 iteration of ifa_p can take, so a
+ * timestamp also carries the uptime in ms in its upper half: spans the counter cannot cover are measured in ms.
+ * Without the timing API (nrf52_bsim) the kernel's cycle counter is used.
+ */
+
+struct stats_hist {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t sum_us;
+  uint32_t samples[STATS_SAMPLES];  // ring of the most recent samples
+  uint32_t buckets[STATS_BUCKETS];
+};
+
+static const char *const metric_names[] = {
+  [STATS_CONNECT] = "connect",
+  [STATS_PAIRING_FEAT] = "pairing_feat",
+  [STATS_SECURITY] = "security",
+  [STATS_PAIRING] = "pairing",
+  [STATS_DISCONNECT] = "disconnect",
+  [STATS_UNPAIR] = "unpair",
+  [STATS_ID_RESET] = "id_reset",
+  [STATS_SETTINGS_LOAD] = "settings_load",
+  [STATS_STACK_RESTART] = "stack_restart",
+  [STATS_ITERATION] = "iteration",
+  [STATS_BOND_RESTORE] = "bond_restore",
+};
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+static uint32_t stats_cycles(void){
+  return (uint32_t)timing_counter_get();
+}
+
+static uint64_t stats_cycles_hz(void){
+  return timing_freq_get_mhz() * 1000000ULL;
+}
+
+static uint64_t stats_cycles_to_ns(uint32_t cycles){
+  return timing_cycles_to_ns(cycles);
+}
+#else
+static uint32_t stats_cycles(void){
+  return k_cycle_get_32();
+}
+
+static uint64_t stats_cycles_hz(void){
+  return sys_clock_hw_cycles_per_sec();
+}
+
+static uint64_t stats_cycles_to_ns(uint32_t cycles){
+  return k_cyc_to_ns_floor64(cycles);
+}
+#endif
+
+static struct stats_hist hists[STATS_METRIC_COUNT];
+static struct k_spinlock stats_lock;
+static uint32_t sorted[STATS_SAMPLES];  // scratch for the percentile, only used by the shell thread
+
+void stats_init(void){
+  static bool started;
+
+  if (started) {
+    return;
+  }
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+  timing_init();
+  timing_start();
+#endif
+  started = true;
+}
+
+stats_ts_t stats_now(void){
+  return ((uint64_t)k_uptime_get_32() << 32) | stats_cycles();
+}
+
+uint32_t stats_span_us(stats_ts_t start, stats_ts_t end){
+  uint32_t ms = (uint32_t)(end >> 32) - (uint32_t)(start >> 32);
+  uint32_t wrap_ms = (uint32_t)(BIT64(32) * 1000U / stats_cycles_hz());
+
+  if (ms >= wrap_ms / 2) {
+    return (uint32_t)MIN(ms * 1000ULL, UINT32_MAX);
+  }
+
+  return (uint32_t)(stats_cycles_to_ns((uint32_t)end - (uint32_t)start) / 1000U);
+}
+
+static uint8_t stats_bucket(uint32_t us){
+  uint8_t bucket = 0;
+
+  while (us > 1 && bucket < STATS_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+void stats_record(enum stats_metric metric, stats_ts_t start, stats_ts_t end){
+  struct stats_hist *h = &hists[metric];
+  uint32_t us = stats_span_us(start, end);
+
+  K_SPINLOCK(&stats_lock) {
+    if (h->count == 0 || us < h->min_us) {
+      h->min_us = us;
+    }
+    if (us > h->max_us) {
+      h->max_us = us;
+    }
+    h->sum_us += us;
+    h->samples[h->count % STATS_SAMPLES] = us;
+    h->buckets[stats_bucket(us)]++;
+    h->count++;
+  }
+}
+
+void stats_record_since(enum stats_metric metric, stats_ts_t start){
+  stats_record(metric, start, stats_now());
+}
+
+void stats_reset(void){
+  K_SPINLOCK(&stats_lock) {
+    memset(hists, 0, sizeof(hists));
+  }
+  logstat_reset();
+}
+
+int stats_mean(enum stats_metric metric, uint32_t *mean_us){
+  int err = -ENODATA;
+
+  K_SPINLOCK(&stats_lock) {
+    if (hists[metric].count) {
+      *mean_us = (uint32_t)(hists[metric].sum_us / hists[metric].count);
+      err = 0;
+    }
+  }
+
+  return err;
+}
+
+static int stats_cmp(const void *a, const void *b){
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void stats_print_hist(const struct shell *sh, enum stats_metric metric){
+  uint32_t buckets[STATS_BUCKETS];
+  uint32_t peak = 0;
+
+  K_SPINLOCK(&stats_lock) {
+    memcpy(buckets, hists[metric].buckets, sizeof(buckets));
+  }
+
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    peak = MAX(peak, buckets[i]);
+  }
+
+  shell_print(sh, "%s:", metric_names[metric]);
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    char bar[41];
+    uint32_t len;
+
+    if (!buckets[i]) {
+      continue;
+    }
+
+    len = DIV_ROUND_UP(buckets[i] * (sizeof(bar) - 1), peak);
+    memset(bar, '#', len);
+    bar[len] = '\0';
+    shell_print(sh, "  < %10u us %6u %s", 1U << (i + 1), buckets[i], bar);
+  }
+}
+
+// one record per metric row, all times in us
+static void stats_output(enum stats_metric metric, uint32_t count, uint32_t min_us, uint32_t mean_us, uint32_t p95_us,
+                         uint32_t max_us){
+  struct output_field fields[] = {
+    OUTPUT_STR("metric", metric_names[metric]),
+    OUTPUT_NUM("n", count),
+    OUTPUT_NUM("min", min_us),
+    OUTPUT_NUM("mean", mean_us),
+    OUTPUT_NUM("p95", p95_us),
+    OUTPUT_NUM("max", max_us),
+  };
+
+  output_record("stat", k_uptime_get_32(), worker_current_id(), fields, ARRAY_SIZE(fields));
+}
+
+int cmd_stats(const struct shell *sh, size_t argc, char *argv[]){
+  uint32_t count, kept, min_us, max_us, p95_us;
+  uint64_t sum_us;
+
+  if (argc > 1 && !strcmp(argv[1], "reset")) {
+    stats_reset();
+    shell_print(sh, "stats cleared");
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "hist")) {
+    for (int m = 0; m < STATS_METRIC_COUNT; m++) {
+      if (argc < 3 || !strcmp(argv[2], metric_names[m])) {
+        stats_print_hist(sh, m);
+      }
+    }
+    return 0;
+  }
+
+  if (!output_structured()) {
+    shell_print(sh, "%-14s %6s %10s %10s %10s %10s  (us)", "step", "n", "min", "mean", "p95", "max");
+  }
+
+  for (int m = 0; m < STATS_METRIC_COUNT; m++) {
+    K_SPINLOCK(&stats_lock) {
+      count = hists[m].count;
+      min_us = hists[m].min_us;
+      max_us = hists[m].max_us;
+      sum_us = hists[m].sum_us;
+      kept = MIN(count, STATS_SAMPLES);
+      memcpy(sorted, hists[m].samples, kept * sizeof(sorted[0]));
+    }
+
+    if (!count) {
+      continue;
+    }
+
+    qsort(sorted, kept, sizeof(sorted[0]), stats_cmp);
+    p95_us = sorted[(kept * 95 - 1) / 100];
+
+    if (output_structured()) {
+      stats_output(m, count, min_us, (uint32_t)(sum_us / count), p95_us, max_us);
+    } else {
+      shell_print(sh, "%-14s %6u %10u %10u %10u %10u", metric_names[m], count, min_us, (uint32_t)(sum_us / count),
+                  p95_us, max_us);
+    }
+  }
+
+  logstat_print(sh);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+/* Latencies measured between two transitions of the IFA/pairing path, see stats.c for the exact start and end points */
+enum stats_metric {
+  STATS_CONNECT,           // connect requested -> connected()
+  STATS_PAIRING_FEAT,      // security requested -> pairing_accept()
+  STATS_SECURITY,          // security requested -> security_changed()
+  STATS_PAIRING,           // security requested -> pairing_complete()
+  STATS_DISCONNECT,        // disconnect requested -> disconnected()
+  STATS_UNPAIR,            // bt_unpair()
+  STATS_ID_RESET,          // bt_id_reset() incl. rpa invalidation
+  STATS_SETTINGS_LOAD,     // settings_load()
+  STATS_STACK_RESTART,     // bt_disable() + bt_enable()
+  STATS_ITERATION,         // one stage 2 iteration
+  STATS_BOND_RESTORE,      // stage 3 in-place restore: keys verified and re-added to the resolving list
+  STATS_METRIC_COUNT,
+};
+
+/* samples kept per metric for the percentile; min/mean/max cover all samples since the last reset */
+#define STATS_SAMPLES  256
+#define STATS_BUCKETS  25     // log2 buckets from 1 us up to 16 s
+
+typedef uint64_t stats_ts_t;    // uptime ms << 32 | cycle counter, see stats.c
+
+void stats_init(void);
+stats_ts_t stats_now(void);
+uint32_t stats_span_us(stats_ts_t start, stats_ts_t end);
+void stats_record(enum stats_metric metric, stats_ts_t start, stats_ts_t end);
+void stats_record_since(enum stats_metric metric, stats_ts_t start);
+void stats_reset(void);
+int stats_mean(enum stats_metric metric, uint32_t *mean_us);
+
+int cmd_stats(const struct shell *sh, size_t argc, char *argv[]);
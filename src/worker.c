@@ -0,0 +1,165 @@
+#include "worker.h"
+#include "ifa.h"
+#include "main.h"
+#include "output.h"
+#include "script.h"
+
+/* The worker thread owns every Bluetooth test sequence. Shell handlers only parse and enqueue, so the console stays
+ * responsive (status, bonds, abort, ...) while a campaign runs, and several jobs can be queued back to back.
+ */
+
+K_MSGQ_DEFINE(worker_q, sizeof(struct worker_job), WORKER_QUEUE_LEN, 4);
+
+static struct k_spinlock worker_lock;
+static struct worker_job current;
+static bool current_valid;
+static int64_t current_start;
+static uint32_t next_id = 1;
+static uint32_t pending;         // queued or running
+
+static void worker_report(const struct worker_job *job, bool done, int err, int64_t duration_ms){
+  struct output_field fields[] = {
+    OUTPUT_STR("name", job->name),
+    OUTPUT_NUM("err", err),
+    OUTPUT_NUM("ms", duration_ms),
+  };
+
+  if (output_structured()) {
+    output_record(done ? "job_end" : "job_start", k_uptime_get_32(), job->id, fields, done ? ARRAY_SIZE(fields) : 1);
+  } else if (done) {
+    shell_print(shell, "job #%u %s finished with %d after %lld ms", job->id, job->name, err, duration_ms);
+  } else {
+    shell_print(shell, "job #%u %s started", job->id, job->name);
+  }
+}
+
+static void worker_thread(void *p1, void *p2, void *p3){
+  struct worker_job job;
+  int64_t start;
+  int err;
+
+  for (;;) {
+    k_msgq_get(&worker_q, &job, K_FOREVER);
+
+    start = k_uptime_get();
+    K_SPINLOCK(&worker_lock) {
+      current = job;
+      current_valid = true;
+      current_start = start;
+    }
+
+    worker_report(&job, false, 0, 0);
+    err = job.run(&job);
+    worker_report(&job, true, err, k_uptime_get() - start);
+
+    K_SPINLOCK(&worker_lock) {
+      current_valid = false;
+      pending--;
+    }
+    script_job_done(err);
+  }
+}
+
+K_THREAD_DEFINE(worker_tid, WORKER_STACK_SIZE, worker_thread, NULL, NULL, NULL, WORKER_PRIORITY, 0, 0);
+
+int worker_submit(const struct shell *sh, struct worker_job *job){
+  uint32_t queued;
+  int err;
+
+  queued = k_msgq_num_used_get(&worker_q) + (worker_busy() ? 1 : 0);
+
+  K_SPINLOCK(&worker_lock) {
+    job->id = next_id++;
+    pending++;
+  }
+
+  err = k_msgq_put(&worker_q, job, K_NO_WAIT);
+  if (err) {
+    K_SPINLOCK(&worker_lock) {
+      pending--;
+    }
+    shell_error(sh, "job queue full (%d jobs), %s not queued", WORKER_QUEUE_LEN, job->name);
+    return -ENOMEM;
+  }
+
+  shell_print(sh, "job #%u %s queued (%u ahead)", job->id, job->name, queued);
+  return 0;
+}
+
+// drops all jobs that have not started yet
+int worker_purge(void){
+  int dropped;
+
+  K_SPINLOCK(&worker_lock) {
+    dropped = k_msgq_num_used_get(&worker_q);
+    k_msgq_purge(&worker_q);
+    pending -= dropped;
+  }
+
+  return dropped;
+}
+
+bool worker_busy(void){
+  bool busy;
+
+  K_SPINLOCK(&worker_lock) {
+    busy = current_valid;
+  }
+
+  return busy;
+}
+
+// every submitted job has finished (or was purged)
+bool worker_idle(void){
+  bool idle;
+
+  K_SPINLOCK(&worker_lock) {
+    idle = !pending;
+  }
+
+  return idle;
+}
+
+// id of the running job, 0 when idle
+uint32_t worker_current_id(void){
+  uint32_t id = 0;
+
+  K_SPINLOCK(&worker_lock) {
+    if (current_valid) {
+      id = current.id;
+    }
+  }
+
+  return id;
+}
+
+int cmd_status(const struct shell *sh, size_t argc, char *argv[]){
+  struct ifa_status st;
+  struct worker_job job;
+  int64_t start;
+  bool busy;
+
+  K_SPINLOCK(&worker_lock) {
+    busy = current_valid;
+    job = current;
+    start = current_start;
+  }
+
+  if (!busy) {
+    shell_print(sh, "idle, %u jobs queued", k_msgq_num_used_get(&worker_q));
+    return 0;
+  }
+
+  shell_print(sh, "job #%u %s running for %lld ms, %u jobs queued", job.id, job.name, k_uptime_get() - start,
+              k_msgq_num_used_get(&worker_q));
+
+  for (uint8_t i = 0; ifa_get_status(i, &st) == 0; i++) {
+    char addr[BT_ADDR_LE_STR_LEN];
+
+    bt_addr_le_to_str(&st.target, addr, sizeof(addr));
+    shell_print(sh, "%s: stage %s, step %s (%s), iteration %d/%d, attempt %u", addr, st.stage, st.step, st.phase,
+                st.iter, st.n, st.attempt);
+  }
+
+  return 0;
+}
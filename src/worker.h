@@ -0,0 +1,29 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/shell/shell.h>
+
+#define WORKER_QUEUE_LEN    8
+#define WORKER_STACK_SIZE   4096
+#define WORKER_PRIORITY     K_PRIO_PREEMPT(7)
+
+/* A queued test sequence. The shell handler fills in the parsed arguments, the worker thread calls run() with them. */
+struct worker_job {
+  const char *name;
+  int (*run)(const struct worker_job *job);
+  bt_addr_le_t addr;
+  int n;
+  uint8_t profile;           // enum conn_profile_id of the connections the job initiates
+  uint8_t range[2];          // first and last value of a sweep
+  uint32_t set;              // bit mask of the values of a grid job
+  uint32_t id;               // assigned by worker_submit()
+};
+
+int worker_submit(const struct shell *sh, struct worker_job *job);
+int worker_purge(void);
+bool worker_busy(void);
+bool worker_idle(void);
+uint32_t worker_current_id(void);
+
+int cmd_status(const struct shell *sh, size_t argc, char *argv[]);